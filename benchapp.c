@@ -0,0 +1,505 @@
+/* Allocator benchmark driver. Replays the same pre-generated traces
+ * against the memory manager and against glibc calloc/free, each run
+ * in its own forked process so RSS figures do not leak between them.
+ *
+ * Build: gcc -O2 benchapp.c mm.c gluethread/glthread.c -o benchapp -lpthread
+ * Usage: benchapp [churn|prodcons|larson|frag|all] [-t threads] [-n ops] [-s seed]
+ *                 [-H huge page mode, 0 none, 1 transparent, 2 explicit]
+ */
+
+#include "uapi_mm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+typedef struct bench_16_ { char data[16]; } bench_16_t;
+typedef struct bench_24_ { char data[24]; } bench_24_t;
+typedef struct bench_48_ { char data[48]; } bench_48_t;
+typedef struct bench_64_ { char data[64]; } bench_64_t;
+typedef struct bench_100_ { char data[100]; } bench_100_t;
+typedef struct bench_128_ { char data[128]; } bench_128_t;
+typedef struct bench_256_ { char data[256]; } bench_256_t;
+typedef struct bench_700_ { char data[700]; } bench_700_t;
+typedef struct bench_1500_ { char data[1500]; } bench_1500_t;
+typedef struct bench_4000_ { char data[4000]; } bench_4000_t;
+typedef struct bench_10000_ { char data[10000]; } bench_10000_t;
+
+#define BENCH_CLASSES 11
+#define BENCH_MAX_THREADS 64
+#define BENCH_LIVE_SLOTS 4096
+/* One op in this many is timed individually for the latency figures */
+#define BENCH_SAMPLE_EVERY 16
+#define BENCH_RING_SIZE 1024
+/* The frag live set is capped so the default op count stays in memory */
+#define BENCH_FRAG_OBJECTS 100000
+
+static const uint32_t bench_class_size[BENCH_CLASSES] = {
+    16, 24, 48, 64, 100, 128, 256, 700, 1500, 4000, 10000};
+
+/* Weights skewed towards small objects, like most real traces */
+static const uint32_t bench_class_weight[BENCH_CLASSES] = {
+    20, 20, 15, 12, 10, 8, 6, 4, 2, 2, 1};
+
+static mm_family_handle_t bench_family[BENCH_CLASSES];
+
+typedef enum
+{
+    BENCH_MM,
+    BENCH_GLIBC
+} bench_backend_t;
+
+static bench_backend_t backend;
+
+typedef struct bench_trace_
+{
+    uint32_t *ops; /* slot << 8 | size class */
+    uint64_t n_ops;
+} bench_trace_t;
+
+typedef struct bench_thread_
+{
+    pthread_t tid;
+    bench_trace_t trace;
+    uint64_t *samples;
+    uint64_t n_samples;
+    uint64_t live_bytes;
+    void *peer_ring;
+} bench_thread_t;
+
+typedef struct bench_result_
+{
+    double ops_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t rss_kib;
+    uint64_t live_kib;
+} bench_result_t;
+
+typedef struct bench_config_
+{
+    int threads;
+    uint64_t ops;
+    uint64_t seed;
+    int huge_page_mode;
+} bench_config_t;
+
+static bench_config_t config = {4, 1000000, 42, MM_HUGE_PAGES_NONE};
+
+static inline uint64_t
+bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t
+bench_rand(uint64_t *state)
+{
+    /* xorshift64*, deterministic for a given seed on every platform */
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ull;
+}
+
+static uint32_t
+bench_pick_class(uint64_t *state)
+{
+    uint32_t total = 0, i, r;
+    for (i = 0; i < BENCH_CLASSES; i++)
+        total += bench_class_weight[i];
+    r = (uint32_t)(bench_rand(state) % total);
+    for (i = 0; i < BENCH_CLASSES; i++)
+    {
+        if (r < bench_class_weight[i])
+            return i;
+        r -= bench_class_weight[i];
+    }
+    return 0;
+}
+
+static inline void *
+bench_alloc(uint32_t size_class)
+{
+    if (backend == BENCH_MM)
+        return xcalloc_by_handle(bench_family[size_class], 1);
+    return calloc(1, bench_class_size[size_class]);
+}
+
+static inline void
+bench_free(void *ptr)
+{
+    if (backend == BENCH_MM)
+        xfree(ptr);
+    else
+        free(ptr);
+}
+
+static uint64_t
+bench_rss_kib(void)
+{
+    unsigned long size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * (uint64_t)getpagesize() / 1024;
+}
+
+static void
+bench_register_families(void)
+{
+    int i = 0;
+    MM_REG_STRUCT(bench_16_t);
+    MM_REG_STRUCT(bench_24_t);
+    MM_REG_STRUCT(bench_48_t);
+    MM_REG_STRUCT(bench_64_t);
+    MM_REG_STRUCT(bench_100_t);
+    MM_REG_STRUCT(bench_128_t);
+    MM_REG_STRUCT(bench_256_t);
+    MM_REG_STRUCT(bench_700_t);
+    MM_REG_STRUCT(bench_1500_t);
+    MM_REG_STRUCT(bench_4000_t);
+    MM_REG_STRUCT(bench_10000_t);
+    bench_family[i++] = mm_get_family_handle("bench_16_t");
+    bench_family[i++] = mm_get_family_handle("bench_24_t");
+    bench_family[i++] = mm_get_family_handle("bench_48_t");
+    bench_family[i++] = mm_get_family_handle("bench_64_t");
+    bench_family[i++] = mm_get_family_handle("bench_100_t");
+    bench_family[i++] = mm_get_family_handle("bench_128_t");
+    bench_family[i++] = mm_get_family_handle("bench_256_t");
+    bench_family[i++] = mm_get_family_handle("bench_700_t");
+    bench_family[i++] = mm_get_family_handle("bench_1500_t");
+    bench_family[i++] = mm_get_family_handle("bench_4000_t");
+    bench_family[i++] = mm_get_family_handle("bench_10000_t");
+}
+
+/* Traces */
+
+static void
+bench_trace_build(bench_trace_t *trace, uint64_t n_ops, uint64_t seed, int single_class)
+{
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1, i;
+    trace->n_ops = n_ops;
+    trace->ops = malloc(sizeof(uint32_t) * trace->n_ops);
+    for (i = 0; i < trace->n_ops; i++)
+    {
+        uint32_t slot = (uint32_t)(bench_rand(&state) % BENCH_LIVE_SLOTS);
+        uint32_t size_class = single_class >= 0 ? (uint32_t)single_class : bench_pick_class(&state);
+        trace->ops[i] = slot << 8 | size_class;
+    }
+}
+
+/* Replaces a random slot of a private live set on every op. churn keeps
+ * one size class, larson mixes all of them */
+static void *
+bench_replace_worker(void *arg)
+{
+    bench_thread_t *thread = arg;
+    void **slots = calloc(BENCH_LIVE_SLOTS, sizeof(void *));
+    uint32_t *slot_class = calloc(BENCH_LIVE_SLOTS, sizeof(uint32_t));
+    uint64_t i;
+    for (i = 0; i < thread->trace.n_ops; i++)
+    {
+        uint32_t slot = thread->trace.ops[i] >> 8;
+        uint32_t size_class = thread->trace.ops[i] & 0xff;
+        uint64_t start = 0;
+        if (i % BENCH_SAMPLE_EVERY == 0)
+            start = bench_now_ns();
+        if (slots[slot])
+        {
+            bench_free(slots[slot]);
+            thread->live_bytes -= bench_class_size[slot_class[slot]];
+        }
+        slots[slot] = bench_alloc(size_class);
+        if (start)
+            thread->samples[thread->n_samples++] = bench_now_ns() - start;
+        *(char *)slots[slot] = 1;
+        slot_class[slot] = size_class;
+        thread->live_bytes += bench_class_size[size_class];
+    }
+    /* The live set stays allocated so the RSS read after the run
+     * includes it */
+    free(slot_class);
+    return NULL;
+}
+
+/* Single producer single consumer ring, every object is freed by a
+ * thread other than the one that allocated it */
+typedef struct bench_ring_
+{
+    void *entries[BENCH_RING_SIZE];
+    volatile uint64_t head __attribute__((aligned(64)));
+    volatile uint64_t tail __attribute__((aligned(64)));
+} bench_ring_t;
+
+static void *
+bench_producer_worker(void *arg)
+{
+    bench_thread_t *thread = arg;
+    bench_ring_t *ring = thread->peer_ring;
+    uint64_t i;
+    for (i = 0; i < thread->trace.n_ops; i++)
+    {
+        uint32_t size_class = thread->trace.ops[i] & 0xff;
+        uint64_t start = 0;
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == BENCH_RING_SIZE)
+            sched_yield();
+        if (i % BENCH_SAMPLE_EVERY == 0)
+            start = bench_now_ns();
+        void *ptr = bench_alloc(size_class);
+        if (start)
+            thread->samples[thread->n_samples++] = bench_now_ns() - start;
+        *(char *)ptr = 1;
+        ring->entries[ring->head % BENCH_RING_SIZE] = ptr;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *
+bench_consumer_worker(void *arg)
+{
+    bench_thread_t *thread = arg;
+    bench_ring_t *ring = thread->peer_ring;
+    uint64_t i;
+    for (i = 0; i < thread->trace.n_ops; i++)
+    {
+        uint64_t start = 0;
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+            sched_yield();
+        void *ptr = ring->entries[ring->tail % BENCH_RING_SIZE];
+        if (i % BENCH_SAMPLE_EVERY == 0)
+            start = bench_now_ns();
+        bench_free(ptr);
+        if (start)
+            thread->samples[thread->n_samples++] = bench_now_ns() - start;
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Fills the live set with mixed sizes, frees every other object and
+ * refills with differently sized ones, leaving holes the allocator has
+ * to reuse or waste */
+static void *
+bench_frag_worker(void *arg)
+{
+    bench_thread_t *thread = arg;
+    uint64_t n = thread->trace.n_ops, i;
+    void **objects = calloc(n, sizeof(void *));
+    uint32_t *object_class = calloc(n, sizeof(uint32_t));
+    uint32_t pass;
+    for (pass = 0; pass < 3; pass++)
+    {
+        for (i = 0; i < n; i++)
+        {
+            uint64_t start = 0;
+            if (pass && (i & 1) == (pass & 1))
+                continue;
+            if (objects[i])
+            {
+                bench_free(objects[i]);
+                thread->live_bytes -= bench_class_size[object_class[i]];
+            }
+            object_class[i] = ((thread->trace.ops[i] & 0xff) + pass) % BENCH_CLASSES;
+            if (i % BENCH_SAMPLE_EVERY == 0)
+                start = bench_now_ns();
+            objects[i] = bench_alloc(object_class[i]);
+            if (start)
+                thread->samples[thread->n_samples++] = bench_now_ns() - start;
+            *(char *)objects[i] = 1;
+            thread->live_bytes += bench_class_size[object_class[i]];
+        }
+    }
+    free(object_class);
+    return NULL;
+}
+
+/* Running a workload */
+
+static int
+bench_compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+bench_run_workload(const char *workload, bench_result_t *result)
+{
+    bench_thread_t threads[BENCH_MAX_THREADS];
+    bench_ring_t *rings = NULL;
+    void *(*worker)(void *) = bench_replace_worker;
+    int n_threads = config.threads, i;
+    uint64_t n_ops = config.ops;
+    uint64_t total_ops = 0, n_samples = 0, live_bytes = 0, rss_before, start, elapsed;
+
+    if (strcmp(workload, "prodcons") == 0)
+    {
+        if (n_threads < 2)
+            n_threads = 2;
+        n_threads &= ~1;
+        rings = calloc(n_threads / 2, sizeof(bench_ring_t));
+    }
+    else if (strcmp(workload, "frag") == 0)
+    {
+        worker = bench_frag_worker;
+        n_threads = 1;
+        if (n_ops > BENCH_FRAG_OBJECTS)
+            n_ops = BENCH_FRAG_OBJECTS;
+    }
+
+    memset(threads, 0, sizeof(threads));
+    for (i = 0; i < n_threads; i++)
+    {
+        bench_thread_t *thread = &threads[i];
+        /* A consumer replays its producer's trace so the op counts match */
+        uint64_t trace_seed = config.seed + (rings ? (uint64_t)(i / 2) : (uint64_t)i);
+        bench_trace_build(&thread->trace, n_ops, trace_seed, strcmp(workload, "churn") == 0 ? 3 : -1);
+        thread->samples = malloc(sizeof(uint64_t) * (thread->trace.n_ops * 3 / BENCH_SAMPLE_EVERY + 3));
+        if (rings)
+            thread->peer_ring = &rings[i / 2];
+    }
+
+    rss_before = bench_rss_kib();
+    start = bench_now_ns();
+    for (i = 0; i < n_threads; i++)
+    {
+        if (rings)
+            worker = (i & 1) ? bench_consumer_worker : bench_producer_worker;
+        pthread_create(&threads[i].tid, NULL, worker, &threads[i]);
+    }
+    for (i = 0; i < n_threads; i++)
+        pthread_join(threads[i].tid, NULL);
+    elapsed = bench_now_ns() - start;
+
+    for (i = 0; i < n_threads; i++)
+    {
+        total_ops += worker == bench_frag_worker ? threads[i].trace.n_ops * 2 : threads[i].trace.n_ops;
+        n_samples += threads[i].n_samples;
+        live_bytes += threads[i].live_bytes;
+    }
+    uint64_t *samples = malloc(sizeof(uint64_t) * (n_samples + 1));
+    n_samples = 0;
+    for (i = 0; i < n_threads; i++)
+    {
+        memcpy(samples + n_samples, threads[i].samples, sizeof(uint64_t) * threads[i].n_samples);
+        n_samples += threads[i].n_samples;
+    }
+    qsort(samples, n_samples, sizeof(uint64_t), bench_compare_u64);
+
+    result->ops_per_sec = elapsed ? total_ops * 1e9 / elapsed : 0;
+    result->p50_ns = n_samples ? samples[n_samples / 2] : 0;
+    result->p99_ns = n_samples ? samples[n_samples * 99 / 100] : 0;
+    result->rss_kib = bench_rss_kib() - rss_before;
+    result->live_kib = live_bytes / 1024;
+}
+
+/* Runs the workload in a child so each backend starts from a fresh
+ * address space */
+static int
+bench_run_isolated(const char *workload, bench_backend_t which, bench_result_t *result)
+{
+    int fds[2], status = 0;
+    pid_t pid;
+    if (pipe(fds) < 0)
+        return -1;
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        close(fds[0]);
+        backend = which;
+        bench_run_workload(workload, result);
+        if (write(fds[1], result, sizeof(*result)) != sizeof(*result))
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    return got == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void
+bench_report(const char *workload, const char *name, bench_result_t *result)
+{
+    double frag = result->live_kib ? (double)result->rss_kib / result->live_kib : 0;
+    printf("%-9s %-6s %12.0f %8lu %8lu %10lu %10lu %6.2f\n", workload, name,
+           result->ops_per_sec, (unsigned long)result->p50_ns, (unsigned long)result->p99_ns,
+           (unsigned long)result->rss_kib, (unsigned long)result->live_kib, frag);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *workloads[] = {"churn", "prodcons", "larson", "frag"};
+    const char *selected = "all";
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "t:n:s:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'n':
+            config.ops = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            config.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'H':
+            config.huge_page_mode = atoi(optarg);
+            break;
+        default:
+            printf("Usage: %s [churn|prodcons|larson|frag|all] [-t threads] [-n ops] [-s seed] [-H 0|1|2]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        selected = argv[optind];
+    if (config.threads < 1 || config.threads > BENCH_MAX_THREADS)
+    {
+        printf("Error: thread count must be between 1 and %d\n", BENCH_MAX_THREADS);
+        return 1;
+    }
+
+    mm_init();
+    mm_set_huge_pages((mm_huge_page_mode_t)config.huge_page_mode);
+    bench_register_families();
+
+    printf("threads %d  ops/thread %lu  seed %lu  huge pages %d\n", config.threads,
+           (unsigned long)config.ops, (unsigned long)config.seed, config.huge_page_mode);
+    printf("%-9s %-6s %12s %8s %8s %10s %10s %6s\n", "workload", "alloc",
+           "ops/sec", "p50(ns)", "p99(ns)", "rss(KiB)", "live(KiB)", "frag");
+
+    for (i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++)
+    {
+        bench_result_t result;
+        if (strcmp(selected, "all") != 0 && strcmp(selected, workloads[i]) != 0)
+            continue;
+        if (bench_run_isolated(workloads[i], BENCH_MM, &result) == 0)
+            bench_report(workloads[i], "mm", &result);
+        else
+            printf("Error: %s run failed for mm\n", workloads[i]);
+        if (bench_run_isolated(workloads[i], BENCH_GLIBC, &result) == 0)
+            bench_report(workloads[i], "glibc", &result);
+        else
+            printf("Error: %s run failed for glibc\n", workloads[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,1010 @@
+/* Behavior checks of the memory manager. Each failed check is printed
+ * with its line, the exit status is non-zero if any failed.
+ *
+ * Build: gcc -O1 checkapp.c mm.c gluethread/glthread.c -o checkapp -lpthread
+ * Usage: checkapp
+ *
+ * Debug mode has to be set before any family is registered, its checks
+ * run in a second process started as: checkapp debug
+ */
+
+#include "uapi_mm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+
+typedef struct check_small_ { char data[40]; } check_small_t;
+typedef struct check_page_ { char data[3000]; } check_page_t;
+typedef struct check_wide_ { char data[10000]; } check_wide_t;
+typedef struct check_row_ { char data[9000]; } check_row_t;
+typedef struct check_large_ { char data[100000]; } check_large_t;
+typedef struct check_stats_ { char data[500]; } check_stats_t;
+typedef struct check_grown_ { char data[4096]; } check_grown_t;
+typedef struct check_aligned_ { char data[72]; } check_aligned_t;
+typedef struct check_shared_a_ { char data[36]; } check_shared_a_t;
+typedef struct check_shared_b_ { char data[40]; } check_shared_b_t;
+typedef struct check_shm_node_ { uint64_t next; int id; char data[100]; } check_shm_node_t;
+typedef struct check_moved_ { int id; char data[196]; } check_moved_t;
+typedef struct check_explicit_ { char data[200]; } check_explicit_t;
+typedef struct check_transparent_ { char data[200]; } check_transparent_t;
+typedef struct check_byte_ { char data[1]; } check_byte_t;
+
+static int check_failures;
+
+#define CHECK(condition)                                                     \
+    do                                                                       \
+    {                                                                        \
+        if (!(condition))                                                    \
+        {                                                                    \
+            printf("FAILED %s:%d %s\n", __FUNCTION__, __LINE__, #condition); \
+            check_failures++;                                                \
+        }                                                                    \
+    } while (0)
+
+static int
+check_is_zero(const void *app_data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)app_data;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        if (bytes[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Whether the first system page lying wholly inside the object has never
+ * been touched, which it would have been by clearing the object */
+static int
+check_is_untouched(void *app_data, size_t size)
+{
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t page = ((uintptr_t)app_data + page_size - 1) & ~(page_size - 1);
+    unsigned char resident = 1;
+    if (page + page_size > (uintptr_t)app_data + size)
+        return 0;
+    if (mincore((void *)page, page_size, &resident))
+        return 0;
+    return !(resident & 1);
+}
+
+static void
+check_registration(void)
+{
+    mm_family_handle_t small = MM_REG_STRUCT(check_small_t);
+    CHECK(small != NULL);
+    CHECK(MM_REG_STRUCT(check_small_t) == NULL);
+    CHECK(mm_get_family_handle("check_small_t") == small);
+    CHECK(mm_get_family_handle("check_missing_t") == NULL);
+    /* Allocating through the handle of an unregistered struct */
+    CHECK(xcalloc_by_handle(mm_get_family_handle("check_missing_t"), 1) == NULL);
+    CHECK(xmalloc_by_handle(NULL, 1) == NULL);
+    CHECK(xcalloc_aligned_by_handle(NULL, 1, 64) == NULL);
+    CHECK(xcalloc_batch_by_handle(NULL, 4, NULL) == 0);
+    CHECK(MM_REG_STRUCT(check_page_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_large_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_wide_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_row_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_stats_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_moved_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_grown_t) != NULL);
+    CHECK(MM_REG_STRUCT_ALIGNED(check_aligned_t, 64) != NULL);
+    CHECK(MM_REG_STRUCT_SHARED(check_shared_a_t) != NULL);
+    CHECK(MM_REG_STRUCT_SHARED(check_shared_b_t) != NULL);
+}
+
+/* A table registered at once is found by name, duplicates get no handle */
+static void
+check_registration_table(void)
+{
+    static char names[200][32];
+    mm_family_spec_t specs[201];
+    mm_family_handle_t handles[201];
+    uint32_t i;
+    for (i = 0; i < 200; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "check_table_%u", i);
+        specs[i].struct_name = names[i];
+        specs[i].struct_size = 8 * (i + 1);
+    }
+    specs[200] = specs[7];
+    CHECK(mm_instantiate_page_families(specs, 201, handles) == 200);
+    CHECK(handles[200] == NULL);
+    for (i = 0; i < 200; i++)
+        CHECK(handles[i] && mm_get_family_handle(names[i]) == handles[i]);
+}
+
+/* Unit counts below one and objects too large to map are refused */
+static void
+check_unit_counts(void)
+{
+    CHECK(XMALLOC(-1, check_small_t) == NULL);
+    CHECK(XCALLOC(0, check_small_t) == NULL);
+    CHECK(XCALLOC(-1, check_large_t) == NULL);
+    CHECK(XMALLOC(INT_MAX, check_large_t) == NULL);
+    CHECK(xcalloc_aligned("check_page_t", -1, 64) == NULL);
+}
+
+/* Objects carved from fresh pages are known zero, xcalloc leaves them be */
+static void
+check_fresh_pages_not_cleared(void)
+{
+    check_wide_t *wide = XCALLOC(1, check_wide_t);
+    check_page_t *pages = XCALLOC(4, check_page_t);
+    /* Before reading them back, which maps the shared zero page */
+    CHECK(wide && check_is_untouched(wide, sizeof(*wide)));
+    CHECK(pages && check_is_untouched(pages, 4 * sizeof(*pages)));
+    CHECK(wide && check_is_zero(wide, sizeof(*wide)));
+    CHECK(pages && check_is_zero(pages, 4 * sizeof(*pages)));
+    XFREE(wide);
+    XFREE(pages);
+}
+
+static void
+check_batches(void)
+{
+    mm_family_handle_t rows = MM_FAMILY_HANDLE(check_row_t);
+    mm_family_stats_t stats;
+    void *objects[6], *kept = NULL;
+    int i, count;
+    /* Spans parked by the checks before are not known zero, map fresh ones */
+    mm_trim_page_reserve();
+    count = XCALLOC_BATCH(6, check_row_t, objects);
+    CHECK(count == 6);
+    for (i = 0; i < count; i++)
+        CHECK(check_is_untouched(objects[i], sizeof(check_row_t)));
+    for (i = 0; i < count; i++)
+    {
+        CHECK(check_is_zero(objects[i], sizeof(check_row_t)));
+        memset(objects[i], 0xa5, sizeof(check_row_t));
+    }
+    /* Freed neighbours merge, leaving the free space around the kept one */
+    kept = objects[2];
+    objects[2] = objects[count - 1];
+    XFREE_BATCH(objects, count - 1);
+    mm_get_family_stats(rows, &stats);
+    CHECK(stats.objects_allocated == 1 && stats.free_blocks == 2);
+    XFREE_BATCH(&kept, 1);
+    mm_get_family_stats(rows, &stats);
+    CHECK(stats.objects_allocated == 0 && stats.pages_in_use == 0);
+
+    count = XCALLOC_BATCH(6, check_row_t, objects);
+    for (i = 0; i < count; i++)
+        CHECK(check_is_zero(objects[i], sizeof(check_row_t)));
+    XFREE_BATCH(objects, count);
+}
+
+/* Freed memory handed out again by xcalloc must read as zero */
+static void
+check_xcalloc_zeroes(void)
+{
+    void *objects[200];
+    int i;
+    for (i = 0; i < 200; i++)
+    {
+        objects[i] = XCALLOC(1 + i % 3, check_small_t);
+        CHECK(objects[i] && check_is_zero(objects[i], sizeof(check_small_t) * (1 + i % 3)));
+        memset(objects[i], 0xa5, sizeof(check_small_t) * (1 + i % 3));
+    }
+    for (i = 0; i < 200; i++)
+        XFREE(objects[i]);
+    for (i = 0; i < 200; i++)
+    {
+        objects[i] = XCALLOC(1 + i % 3, check_small_t);
+        CHECK(objects[i] && check_is_zero(objects[i], sizeof(check_small_t) * (1 + i % 3)));
+    }
+    for (i = 0; i < 200; i++)
+        XFREE(objects[i]);
+
+    check_large_t *large = XCALLOC(1, check_large_t);
+    CHECK(large && check_is_zero(large, sizeof(*large)));
+    memset(large, 0xa5, sizeof(*large));
+    XFREE(large);
+    large = XCALLOC(1, check_large_t);
+    CHECK(large && check_is_zero(large, sizeof(*large)));
+    XFREE(large);
+}
+
+/* Live objects never overlap and keep what was written to them */
+static void
+check_object_contents(void)
+{
+    check_small_t *objects[500];
+    int i;
+    for (i = 0; i < 500; i++)
+    {
+        objects[i] = XMALLOC(1, check_small_t);
+        CHECK(objects[i] != NULL);
+        memset(objects[i], i & 0xff, sizeof(check_small_t));
+    }
+    for (i = 0; i < 500; i += 2)
+        XFREE(objects[i]);
+    for (i = 0; i < 500; i += 2)
+    {
+        objects[i] = XMALLOC(1, check_small_t);
+        memset(objects[i], i & 0xff, sizeof(check_small_t));
+    }
+    for (i = 0; i < 500; i++)
+    {
+        CHECK(objects[i]->data[0] == (char)(i & 0xff) && objects[i]->data[39] == (char)(i & 0xff));
+        XFREE(objects[i]);
+    }
+}
+
+/* Pairs of units skip the thread cache, so the counters follow each free */
+static void
+check_stats(void)
+{
+    mm_family_handle_t family = MM_FAMILY_HANDLE(check_stats_t);
+    mm_family_stats_t stats;
+    check_stats_t *objects[200];
+    uint64_t first_pages, largest;
+    int i, count;
+
+    objects[0] = XMALLOC(2, check_stats_t);
+    CHECK(mm_get_family_stats(family, &stats) == 0);
+    CHECK(stats.objects_allocated == 1 && stats.bytes_requested == 2 * sizeof(check_stats_t));
+    CHECK(stats.free_blocks == 1 && stats.largest_free_block == stats.bytes_free && stats.external_frag == 0);
+    first_pages = stats.pages_in_use;
+    largest = stats.largest_free_block;
+
+    /* The largest block shrinks with each object carved from it */
+    for (count = 1; count < 200; count++)
+    {
+        objects[count] = XMALLOC(2, check_stats_t);
+        mm_get_family_stats(family, &stats);
+        if (stats.pages_in_use != first_pages)
+            break;
+        CHECK(stats.largest_free_block < largest);
+        largest = stats.largest_free_block;
+    }
+    CHECK(count < 200);
+    /* Holes left on the first page are found once its tail is gone */
+    XFREE(objects[count]);
+    objects[count] = NULL;
+    for (i = 1; i < count; i += 2)
+    {
+        XFREE(objects[i]);
+        objects[i] = NULL;
+    }
+    mm_get_family_stats(family, &stats);
+    CHECK(stats.largest_free_block >= 2 * sizeof(check_stats_t) && stats.largest_free_block < 3 * sizeof(check_stats_t));
+    CHECK(stats.free_blocks >= (uint64_t)count / 2);
+    CHECK(stats.external_frag > 0);
+
+    for (i = 0; i < count; i++)
+    {
+        if (objects[i])
+            XFREE(objects[i]);
+    }
+    mm_get_family_stats(family, &stats);
+    CHECK(stats.objects_allocated == 0 && stats.pages_in_use == 0);
+    CHECK(stats.free_blocks == 0 && stats.largest_free_block == 0);
+}
+
+#define CHECK_LATE_FAMILIES 100
+#define CHECK_REMOTE_OBJECTS 32
+
+typedef struct check_cache_run_
+{
+    mm_family_handle_t family;
+    void *objects[CHECK_REMOTE_OBJECTS];
+    uint64_t cached;   /* Objects allocated with one in use */
+    uint64_t released; /* Objects allocated once it is freed */
+} check_cache_run_t;
+
+static void *
+check_cache_thread(void *arg)
+{
+    check_cache_run_t *run = arg;
+    mm_family_stats_t stats;
+    void *app_data = xcalloc_by_handle(run->family, 1);
+    mm_get_family_stats(run->family, &stats);
+    run->cached = stats.objects_allocated;
+    xfree(app_data);
+    mm_get_family_stats(run->family, &stats);
+    run->released = stats.objects_allocated;
+    return NULL;
+}
+
+static void *
+check_remote_thread(void *arg)
+{
+    check_cache_run_t *run = arg;
+    int i;
+    for (i = 0; i < CHECK_REMOTE_OBJECTS; i++)
+        run->objects[i] = xcalloc_by_handle(run->family, 1);
+    return NULL;
+}
+
+/* Families registered past the first few hundred are cached per thread
+ * too, the cache refills a batch at a time and empties on thread exit.
+ * Objects freed by a thread that never allocates from their family go
+ * back to it a batch at a time */
+static void
+check_thread_cache(void)
+{
+    static char names[CHECK_LATE_FAMILIES][32];
+    mm_family_spec_t specs[CHECK_LATE_FAMILIES];
+    mm_family_handle_t handles[CHECK_LATE_FAMILIES];
+    check_cache_run_t run;
+    mm_family_stats_t stats;
+    pthread_t thread;
+    uint32_t i;
+    for (i = 0; i < CHECK_LATE_FAMILIES; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "check_late_%u", i);
+        specs[i].struct_name = names[i];
+        specs[i].struct_size = 64;
+    }
+    CHECK(mm_instantiate_page_families(specs, CHECK_LATE_FAMILIES, handles) == CHECK_LATE_FAMILIES);
+
+    memset(&run, 0, sizeof(run));
+    run.family = handles[CHECK_LATE_FAMILIES - 1];
+    CHECK(pthread_create(&thread, NULL, check_cache_thread, &run) == 0 && pthread_join(thread, NULL) == 0);
+    CHECK(run.cached > 1 && run.released == run.cached);
+    mm_get_family_stats(run.family, &stats);
+    CHECK(stats.objects_allocated == 0 && stats.pages_in_use == 0);
+
+    memset(&run, 0, sizeof(run));
+    run.family = handles[CHECK_LATE_FAMILIES - 2];
+    CHECK(pthread_create(&thread, NULL, check_remote_thread, &run) == 0 && pthread_join(thread, NULL) == 0);
+    mm_get_family_stats(run.family, &stats);
+    CHECK(stats.objects_allocated == CHECK_REMOTE_OBJECTS);
+    for (i = 0; i < CHECK_REMOTE_OBJECTS; i++)
+    {
+        CHECK(run.objects[i] != NULL);
+        xfree(run.objects[i]);
+    }
+    mm_get_family_stats(run.family, &stats);
+    CHECK(stats.objects_allocated == 0 && stats.pages_in_use == 0);
+}
+
+/* Objects come from the pool of the thread's node and go back to it */
+static void
+check_numa_nodes(void)
+{
+    mm_family_handle_t family = MM_FAMILY_HANDLE(check_stats_t);
+    mm_family_stats_t stats;
+    check_stats_t *local, *remote;
+
+    CHECK(mm_numa_node_count() == 2);
+    CHECK(mm_numa_set_thread_node(2) == -1);
+    CHECK(mm_numa_set_thread_node(1) == 0);
+    remote = XMALLOC(2, check_stats_t);
+    CHECK(mm_numa_set_thread_node(0) == 0);
+    local = XMALLOC(2, check_stats_t);
+    CHECK(mm_get_family_node_stats(family, 1, &stats) == 0 && stats.objects_allocated == 1);
+    CHECK(mm_get_family_node_stats(family, 0, &stats) == 0 && stats.objects_allocated == 1);
+    CHECK(mm_get_family_node_stats(family, 2, &stats) == -1);
+    XFREE(remote);
+    mm_get_family_node_stats(family, 1, &stats);
+    CHECK(stats.objects_allocated == 0 && stats.pages_in_use == 0);
+    XFREE(local);
+    mm_numa_set_thread_node(-1);
+}
+
+#define CHECK_HUGE_SPAN_BYTES 65536
+#define CHECK_HUGE_OBJECTS 400
+
+/* Fills a huge page family past its first span and empties it again.
+ * Returns the system pages it held with one object allocated */
+static uint64_t
+check_huge_family(mm_family_handle_t family, uint32_t struct_size)
+{
+    mm_family_stats_t stats;
+    char *objects[CHECK_HUGE_OBJECTS];
+    uint64_t first_pages = 0;
+    int i;
+    for (i = 0; i < CHECK_HUGE_OBJECTS; i++)
+    {
+        objects[i] = xcalloc_by_handle(family, 1);
+        CHECK(objects[i] && check_is_zero(objects[i], struct_size));
+        if (objects[i])
+            memset(objects[i], 0xa5, struct_size);
+        if (!i)
+        {
+            mm_get_family_stats(family, &stats);
+            first_pages = stats.pages_in_use;
+        }
+    }
+    for (i = 0; i < CHECK_HUGE_OBJECTS; i++)
+        xfree(objects[i]);
+    /* Reused blocks read as zero again */
+    objects[0] = xcalloc_by_handle(family, 1);
+    CHECK(objects[0] && check_is_zero(objects[0], struct_size));
+    xfree(objects[0]);
+    return first_pages;
+}
+
+/* Huge page families take whole spans. Explicit huge pages fall back to
+ * transparent ones when the hugetlb pool cannot supply them, the mode
+ * only changes while the family has no pages */
+static void
+check_huge_pages(void)
+{
+    mm_family_handle_t explicit_family = MM_REG_STRUCT(check_explicit_t), transparent_family = NULL;
+    uint64_t span_pages = CHECK_HUGE_SPAN_BYTES / sysconf(_SC_PAGESIZE);
+    mm_family_stats_t stats;
+    void *app_data = NULL;
+
+    CHECK(mm_page_family_set_huge_pages(explicit_family, MM_HUGE_PAGE_MODES) == NULL);
+    CHECK(mm_page_family_set_huge_pages(explicit_family, MM_HUGE_PAGES_EXPLICIT) == explicit_family);
+    CHECK(check_huge_family(explicit_family, sizeof(check_explicit_t)) == span_pages);
+
+    mm_set_huge_pages(MM_HUGE_PAGES_TRANSPARENT);
+    transparent_family = MM_REG_STRUCT(check_transparent_t);
+    mm_set_huge_pages(MM_HUGE_PAGES_NONE);
+    CHECK(check_huge_family(transparent_family, sizeof(check_transparent_t)) == span_pages);
+
+    app_data = XCALLOC(1, check_transparent_t);
+    CHECK(mm_page_family_set_huge_pages(transparent_family, MM_HUGE_PAGES_NONE) == NULL);
+    mm_get_family_stats(transparent_family, &stats);
+    CHECK(stats.pages_in_use > 0 && stats.pages_in_use % span_pages == 0);
+    XFREE(app_data);
+    CHECK(mm_verify_heap() == 0);
+}
+
+/* Pages of the family held with one object of size bytes allocated */
+static uint64_t
+check_byte_pages(mm_family_handle_t family, int size)
+{
+    mm_family_stats_t stats;
+    void *app_data = xmalloc_by_handle(family, size);
+    mm_get_family_stats(family, &stats);
+    xfree(app_data);
+    return app_data ? stats.pages_in_use : 0;
+}
+
+#define CHECK_PACKING_ROUNDS 20000
+#define CHECK_PACKING_SLOTS 256
+
+/* Block headers hold the largest block of a span, the distance back
+ * across a whole span and the longest tails. The byte family takes
+ * whole spans, so a request of any size up to the largest block fits */
+static void
+check_header_packing(void)
+{
+    mm_family_handle_t family = mm_page_family_set_huge_pages(MM_REG_STRUCT(check_byte_t), MM_HUGE_PAGES_TRANSPARENT);
+    uint64_t span_pages = CHECK_HUGE_SPAN_BYTES / sysconf(_SC_PAGESIZE);
+    static unsigned char *objects[CHECK_PACKING_SLOTS];
+    static int sizes[CHECK_PACKING_SLOTS];
+    mm_family_stats_t stats;
+    unsigned char *first, *last;
+    int low = CHECK_HUGE_SPAN_BYTES / 2, high = CHECK_HUGE_SPAN_BYTES, largest, i, slot;
+    uint32_t alignment;
+
+    CHECK(family != NULL);
+    /* The largest request served from a span */
+    while (low < high)
+    {
+        int size = (low + high + 1) / 2;
+        if (check_byte_pages(family, size) == span_pages)
+            low = size;
+        else
+            high = size - 1;
+    }
+    largest = low;
+    CHECK(largest > CHECK_HUGE_SPAN_BYTES - 1024 && check_byte_pages(family, largest + 1) > span_pages);
+
+    first = xcalloc_by_handle(family, largest);
+    CHECK(first && check_is_zero(first, largest));
+    mm_get_family_stats(family, &stats);
+    CHECK(stats.free_blocks == 0 && stats.bytes_requested == (uint64_t)largest);
+    if (first)
+        memset(first, 0x5a, largest);
+    CHECK(mm_verify_heap() == 0);
+    xfree(first);
+
+    /* The last block of a span sits a whole span past the first */
+    first = xcalloc_by_handle(family, largest - 2 * 16);
+    last = xcalloc_by_handle(family, 1);
+    mm_get_family_stats(family, &stats);
+    CHECK(first && last && last > first && last - first > CHECK_HUGE_SPAN_BYTES - 1024);
+    CHECK(stats.pages_in_use == span_pages && stats.free_blocks == 0);
+    CHECK(mm_verify_heap() == 0);
+    xfree(first);
+    first = xcalloc_by_handle(family, 1);
+    CHECK(first && check_is_zero(first, 1) && mm_verify_heap() == 0);
+    xfree(last);
+    xfree(first);
+
+    /* The most aligned request a span holds, padding for the alignment
+     * and the free block split off ahead of it included */
+    alignment = (uint32_t)sysconf(_SC_PAGESIZE);
+    first = xcalloc_aligned_by_handle(family, largest - 2 * alignment - 24, alignment);
+    mm_get_family_stats(family, &stats);
+    CHECK(first && ((uintptr_t)first & (alignment - 1)) == 0 && stats.pages_in_use == span_pages);
+    CHECK(first && check_is_zero(first, largest - 2 * alignment - 24) && mm_verify_heap() == 0);
+    xfree(first);
+
+    /* Small objects, some aligned, stack up hard internal fragmentation
+     * in the tails of the blocks ahead of them */
+    srand(18);
+    for (i = 0; i < CHECK_PACKING_ROUNDS; i++)
+    {
+        slot = rand() % CHECK_PACKING_SLOTS;
+        if (objects[slot])
+        {
+            CHECK(objects[slot][0] == (unsigned char)slot && objects[slot][sizes[slot] - 1] == (unsigned char)slot);
+            xfree(objects[slot]);
+            objects[slot] = NULL;
+            continue;
+        }
+        sizes[slot] = 1 + rand() % 40;
+        alignment = 8u << (rand() % 4);
+        objects[slot] = rand() % 2 ? xcalloc_aligned_by_handle(family, sizes[slot], alignment)
+                                   : xcalloc_by_handle(family, sizes[slot]);
+        CHECK(objects[slot] != NULL);
+        if (!objects[slot])
+            continue;
+        memset(objects[slot], slot, sizes[slot]);
+        if (i % 1000 == 0)
+            CHECK(mm_verify_heap() == 0);
+    }
+    for (slot = 0; slot < CHECK_PACKING_SLOTS; slot++)
+    {
+        if (objects[slot])
+            xfree(objects[slot]);
+    }
+    mm_get_family_stats(family, &stats);
+    CHECK(stats.objects_allocated == 0 && mm_verify_heap() == 0);
+}
+
+/* Objects of an aligned family and ones asked for with more alignment */
+static void
+check_alignment(void)
+{
+    void *objects[100];
+    int i;
+    CHECK(mm_page_family_set_alignment(MM_FAMILY_HANDLE(check_small_t), 48) == NULL);
+    for (i = 0; i < 100; i++)
+    {
+        objects[i] = i % 2 ? (void *)XCALLOC(1 + i % 3, check_aligned_t)
+                           : xcalloc_aligned("check_small_t", 1 + i % 3, 256);
+        CHECK(objects[i] && ((uintptr_t)objects[i] & (i % 2 ? 63 : 255)) == 0);
+        CHECK(objects[i] && check_is_zero(objects[i], (1 + i % 3) * (i % 2 ? sizeof(check_aligned_t)
+                                                                           : sizeof(check_small_t))));
+        memset(objects[i], 0xa5, (1 + i % 3) * sizeof(check_small_t));
+    }
+    for (i = 0; i < 100; i++)
+        XFREE(objects[i]);
+    CHECK(xcalloc_aligned("check_small_t", 1, 3) == NULL);
+}
+
+/* Families of about the same size share slab pages, each still counts
+ * its own objects */
+static void
+check_size_classes(void)
+{
+    mm_family_handle_t a = MM_FAMILY_HANDLE(check_shared_a_t), b = MM_FAMILY_HANDLE(check_shared_b_t);
+    mm_family_stats_t stats;
+    void *objects[100];
+    int i;
+    CHECK(mm_page_family_size_class(a) != NULL && mm_page_family_size_class(a) == mm_page_family_size_class(b));
+    CHECK(mm_page_family_size_class(MM_FAMILY_HANDLE(check_small_t)) == NULL);
+    for (i = 0; i < 100; i++)
+    {
+        objects[i] = i % 2 ? (void *)XCALLOC(1, check_shared_a_t) : (void *)XCALLOC(1, check_shared_b_t);
+        CHECK(objects[i] && check_is_zero(objects[i], i % 2 ? sizeof(check_shared_a_t) : sizeof(check_shared_b_t)));
+        memset(objects[i], 0xa5, sizeof(check_shared_a_t));
+    }
+    mm_get_family_stats(a, &stats);
+    CHECK(stats.objects_allocated == 50 && stats.bytes_requested == 50 * sizeof(check_shared_a_t));
+    mm_get_family_stats(mm_page_family_size_class(a), &stats);
+    /* Along with the slots this thread's cache took ahead */
+    CHECK(stats.objects_allocated >= 100 && stats.pages_in_use > 0);
+    for (i = 0; i < 100; i++)
+        XFREE(objects[i]);
+    mm_get_family_stats(b, &stats);
+    CHECK(stats.objects_allocated == 0);
+    /* Freed slots read zero for either family */
+    for (i = 0; i < 100; i++)
+    {
+        objects[i] = i % 2 ? (void *)XCALLOC(1, check_shared_b_t) : (void *)XCALLOC(1, check_shared_a_t);
+        CHECK(objects[i] && check_is_zero(objects[i], i % 2 ? sizeof(check_shared_b_t) : sizeof(check_shared_a_t)));
+    }
+    for (i = 0; i < 100; i++)
+        XFREE(objects[i]);
+}
+
+/* With a one byte interval every allocation is sampled and traced */
+static void
+check_profiler(void)
+{
+    mm_profile_event_t events[8];
+    check_page_t *object;
+    uint32_t count, i;
+    int allocated = 0, freed = 0;
+
+    CHECK(mm_profile_start(1) == 0);
+    /* A thread's first allocation only starts its sampling distance */
+    XFREE(XMALLOC(2, check_page_t));
+    mm_profile_read_events(events, 8);
+    object = XMALLOC(2, check_page_t);
+    count = mm_profile_read_events(events, 8);
+    for (i = 0; i < count; i++)
+    {
+        if (events[i].type == MM_PROFILE_ALLOC && events[i].app_data == object)
+            allocated = events[i].size == 2 * sizeof(check_page_t) && events[i].depth > 0 &&
+                        !strcmp(events[i].struct_name, "check_page_t");
+    }
+    CHECK(allocated);
+    XFREE(object);
+    mm_profile_stop();
+    count = mm_profile_read_events(events, 8);
+    for (i = 0; i < count; i++)
+    {
+        if (events[i].type == MM_PROFILE_FREE && events[i].app_data == object)
+            freed = 1;
+    }
+    CHECK(freed);
+    /* Not sampled once stopped */
+    object = XMALLOC(2, check_page_t);
+    CHECK(mm_profile_read_events(events, 8) == 0);
+    XFREE(object);
+}
+
+/* Arena objects are zero, XFREE leaves them be and a reset reuses
+ * the arena's spans */
+static void
+check_arena(void)
+{
+    mm_arena_handle_t arena = mm_arena_create();
+    check_page_t *first, *objects[100];
+    int i;
+    CHECK(arena != NULL);
+    if (!arena)
+        return;
+    for (i = 0; i < 100; i++)
+    {
+        objects[i] = XCALLOC_IN(arena, 1 + i % 4, check_page_t);
+        CHECK(objects[i] && check_is_zero(objects[i], (1 + i % 4) * sizeof(check_page_t)));
+        memset(objects[i], i, (1 + i % 4) * sizeof(check_page_t));
+    }
+    CHECK(XCALLOC_IN(arena, -1, check_page_t) == NULL);
+    CHECK(XCALLOC_IN(arena, 0, check_page_t) == NULL);
+    CHECK(XCALLOC_IN(arena, INT_MAX, check_large_t) == NULL);
+    CHECK(xcalloc_in_by_handle(NULL, MM_FAMILY_HANDLE(check_page_t), 1) == NULL);
+    CHECK(xcalloc_in_by_handle(arena, NULL, 1) == NULL);
+    first = objects[0];
+    XFREE(objects[1]);
+    CHECK(objects[1]->data[0] == 1);
+    for (i = 0; i < 100; i++)
+        CHECK(objects[i]->data[sizeof(check_page_t) - 1] == (char)i);
+    mm_arena_reset(arena);
+    objects[0] = XCALLOC_IN(arena, 1, check_page_t);
+    CHECK(objects[0] == first && check_is_zero(objects[0], sizeof(check_page_t)));
+    mm_arena_destroy(arena);
+}
+
+/* Resized objects keep their contents and read zero in the added units */
+static void
+check_realloc(void)
+{
+    check_grown_t *grown, *blocker, *moved;
+    size_t unit = sizeof(check_grown_t);
+
+    CHECK(XREALLOC(NULL, 1) == NULL);
+    /* Growing over the untouched rest of a fresh page does not clear it */
+    mm_trim_page_reserve();
+    grown = XMALLOC(1, check_grown_t);
+    memset(grown, 0xa5, unit);
+    CHECK(XREALLOC(grown, 4) == grown);
+    CHECK(check_is_untouched(grown + 1, 3 * unit));
+    CHECK(grown->data[0] == (char)0xa5 && grown->data[unit - 1] == (char)0xa5);
+    CHECK(check_is_zero(grown + 1, 3 * unit));
+    CHECK(XREALLOC(grown, 0) == NULL);
+
+    /* Shrunk in place, the dirtied units read zero when grown again */
+    memset(grown, 0x5a, 4 * unit);
+    CHECK(XREALLOC(grown, 1) == grown && grown->data[unit - 1] == 0x5a);
+    CHECK(XREALLOC(grown, 3) == grown && check_is_zero(grown + 1, 2 * unit));
+
+    /* A live neighbour makes it move */
+    blocker = XMALLOC(1, check_grown_t);
+    memset(grown, 0x3c, 3 * unit);
+    moved = XREALLOC(grown, 20);
+    CHECK(moved != NULL && moved != grown);
+    CHECK(moved && moved->data[0] == 0x3c && moved[2].data[unit - 1] == 0x3c);
+    CHECK(moved && check_is_zero(moved + 3, 17 * unit));
+    XFREE(moved);
+    XFREE(blocker);
+}
+
+#define CHECK_MOVED_OBJECTS 2000
+
+static check_moved_t *check_moved[CHECK_MOVED_OBJECTS];
+
+/* Knows only the objects in check_moved, refuses anything else */
+static int
+check_relocate(void *old_app_data, void *new_app_data, void *arg)
+{
+    check_moved_t **table = (check_moved_t **)arg;
+    int i;
+    for (i = 0; i < CHECK_MOVED_OBJECTS; i++)
+    {
+        if (table[i] == old_app_data)
+        {
+            table[i] = (check_moved_t *)new_app_data;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Compaction empties sparse pages and the relocator sees each move */
+static void
+check_compaction(void)
+{
+    mm_family_handle_t family = MM_FAMILY_HANDLE(check_moved_t);
+    mm_compaction_stats_t compaction;
+    mm_family_stats_t before, after;
+    int i;
+
+    CHECK(mm_compact_family(family, 50, NULL) == -1);
+    CHECK(mm_page_family_set_relocator(family, check_relocate, check_moved) == family);
+    for (i = 0; i < CHECK_MOVED_OBJECTS; i++)
+    {
+        check_moved[i] = XMALLOC(1, check_moved_t);
+        check_moved[i]->id = i;
+        memset(check_moved[i]->data, i & 0xff, sizeof(check_moved[i]->data));
+    }
+    for (i = 0; i < CHECK_MOVED_OBJECTS; i++)
+    {
+        if (i % 8)
+        {
+            XFREE(check_moved[i]);
+            check_moved[i] = NULL;
+        }
+    }
+    mm_get_family_stats(family, &before);
+    CHECK(mm_get_compaction_stats(family, 50, &compaction) == 0);
+    CHECK(compaction.sparse_pages > 1 && compaction.objects_moved == 0);
+    CHECK(mm_compact_family(family, 50, &compaction) == 0);
+    CHECK(compaction.objects_moved > 0 && compaction.pages_released > 0);
+    mm_get_family_stats(family, &after);
+    /* The objects cached by this thread were handed back first */
+    CHECK(after.pages_in_use < before.pages_in_use && after.objects_allocated == CHECK_MOVED_OBJECTS / 8);
+    for (i = 0; i < CHECK_MOVED_OBJECTS; i++)
+    {
+        if (!check_moved[i])
+            continue;
+        CHECK(check_moved[i]->id == i && check_moved[i]->data[195] == (char)(i & 0xff));
+        XFREE(check_moved[i]);
+        check_moved[i] = NULL;
+    }
+}
+
+/* Bytes of the file backing a shm heap */
+static uint64_t
+check_file_bytes(int fd)
+{
+    struct stat file_stat;
+    return fstat(fd, &file_stat) ? 0 : (uint64_t)file_stat.st_blocks * 512;
+}
+
+/* Objects linked by offset are read through a second, read-only mapping
+ * of the heap's file. Freed slots are punched out of the file, even the
+ * few kept parked */
+static void
+check_shm_heap(void)
+{
+    static check_shm_node_t *nodes[1024];
+    mm_shm_heap_handle_t heap = mm_shm_heap_create(NULL, 5 * 65536);
+    mm_shm_heap_handle_t attached = NULL;
+    mm_family_handle_t family = NULL;
+    check_shm_node_t *node = NULL;
+    uint64_t offset = 0;
+    int i, count = 0;
+
+    CHECK(heap != NULL && mm_shm_heap_fd(heap) >= 0);
+    if (!heap)
+        return;
+    CHECK(mm_shm_heap_detach(heap) == -1);
+    family = MM_REG_STRUCT_IN_SHM_HEAP(check_shm_node_t, heap);
+    CHECK(family != NULL);
+    CHECK(mm_page_family_set_shm_heap(MM_FAMILY_HANDLE(check_small_t), heap) == NULL);
+    /* Until the heap is full */
+    for (i = 0; i < 1024; i++)
+    {
+        nodes[i] = XCALLOC(1, check_shm_node_t);
+        if (!nodes[i])
+            break;
+        CHECK(mm_shm_heap_offset(heap, nodes[i]) != 0);
+        nodes[i]->id = i;
+        nodes[i]->next = i ? mm_shm_heap_offset(heap, nodes[i - 1]) : 0;
+    }
+    CHECK(i > 100 && i < 1024);
+    CHECK(mm_shm_heap_set_root(heap, nodes[i - 1]) == 0);
+
+    attached = mm_shm_heap_attach(mm_shm_heap_fd(heap));
+    CHECK(attached != NULL && attached != heap);
+    if (attached)
+    {
+        CHECK(mm_shm_heap_set_root(attached, NULL) == -1);
+        node = (check_shm_node_t *)mm_shm_heap_root(attached);
+        CHECK(node != NULL && node != nodes[i - 1]);
+        for (; node; node = (check_shm_node_t *)mm_shm_heap_pointer(attached, offset))
+        {
+            CHECK(node->id == i - 1 - count);
+            offset = node->next;
+            count++;
+            if (!offset)
+                break;
+        }
+        CHECK(count == i);
+        CHECK(mm_shm_heap_destroy(attached) == -1);
+        CHECK(mm_shm_heap_detach(attached) == 0);
+    }
+
+    /* Destroyed only once its objects are all gone */
+    CHECK(mm_shm_heap_destroy(heap) == -1);
+    CHECK(check_file_bytes(mm_shm_heap_fd(heap)) > 4 * (uint64_t)sysconf(_SC_PAGESIZE));
+    XFREE_BATCH((void **)nodes, i);
+    /* Only the header is left */
+    CHECK(check_file_bytes(mm_shm_heap_fd(heap)) <= (uint64_t)sysconf(_SC_PAGESIZE));
+    CHECK(mm_shm_heap_destroy(heap) == 0);
+    node = XCALLOC(1, check_shm_node_t);
+    CHECK(node && check_is_zero(node, sizeof(*node)));
+    XFREE(node);
+}
+
+typedef enum
+{
+    CHECK_DEBUG_OVERRUN,
+    CHECK_DEBUG_DOUBLE_FREE,
+    CHECK_DEBUG_WRITE_AFTER_FREE,
+    CHECK_DEBUG_GUARD_PAGE,
+    CHECK_DEBUG_VERIFY
+} check_debug_fault_t;
+
+/* Makes the fault in a child, returns the signal that ended it, 0 if
+ * none did */
+static int
+check_debug_fault_signal(check_debug_fault_t fault)
+{
+    check_small_t *objects;
+    check_large_t *large;
+    int status = 0, i;
+    pid_t pid;
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+        return 0;
+    if (pid == 0)
+    {
+        objects = XMALLOC(2, check_small_t);
+        switch (fault)
+        {
+        case CHECK_DEBUG_OVERRUN:
+            objects[2].data[0] = 1;
+            XFREE(objects);
+            break;
+        case CHECK_DEBUG_DOUBLE_FREE:
+            XFREE(objects);
+            XFREE(objects);
+            break;
+        case CHECK_DEBUG_WRITE_AFTER_FREE:
+            XFREE(objects);
+            objects[1].data[8] = 1;
+            /* Released from the quarantine by the frees that follow */
+            for (i = 0; i < 100000; i++)
+                XFREE(XMALLOC(2, check_small_t));
+            break;
+        case CHECK_DEBUG_GUARD_PAGE:
+            large = XMALLOC(1, check_large_t);
+            /* Past the canary, if any, into the guard page */
+            ((volatile char *)large)[sizeof(*large) + sysconf(_SC_PAGESIZE) - 1] = 1;
+            break;
+        case CHECK_DEBUG_VERIFY:
+            /* Found by the walk, with no abort */
+            objects[2].data[0] = 1;
+            if (mm_verify_heap() > 0)
+                raise(SIGUSR1);
+            break;
+        }
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFSIGNALED(status))
+        return 0;
+    return WTERMSIG(status);
+}
+
+/* Canaries, guard pages and the quarantine catch misuse and abort */
+static void
+check_debug_mode(void)
+{
+    check_small_t *objects[100];
+    int i;
+    CHECK(mm_set_debug(MM_DEBUG_CANARIES | MM_DEBUG_GUARD_PAGES | MM_DEBUG_QUARANTINE) == 0);
+    CHECK(MM_REG_STRUCT(check_small_t) != NULL);
+    CHECK(MM_REG_STRUCT(check_large_t) != NULL);
+    CHECK(mm_set_debug(0) == -1);
+
+    for (i = 0; i < 100; i++)
+    {
+        objects[i] = XCALLOC(1 + i % 3, check_small_t);
+        CHECK(objects[i] && check_is_zero(objects[i], (1 + i % 3) * sizeof(check_small_t)));
+        memset(objects[i], 0xa5, (1 + i % 3) * sizeof(check_small_t));
+    }
+    for (i = 0; i < 100; i += 2)
+        XFREE(objects[i]);
+    CHECK(mm_verify_heap() == 0);
+    for (i = 1; i < 100; i += 2)
+        XFREE(objects[i]);
+    CHECK(mm_verify_heap() == 0);
+
+    CHECK(check_debug_fault_signal(CHECK_DEBUG_OVERRUN) == SIGABRT);
+    CHECK(check_debug_fault_signal(CHECK_DEBUG_DOUBLE_FREE) == SIGABRT);
+    CHECK(check_debug_fault_signal(CHECK_DEBUG_WRITE_AFTER_FREE) == SIGABRT);
+    CHECK(check_debug_fault_signal(CHECK_DEBUG_GUARD_PAGE) == SIGSEGV);
+    CHECK(check_debug_fault_signal(CHECK_DEBUG_VERIFY) == SIGUSR1);
+}
+
+/* Runs this program again for the debug mode checks */
+static void
+check_debug_process(char *self)
+{
+    int status = 0;
+    pid_t pid;
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        execl(self, self, "debug", (char *)NULL);
+        _exit(127);
+    }
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    mm_init();
+    if (argc > 1 && !strcmp(argv[1], "debug"))
+    {
+        check_debug_mode();
+        if (check_failures)
+            printf("%d debug checks failed\n", check_failures);
+        return check_failures ? 1 : 0;
+    }
+    CHECK(mm_numa_simulate(2) == 0);
+    /* Huge pages would make untouched memory resident */
+    prctl(PR_SET_THP_DISABLE, 1, 0, 0, 0);
+    check_registration();
+    check_registration_table();
+    check_unit_counts();
+    check_fresh_pages_not_cleared();
+    check_batches();
+    check_xcalloc_zeroes();
+    check_object_contents();
+    check_stats();
+    check_thread_cache();
+    check_profiler();
+    check_numa_nodes();
+    check_compaction();
+    check_realloc();
+    check_arena();
+    check_alignment();
+    check_huge_pages();
+    check_header_packing();
+    check_size_classes();
+    check_shm_heap();
+    check_debug_process(argv[0]);
+    if (check_failures)
+    {
+        printf("%d checks failed\n", check_failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
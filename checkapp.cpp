@@ -0,0 +1,164 @@
+/* Behavior checks of the typed C++ front-end. Each failed check is
+ * printed with its line, the exit status is non-zero if any failed.
+ *
+ * Build: gcc -O1 -c mm.c gluethread/glthread.c &&
+ *        g++ -O1 checkapp.cpp mm.o glthread.o -o checkapp_cpp -lpthread
+ * Usage: checkapp_cpp
+ */
+
+#include "uapi_mm.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+struct check_point
+{
+    int x;
+    int y;
+    check_point(int x, int y) : x(x), y(y) {}
+};
+
+struct alignas(64) check_line
+{
+    char data[72];
+};
+
+struct check_slot
+{
+    long value;
+};
+
+namespace mm
+{
+template <>
+struct family_traits<check_slot>
+{
+    static constexpr bool slab = true;
+};
+} // namespace mm
+
+static int check_failures;
+
+#define CHECK(condition)                                                     \
+    do                                                                       \
+    {                                                                        \
+        if (!(condition))                                                    \
+        {                                                                    \
+            printf("FAILED %s:%d %s\n", __FUNCTION__, __LINE__, #condition); \
+            check_failures++;                                                \
+        }                                                                    \
+    } while (0)
+
+template <typename T>
+static uint64_t
+check_objects_allocated()
+{
+    mm_family_stats_t stats;
+    if (mm_get_family_stats(mm::family_handle<T>(), &stats))
+        return 0;
+    return stats.objects_allocated;
+}
+
+/* Every type gets a family of its own, found again under its name */
+static void
+check_families(void)
+{
+    mm_family_handle_t points = mm::family_handle<check_point>();
+    mm_family_stats_t stats;
+    CHECK(points != NULL && mm::family_handle<check_point>() == points);
+    CHECK(mm::family_handle<check_line>() != points && mm::family_handle<check_line>() != NULL);
+    CHECK(mm_get_family_stats(points, &stats) == 0 && stats.struct_size == sizeof(check_point));
+    CHECK(mm_get_family_handle((char *)stats.struct_name) == points);
+}
+
+/* The elements of a vector live in its element type's family and
+ * survive every reallocation as it grows */
+static void
+check_vector(void)
+{
+    std::vector<int, mm::allocator<int>> numbers;
+    std::vector<check_line, mm::allocator<check_line>> lines(10);
+    int i;
+    for (i = 0; i < 10000; i++)
+        numbers.push_back(i);
+    CHECK(check_objects_allocated<int>() > 0);
+    for (i = 0; i < 10000; i++)
+    {
+        if (numbers[i] != i)
+            break;
+    }
+    CHECK(i == 10000);
+    CHECK(((uintptr_t)lines.data() & 63) == 0);
+    numbers.clear();
+    numbers.shrink_to_fit();
+    CHECK(numbers.capacity() == 0);
+}
+
+typedef std::unordered_map<int, std::string, std::hash<int>, std::equal_to<int>,
+                           mm::allocator<std::pair<const int, std::string>>>
+    check_map_t;
+
+/* Nodes and buckets of a map come from families of their own types */
+static void
+check_unordered_map(void)
+{
+    check_map_t names;
+    int i;
+    for (i = 0; i < 2000; i++)
+        names[i] = "name " + std::to_string(i);
+    CHECK(names.size() == 2000);
+    for (i = 0; i < 2000; i++)
+    {
+        check_map_t::const_iterator found = names.find(i);
+        if (found == names.end() || found->second != "name " + std::to_string(i))
+            break;
+    }
+    CHECK(i == 2000);
+    for (i = 0; i < 2000; i += 2)
+        names.erase(i);
+    CHECK(names.size() == 1000 && names.count(1) == 1 && names.count(2) == 0);
+}
+
+/* Objects made one at a time are constructed in place and handed back
+ * by the deleter, slab families included */
+static void
+check_make(void)
+{
+    mm::unique_ptr<check_point> point = mm::make<check_point>(3, 4);
+    mm::unique_ptr<check_slot> slot = mm::make<check_slot>();
+    mm::allocator<check_point> points;
+    mm::allocator<check_slot> slots;
+    CHECK(point && point->x == 3 && point->y == 4);
+    CHECK(slot != NULL);
+    CHECK(points == slots && !(points != slots));
+    point.reset();
+    bool threw = false;
+    try
+    {
+        points.allocate((std::size_t)INT_MAX + 1);
+    }
+    catch (const std::bad_array_new_length &)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+int main()
+{
+    mm_init();
+    check_families();
+    check_vector();
+    check_unordered_map();
+    check_make();
+    CHECK(mm_verify_heap() == 0);
+    if (check_failures)
+    {
+        printf("%d checks failed\n", check_failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
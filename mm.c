@@ -1,18 +1,83 @@
+#define _GNU_SOURCE /* sched_getcpu() */
 #include "mm.h"
+#include "uapi_mm.h"
 #include <stdio.h>
 #include <errno.h>
+#include <sched.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 static size_t SYSTEM_PAGE_SIZE = 0;
 
+static void
+mm_numa_init(void);
+
+/* Comma separated list of canary, guard and quarantine */
+static uint32_t
+mm_debug_parse_flags(const char *spec)
+{
+    uint32_t flags = 0;
+    size_t length;
+    while (*spec)
+    {
+        length = strcspn(spec, ",");
+        if (length == 6 && !strncmp(spec, "canary", length))
+            flags |= MM_DEBUG_CANARIES;
+        else if (length == 5 && !strncmp(spec, "guard", length))
+            flags |= MM_DEBUG_GUARD_PAGES;
+        else if (length == 10 && !strncmp(spec, "quarantine", length))
+            flags |= MM_DEBUG_QUARANTINE;
+        else if (length)
+            printf("Error: %s() Unknown debug option %.*s\n", __FUNCTION__, (int)length, spec);
+        spec += length;
+        if (*spec)
+            spec++;
+    }
+    return flags;
+}
+
 void mm_init()
 {
+    char *debug_spec = getenv("MM_DEBUG");
     SYSTEM_PAGE_SIZE = getpagesize();
+    mm_numa_init();
+    if (debug_spec)
+        mm_set_debug(mm_debug_parse_flags(debug_spec));
 }
 
-static vm_page_for_family_t *first_vm_page_for_family = NULL;
+static mm_family_registry_t family_registry = {NULL, 0};
+
+/* Families of the shared size classes, created on first use */
+static const uint32_t size_class_sizes[] = {MM_SIZE_CLASS_SIZES};
+static vm_page_family_t *size_class_families[sizeof(size_class_sizes) / sizeof(size_class_sizes[0])];
+static int size_class_sharing = 0; /* Default of newly registered families */
+
+/* Serializes registration and name lookups. Allocation through a
+ * family handle only ever takes that family's own lock */
+static pthread_mutex_t family_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread mm_thread_cache_t thread_cache;
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+static mm_profile_t heap_profile = {0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0, 0};
+static __thread int64_t profile_bytes_until_sample;
+static __thread uint64_t profile_rand_state;
+
+/* Fixed before the first family is registered, see mm_set_debug() */
+static uint32_t debug_flags = 0;
+static uint32_t debug_canary_bytes = 0; /* Room taken by a canary */
+static uint64_t debug_canary_secret = 0;
+
+static mm_numa_topology_t numa_topology = {1, MM_FALSE, {0}};
+static __thread int thread_numa_binding = -1; /* Set by mm_numa_set_thread_node() */
+static __thread uint32_t thread_numa_node;     /* Node seen by the last slow path */
 
 static void *
 mm_get_new_vm_page_from_kernel(int units)
@@ -23,476 +88,4162 @@ mm_get_new_vm_page_from_kernel(int units)
         printf("Error: VM page allocation failed\n");
         return NULL;
     }
-    memset(vm_page, 0, units * SYSTEM_PAGE_SIZE);
+    /* Fresh anonymous mappings are zero filled by the kernel */
     return (void *)vm_page;
 }
 
-void mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size)
+static void
+mm_return_vm_page_to_kernel(void *vm_page, int units)
 {
-    vm_page_family_t *vm_page_family_curr = NULL;
-    vm_page_for_family_t *new_vm_page_for_family = NULL;
-    if (struct_size > SYSTEM_PAGE_SIZE)
-    {
-        printf("Error: %s() Structure %s exceeds the system page size\n", __FUNCTION__, struct_name);
-        return;
-    }
-    if (!first_vm_page_for_family)
-    {
-        first_vm_page_for_family = (vm_page_for_family_t *)mm_get_new_vm_page_from_kernel(SYSTEM_PAGE_SIZE);
-        first_vm_page_for_family->next = NULL;
-        vm_page_family_curr = (vm_page_family_t *)&first_vm_page_for_family->vm_page_family[0];
-        strncpy(vm_page_family_curr->struct_name, struct_name, MM_MAX_STRUCT_NAME);
-        vm_page_family_curr->struct_size = struct_size;
-        vm_page_family_curr->first_page = NULL;
-        init_glthread(&vm_page_family_curr->free_block_priority_list_head);
-        return;
-    }
-    uint32_t count1 = 0;
-    ITERATE_PAGE_FAMILIES_BEGIN(first_vm_page_for_family, vm_page_family_curr)
-    {
-        if (strncmp(vm_page_family_curr->struct_name, struct_name, MM_MAX_STRUCT_NAME) != 0)
-        {
-            count1++;
-            continue;
-        }
-        assert(0);
-    }
-    ITERATE_PAGE_FAMILIES_END(first_vm_page_for_family, vm_page_family_curr)
-
-    if (count1 == MAX_FAMILIES_PER_VM_PAGE)
+    if (munmap(vm_page, SYSTEM_PAGE_SIZE * units))
     {
-        new_vm_page_for_family = (vm_page_for_family_t *)mm_get_new_vm_page_from_kernel(SYSTEM_PAGE_SIZE);
-        new_vm_page_for_family->next = first_vm_page_for_family;
-        first_vm_page_for_family = new_vm_page_for_family;
-        vm_page_family_curr = (vm_page_family_t *)&first_vm_page_for_family->vm_page_family[0];
+        printf("Error: Could not unmap VM page to kernel\n");
     }
-    strncpy(vm_page_family_curr->struct_name, struct_name, MM_MAX_STRUCT_NAME);
-    vm_page_family_curr->struct_size = struct_size;
-    vm_page_family_curr->first_page = NULL;
-    init_glthread(&vm_page_family_curr->free_block_priority_list_head);
 }
 
-void mm_print_registered_page_families()
+/* Maps span_size bytes starting on an alignment boundary by over
+ * mapping and trimming the unaligned head and the surplus tail */
+static void *
+mm_map_aligned_from_kernel(size_t span_size, size_t alignment)
 {
-    printf("System page size: %d\n", (int)SYSTEM_PAGE_SIZE);
-    printf("Maximum no of families per page: %d\n", MAX_FAMILIES_PER_VM_PAGE);
-    vm_page_for_family_t *vm_page_for_family_curr = first_vm_page_for_family;
-    if (!vm_page_for_family_curr)
-    {
-        printf("No vm pages allocated\n");
-        return;
-    }
-    vm_page_family_t *vm_page_family_curr = NULL;
-    int vm_page_count = 1;
-    while (vm_page_for_family_curr != NULL)
+    size_t map_size = span_size + alignment - SYSTEM_PAGE_SIZE;
+    char *vm_page = mmap(0, map_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
+    if (vm_page == MAP_FAILED)
     {
-        printf("VM page %d\n", vm_page_count);
-        ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_family_curr, vm_page_family_curr)
-        {
-            printf("Page family: %s, Struct size: %d\n", vm_page_family_curr->struct_name, vm_page_family_curr->struct_size);
-        }
-        ITERATE_PAGE_FAMILIES_END(vm_page_for_family_curr, vm_page_family_curr)
-        vm_page_count++;
-        vm_page_for_family_curr = vm_page_for_family_curr->next;
+        printf("Error: VM span allocation failed\n");
+        return NULL;
     }
+    char *vm_span = (char *)(((uintptr_t)vm_page + alignment - 1) & ~(alignment - 1));
+    if (vm_span != vm_page)
+        munmap(vm_page, vm_span - vm_page);
+    if (vm_span + span_size != vm_page + map_size)
+        munmap(vm_span + span_size, (vm_page + map_size) - (vm_span + span_size));
+    return (void *)vm_span;
 }
 
-vm_page_family_t *
-lookup_page_family_by_name(char *struct_name)
+static void *
+mm_get_new_vm_span_from_kernel(uint64_t units)
 {
-    vm_page_for_family_t *vm_page_for_family_curr = first_vm_page_for_family;
+    return mm_map_aligned_from_kernel((size_t)units * SYSTEM_PAGE_SIZE, MM_SPAN_ALIGNMENT);
+}
 
-    vm_page_family_t *vm_page_family_curr = NULL;
-    while (vm_page_for_family_curr != NULL)
-    {
+/* One reserve per NUMA node and huge page mode. Families and arenas
+ * draw their spans from, and return them to, the reserve of the node
+ * the page belongs to in their mode. Set up by mm_init() */
+static mm_span_reserve_t span_reserves[MM_MAX_NUMA_NODES][MM_HUGE_PAGE_MODES];
+static vm_bool_t span_reserves_ready = MM_FALSE;
+static pthread_mutex_t span_reserve_lock = PTHREAD_MUTEX_INITIALIZER;
+static mm_huge_page_mode_t default_huge_page_mode = MM_HUGE_PAGES_NONE;
 
-        ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_family_curr, vm_page_family_curr)
+static void
+mm_span_reserves_init(void)
+{
+    uint32_t node, mode;
+    for (node = 0; node < MM_MAX_NUMA_NODES; node++)
+    {
+        for (mode = 0; mode < MM_HUGE_PAGE_MODES; mode++)
         {
-            if (strncmp(vm_page_family_curr->struct_name, struct_name, sizeof(struct_name)) == 0)
-            {
-                return vm_page_family_curr;
-            }
+            mm_span_reserve_t *reserve = &span_reserves[node][mode];
+            memset(reserve, 0, sizeof(*reserve));
+            reserve->chunk_spans = MM_RESERVE_CHUNK_SPANS;
+            reserve->min_free_spans = MM_RESERVE_MIN_FREE_SPANS;
+            reserve->max_free_spans = MM_RESERVE_MAX_FREE_SPANS;
+            reserve->huge_mode = (mm_huge_page_mode_t)mode;
+            reserve->hugetlb_unavailable = MM_FALSE;
+            reserve->numa_node = node;
         }
-        ITERATE_PAGE_FAMILIES_END(vm_page_for_family_curr, vm_page_family_curr)
-
-        vm_page_for_family_curr = vm_page_for_family_curr->next;
     }
-    return NULL;
+    span_reserves_ready = MM_TRUE;
 }
 
-void meta_block_util(block_meta_data_t *first_meta_block)
+static inline mm_span_reserve_t *
+mm_family_span_reserve(vm_page_family_t *vm_page_family, uint32_t numa_node)
 {
-    block_meta_data_t *curr = NULL;
-    uint32_t free_count = 0, alloc_count = 0, max_free_size = 0, max_alloc_size = 0;
-    void *max_free_block;
-    void *max_alloc_block;
+    if (vm_page_family->shm_heap)
+        return &vm_page_family->shm_heap->reserve;
+    return &span_reserves[numa_node][vm_page_family->huge_mode];
+}
 
-    for (curr = first_meta_block; curr != NULL; curr = curr->next_block)
-    {
-        if (curr->is_free == MM_TRUE)
-        {
-            if (curr->next_block && curr->next_block->is_free)
-                assert(0);
-            free_count++;
-            if (max_free_size < curr->block_size)
-            {
-                max_free_size = curr->block_size;
-                max_free_block = (void *)curr;
-            }
-        }
-        else
-        {
-            alloc_count++;
-            if (max_alloc_size < curr->block_size)
-            {
-                max_alloc_size = curr->block_size;
-                max_alloc_block = (void *)curr;
-            }
-        }
-    }
+/* Drops the pages of a range, which read as zero afterwards. Those of a
+ * shared mapping stay in its file unless they are punched out of it */
+static int
+mm_discard_pages(void *addr, size_t length, vm_bool_t is_shared)
+{
+    if (is_shared == MM_FALSE)
+        return madvise(addr, length, MADV_DONTNEED);
+#ifdef MADV_REMOVE
+    return madvise(addr, length, MADV_REMOVE);
+#else
+    return -1;
+#endif
 }
 
+/* Makes the kernel place the still untouched pages of a mapping on the
+ * given node, falling back to other nodes rather than failing. Memory of
+ * a simulated topology is left where the kernel puts it */
 static void
-mm_union_free_blocks(block_meta_data_t *first, block_meta_data_t *second)
+mm_numa_bind_memory(void *addr, size_t size, uint32_t numa_node)
 {
-    assert(first->is_free == MM_TRUE && second->is_free == MM_TRUE);
-    first->block_size += sizeof(block_meta_data_t) + second->block_size;
-    first->next_block = second->next_block;
-    if (second->next_block)
-        second->next_block->prev_block = first;
+    if (numa_topology.node_count == 1 || numa_topology.simulated == MM_TRUE)
+        return;
+#ifdef SYS_mbind
+    unsigned long nodemask[(MM_MAX_NUMA_NODES + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long))] = {0};
+    nodemask[numa_node / (8 * sizeof(unsigned long))] |= 1UL << (numa_node % (8 * sizeof(unsigned long)));
+    /* 1 is MPOL_PREFERRED of linux/mempolicy.h */
+    if (syscall(SYS_mbind, addr, size, 1, nodemask, (unsigned long)MM_MAX_NUMA_NODES + 1, 0))
+        printf("Error: Could not bind memory to NUMA node %u, errno %d\n", numa_node, errno);
+#endif
 }
 
-vm_bool_t
-mm_is_vm_page_empty(vm_page_t *vm_page)
+static inline int
+mm_span_reserve_units(uint32_t capacity)
 {
-    block_meta_data_t meta_block = vm_page->block_meta_data;
-    if (meta_block.is_free == MM_TRUE && meta_block.next_block == NULL && meta_block.prev_block == NULL)
-        return MM_TRUE;
-    return MM_FALSE;
+    return (int)((capacity * sizeof(void *) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
 }
 
-static inline uint32_t
-mm_max_page_allocatable_memory(int units)
+/* Huge page backed chunks are only ever released whole */
+static inline size_t
+mm_huge_chunk_size(void)
 {
-    return (uint32_t)((uint32_t)SYSTEM_PAGE_SIZE * units - (uint32_t)offset_of(vm_page_t, page_memory));
+    return MM_HUGE_PAGE_SIZE > MM_SPAN_ALIGNMENT ? MM_HUGE_PAGE_SIZE : MM_SPAN_ALIGNMENT;
 }
 
 static int
-free_blocks_comparison_fn(void *_block_meta_data_1, void *_block_meta_data_2)
+mm_compare_addresses(const void *a, const void *b)
 {
-    block_meta_data_t *block_meta_data_1 = (block_meta_data_t *)_block_meta_data_1;
-    block_meta_data_t *block_meta_data_2 = (block_meta_data_t *)_block_meta_data_2;
-    if (block_meta_data_1->block_size < block_meta_data_2->block_size)
-        return 1;
-    else if (block_meta_data_1->block_size > block_meta_data_2->block_size)
-        return -1;
-    else
-        return 0;
+    uintptr_t addr_a = (uintptr_t)*(void *const *)a;
+    uintptr_t addr_b = (uintptr_t)*(void *const *)b;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
 }
 
-static void
-mm_add_free_block_meta_data_to_free_block_list(vm_page_family_t *vm_page, block_meta_data_t *free_block)
+/* Reserve lock held, the stack has room for at least max_free and
+ * for needed spans */
+static vm_bool_t
+mm_span_reserve_ensure_capacity(mm_span_reserve_t *reserve, uint32_t needed)
 {
-    assert(free_block->is_free == MM_TRUE);
-    glthread_priority_insert(&vm_page->free_block_priority_list_head, &free_block->priority_thread_glue, free_blocks_comparison_fn, offset_of(block_meta_data_t, priority_thread_glue));
+    uint32_t capacity = reserve->max_free_spans;
+    if (reserve->capacity >= capacity && reserve->capacity >= needed)
+        return MM_TRUE;
+    if (capacity < needed)
+        capacity = needed * 2;
+    void **free_spans = (void **)mm_get_new_vm_page_from_kernel(mm_span_reserve_units(capacity));
+    if (!free_spans)
+        return MM_FALSE;
+    if (reserve->free_spans)
+    {
+        memcpy(free_spans, reserve->free_spans, reserve->free_span_count * sizeof(void *));
+        mm_return_vm_page_to_kernel((void *)reserve->free_spans, mm_span_reserve_units(reserve->capacity));
+    }
+    reserve->free_spans = free_spans;
+    reserve->capacity = capacity;
+    return MM_TRUE;
 }
 
-vm_page_t *
-allocate_vm_page(vm_page_family_t *vm_page_family)
+/* Reserve lock held. Huge page backed spans cannot be given back one
+ * by one, a chunk is unmapped once all of its spans are parked */
+static void
+mm_span_reserve_release_huge_chunks(mm_span_reserve_t *reserve, uint32_t keep)
 {
-    vm_page_t *vm_page = mm_get_new_vm_page_from_kernel(1);
-    MARK_VM_PAGE_EMPTY(vm_page);
-    vm_page->block_meta_data.block_size = mm_max_page_allocatable_memory(1);
-    vm_page->block_meta_data.offset = offset_of(vm_page_t, block_meta_data);
-    init_glthread(&vm_page->block_meta_data.priority_thread_glue);
-    vm_page->next = NULL;
-    vm_page->prev = NULL;
-    vm_page->pg_family = vm_page_family;
-
-    if (!vm_page_family->first_page)
+    uintptr_t chunk_mask = ~(uintptr_t)(mm_huge_chunk_size() - 1);
+    uint32_t spans_per_chunk = (uint32_t)(mm_huge_chunk_size() / MM_SPAN_ALIGNMENT);
+    uint32_t i = 0, run, kept = 0, remaining = reserve->free_span_count;
+    qsort(reserve->free_spans, reserve->free_span_count, sizeof(void *), mm_compare_addresses);
+    while (i < reserve->free_span_count)
     {
-        vm_page_family->first_page = vm_page;
-        return vm_page;
+        uintptr_t chunk = (uintptr_t)reserve->free_spans[i] & chunk_mask;
+        for (run = 1; i + run < reserve->free_span_count &&
+                      ((uintptr_t)reserve->free_spans[i + run] & chunk_mask) == chunk;
+             run++)
+            ;
+        if (run == spans_per_chunk && remaining - run >= keep)
+        {
+            munmap((void *)chunk, mm_huge_chunk_size());
+            remaining -= run;
+        }
+        else
+        {
+            memmove(reserve->free_spans + kept, reserve->free_spans + i, run * sizeof(void *));
+            kept += run;
+        }
+        i += run;
     }
-    vm_page->next = vm_page_family->first_page;
-    vm_page_family->first_page->prev = vm_page;
-    vm_page_family->first_page = vm_page;
-    return vm_page;
+    reserve->free_span_count = kept;
 }
 
+/* Reserve lock held. Releases the oldest parked spans, the ones at the
+ * bottom of the stack, until only keep remain */
 static void
-mm_return_vm_page_to_kernel(void *vm_page, int units)
+mm_span_reserve_release(mm_span_reserve_t *reserve, uint32_t keep)
 {
-    if (munmap(vm_page, SYSTEM_PAGE_SIZE * units))
+    uint32_t i, surplus;
+    /* A shm heap keeps its mapping, parked slots are already punched out */
+    if (reserve->free_span_count <= keep || reserve->shm_heap)
+        return;
+    if (reserve->huge_mode != MM_HUGE_PAGES_NONE)
     {
-        printf("Error: Could not unmap VM page to kernel\n");
+        mm_span_reserve_release_huge_chunks(reserve, keep);
+        return;
     }
+    surplus = reserve->free_span_count - keep;
+    for (i = 0; i < surplus; i++)
+        munmap((void *)((uintptr_t)reserve->free_spans[i] & ~MM_SPAN_ZEROED), MM_SPAN_ALIGNMENT);
+    memmove(reserve->free_spans, reserve->free_spans + surplus, keep * sizeof(void *));
+    reserve->free_span_count = keep;
 }
 
-void mm_vm_page_delete_and_free(vm_page_t *vm_page)
+/* Maps chunk_size bytes of huge page backed memory. Explicit huge pages
+ * fall back to transparent ones when the pool is empty or missing, and
+ * those to ordinary pages if the kernel does not do THP */
+static char *
+mm_map_huge_chunk(mm_span_reserve_t *reserve, size_t chunk_size)
 {
-    vm_page_family_t *vm_page_family = vm_page->pg_family;
-    if (vm_page_family->first_page == vm_page)
+    char *chunk = NULL;
+#ifdef MAP_HUGETLB
+    if (reserve->huge_mode == MM_HUGE_PAGES_EXPLICIT && reserve->hugetlb_unavailable == MM_FALSE)
     {
-        vm_page_family->first_page = vm_page->next;
-        if (vm_page->next)
-            vm_page->next->prev = vm_page;
-        vm_page->next = NULL;
-        vm_page->prev = NULL;
-        mm_return_vm_page_to_kernel((void *)vm_page, 1);
-        return;
+        chunk = mmap(0, chunk_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, 0, 0);
+        if (chunk != MAP_FAILED)
+            return chunk;
+        printf("Error: Explicit huge pages unavailable, falling back to transparent huge pages\n");
+        reserve->hugetlb_unavailable = MM_TRUE;
     }
-    if (vm_page->next)
-        vm_page->next->prev = vm_page;
-    vm_page->prev->next = vm_page->next;
-    mm_return_vm_page_to_kernel((void *)vm_page, 1);
-    return;
+#endif
+    chunk = mm_map_aligned_from_kernel(chunk_size, mm_huge_chunk_size());
+#ifdef MADV_HUGEPAGE
+    if (chunk)
+        madvise(chunk, chunk_size, MADV_HUGEPAGE);
+#endif
+    return chunk;
 }
 
-static vm_page_t *
-mm_family_new_page_add(vm_page_family_t *vm_page_family)
+/* Reserve lock held. Hands out slots of the heap never used before,
+ * which read as zero like the rest of a fresh file */
+static void
+mm_shm_heap_refill(mm_shm_heap_t *shm_heap, uint32_t spans)
 {
-
-    vm_page_t *vm_page = allocate_vm_page(vm_page_family);
-
-    if (!vm_page)
-        return NULL;
-
-    /* The new page is like one free block, add it to the
-     * free block list*/
-    mm_add_free_block_meta_data_to_free_block_list(
-        vm_page_family, &vm_page->block_meta_data);
-
-    return vm_page;
+    mm_span_reserve_t *reserve = &shm_heap->reserve;
+    uint32_t i, available = (uint32_t)((shm_heap->size - shm_heap->next_slot) / MM_SPAN_ALIGNMENT);
+    char *first = (char *)shm_heap->header + shm_heap->next_slot;
+    if (spans > available)
+        spans = available;
+    for (i = spans; i > 0; i--)
+        reserve->free_spans[reserve->free_span_count++] =
+            (void *)((uintptr_t)(first + (i - 1) * MM_SPAN_ALIGNMENT) | MM_SPAN_ZEROED);
+    shm_heap->next_slot += (uint64_t)spans * MM_SPAN_ALIGNMENT;
 }
 
-static vm_bool_t
-mm_split_free_data_block_for_allocation(vm_page_family_t *page_family, block_meta_data_t *free_block, uint32_t size)
+/* Reserve lock held */
+static void
+mm_span_reserve_refill(mm_span_reserve_t *reserve)
 {
-    assert(free_block->is_free == MM_TRUE);
-    block_meta_data_t *next_meta_block = NULL;
-    if (free_block->block_size < size)
+    uint32_t i, spans = reserve->chunk_spans;
+    char *chunk = NULL;
+    if (reserve->huge_mode != MM_HUGE_PAGES_NONE)
     {
-        return MM_FALSE;
+        uint32_t spans_per_chunk = (uint32_t)(mm_huge_chunk_size() / MM_SPAN_ALIGNMENT);
+        spans = (spans + spans_per_chunk - 1) / spans_per_chunk * spans_per_chunk;
     }
-    uint32_t remaining_size = free_block->block_size - size;
-    free_block->is_free = MM_FALSE;
-    free_block->block_size = size;
-    remove_glthread(&free_block->priority_thread_glue);
-
-    /* Case 1: No split */
-    if (!remaining_size)
+    if (mm_span_reserve_ensure_capacity(reserve, reserve->free_span_count + spans) == MM_FALSE)
+        return;
+    if (reserve->shm_heap)
     {
-        return MM_TRUE;
+        mm_shm_heap_refill(reserve->shm_heap, spans);
+        return;
     }
+    if (reserve->huge_mode != MM_HUGE_PAGES_NONE)
+        chunk = mm_map_huge_chunk(reserve, spans * MM_SPAN_ALIGNMENT);
+    else
+        chunk = mm_map_aligned_from_kernel(spans * MM_SPAN_ALIGNMENT, MM_SPAN_ALIGNMENT);
+    if (!chunk)
+        return;
+    mm_numa_bind_memory(chunk, spans * MM_SPAN_ALIGNMENT, reserve->numa_node);
+    /* Push in reverse so that the lowest addresses are handed out first */
+    for (i = spans; i > 0; i--)
+        reserve->free_spans[reserve->free_span_count++] =
+            (void *)((uintptr_t)(chunk + (i - 1) * MM_SPAN_ALIGNMENT) | MM_SPAN_ZEROED);
+}
 
-    /* Case 2: Partial split */
-    /* Soft Internal Fragmentation */
-    else if (sizeof(block_meta_data_t) < remaining_size && remaining_size < sizeof(block_meta_data_t) + page_family->struct_size)
-    {
-        next_meta_block = NEXT_META_BLOCK_BY_SIZE(free_block);
-        next_meta_block->is_free = MM_TRUE;
-        next_meta_block->block_size = remaining_size - sizeof(block_meta_data_t);
-        next_meta_block->offset = free_block->offset + sizeof(block_meta_data_t) + free_block->block_size;
-
-        init_glthread(&next_meta_block->priority_thread_glue);
-
-        mm_bind_blocks_for_allocation(free_block, next_meta_block);
+/* Spans of up to MM_MAX_SPAN_PAGES pages for block, slab and arena
+ * pages. The span is not cleared, is_zeroed tells whether it is known
+ * to be zero */
+static void *
+mm_get_new_vm_span(mm_span_reserve_t *reserve, int units, vm_bool_t *is_zeroed)
+{
+    uintptr_t vm_span = 0;
+    assert(units <= MM_MAX_SPAN_PAGES);
+    pthread_mutex_lock(&span_reserve_lock);
+    if (!reserve->free_span_count)
+        mm_span_reserve_refill(reserve);
+    if (reserve->free_span_count)
+        vm_span = (uintptr_t)reserve->free_spans[--reserve->free_span_count];
+    pthread_mutex_unlock(&span_reserve_lock);
+    *is_zeroed = (vm_span & MM_SPAN_ZEROED) ? MM_TRUE : MM_FALSE;
+    return (void *)(vm_span & ~MM_SPAN_ZEROED);
+}
 
-        mm_add_free_block_meta_data_to_free_block_list(page_family, next_meta_block);
+static void
+mm_return_vm_span(mm_span_reserve_t *reserve, void *vm_span)
+{
+    pthread_mutex_lock(&span_reserve_lock);
+    if (reserve->free_span_count >= reserve->max_free_spans)
+        mm_span_reserve_release(reserve, reserve->min_free_spans);
+    if (mm_span_reserve_ensure_capacity(reserve, reserve->free_span_count + 1) == MM_FALSE)
+    {
+        pthread_mutex_unlock(&span_reserve_lock);
+        munmap(vm_span, MM_SPAN_ALIGNMENT);
+        return;
     }
-
-    /* Hard Internal Fragmentation */
-    else if (remaining_size < sizeof(block_meta_data_t))
+    /* Beyond the low watermark let the kernel reclaim the memory lazily,
+     * the span is still reused without a fault if it has not done so.
+     * Only discarding guarantees zero contents on the next touch. Slots
+     * of a shm heap are always punched out, the heap keeps its mapping
+     * and nothing else gives their pages back. Huge page backed spans
+     * are left alone, advising part of a huge page would split it */
+    if (reserve->huge_mode == MM_HUGE_PAGES_NONE &&
+        (reserve->shm_heap || reserve->free_span_count >= reserve->min_free_spans))
     {
-        /* No need to do anything */
+#ifdef MADV_FREE
+        if (reserve->shm_heap || madvise(vm_span, MM_SPAN_ALIGNMENT, MADV_FREE))
+#endif
+            if (!mm_discard_pages(vm_span, MM_SPAN_ALIGNMENT, reserve->shm_heap ? MM_TRUE : MM_FALSE))
+                vm_span = (void *)((uintptr_t)vm_span | MM_SPAN_ZEROED);
     }
+    reserve->free_spans[reserve->free_span_count++] = vm_span;
+    pthread_mutex_unlock(&span_reserve_lock);
+}
 
-    /* Case 3: Full Split */
-    else
+/* Reserve lock held. A run of slots for a large object, taken from the
+ * parked slots where they hold one and from the unused end of the heap
+ * otherwise. is_zeroed tells whether all of it is known to be zero */
+static char *
+mm_shm_heap_take_slots(mm_shm_heap_t *shm_heap, uint32_t slots, vm_bool_t *is_zeroed)
+{
+    mm_span_reserve_t *reserve = &shm_heap->reserve;
+    uintptr_t slot = 0, prev_slot = 0;
+    uint32_t i, run = 0;
+    char *first = NULL;
+    *is_zeroed = MM_TRUE;
+    if (reserve->free_span_count >= slots)
     {
-        next_meta_block = NEXT_META_BLOCK_BY_SIZE(free_block);
-        next_meta_block->is_free = MM_TRUE;
-        next_meta_block->block_size = remaining_size - sizeof(block_meta_data_t);
-        next_meta_block->offset = free_block->offset + sizeof(block_meta_data_t) + free_block->block_size;
-
-        init_glthread(&next_meta_block->priority_thread_glue);
-        mm_bind_blocks_for_allocation(free_block, next_meta_block);
-        mm_add_free_block_meta_data_to_free_block_list(page_family, next_meta_block);
+        qsort(reserve->free_spans, reserve->free_span_count, sizeof(void *), mm_compare_addresses);
+        for (i = 0; i < reserve->free_span_count && run < slots; i++)
+        {
+            slot = (uintptr_t)reserve->free_spans[i] & ~MM_SPAN_ZEROED;
+            run = run && slot == prev_slot + MM_SPAN_ALIGNMENT ? run + 1 : 1;
+            prev_slot = slot;
+        }
+        if (run == slots)
+        {
+            i -= slots;
+            first = (char *)((uintptr_t)reserve->free_spans[i] & ~MM_SPAN_ZEROED);
+            for (run = 0; run < slots; run++)
+            {
+                if (!((uintptr_t)reserve->free_spans[i + run] & MM_SPAN_ZEROED))
+                    *is_zeroed = MM_FALSE;
+            }
+            memmove(reserve->free_spans + i, reserve->free_spans + i + slots,
+                    (reserve->free_span_count - i - slots) * sizeof(void *));
+            reserve->free_span_count -= slots;
+            return first;
+        }
     }
-    return MM_TRUE;
+    if (shm_heap->size - shm_heap->next_slot < (uint64_t)slots * MM_SPAN_ALIGNMENT)
+        return NULL;
+    first = (char *)shm_heap->header + shm_heap->next_slot;
+    shm_heap->next_slot += (uint64_t)slots * MM_SPAN_ALIGNMENT;
+    return first;
 }
 
-static block_meta_data_t *
-mm_allocate_free_data_block(vm_page_family_t *page_family, uint32_t req_size)
+static inline uint32_t
+mm_shm_heap_slots(uint64_t span_pages)
 {
-    vm_bool_t status = MM_FALSE;
+    return (uint32_t)((span_pages * SYSTEM_PAGE_SIZE + MM_SPAN_ALIGNMENT - 1) / MM_SPAN_ALIGNMENT);
+}
 
-    block_meta_data_t *first_free_block = mm_get_largest_free_block_page_family(page_family);
-    if (!first_free_block || first_free_block->block_size < req_size)
+/* Zero filled like a fresh mapping */
+static void *
+mm_shm_heap_get_large_span(mm_shm_heap_t *shm_heap, uint64_t span_pages)
+{
+    uint32_t slots = mm_shm_heap_slots(span_pages);
+    vm_bool_t is_zeroed = MM_FALSE;
+    char *vm_span = NULL;
+    pthread_mutex_lock(&span_reserve_lock);
+    vm_span = mm_shm_heap_take_slots(shm_heap, slots, &is_zeroed);
+    pthread_mutex_unlock(&span_reserve_lock);
+    if (!vm_span)
     {
-        vm_page_t *vm_page = mm_family_new_page_add(page_family);
-        status = mm_split_free_data_block_for_allocation(page_family, &vm_page->block_meta_data, req_size);
-        if (status == MM_TRUE)
-            return &vm_page->block_meta_data;
+        printf("Error: %s() Shm heap has no room for %u slots\n", __FUNCTION__, slots);
         return NULL;
     }
-    if (first_free_block)
+    if (is_zeroed == MM_FALSE)
+        memset(vm_span, 0, (size_t)slots * MM_SPAN_ALIGNMENT);
+    return (void *)vm_span;
+}
+
+/* The slots of a large object are parked one by one, for pages or for
+ * another large object that fits in a run of them */
+static void
+mm_shm_heap_return_large_span(mm_shm_heap_t *shm_heap, void *vm_span, uint64_t span_pages)
+{
+    mm_span_reserve_t *reserve = &shm_heap->reserve;
+    uint32_t i, slots = mm_shm_heap_slots(span_pages);
+    uintptr_t zeroed = mm_discard_pages(vm_span, (size_t)slots * MM_SPAN_ALIGNMENT, MM_TRUE) ? 0 : MM_SPAN_ZEROED;
+    pthread_mutex_lock(&span_reserve_lock);
+    /* Never grows, the stack has room for every slot of the heap */
+    if (mm_span_reserve_ensure_capacity(reserve, reserve->free_span_count + slots) == MM_TRUE)
     {
-        status = mm_split_free_data_block_for_allocation(page_family, first_free_block, req_size);
-        if (status == MM_TRUE)
-            return first_free_block;
-        return NULL;
+        for (i = slots; i > 0; i--)
+            reserve->free_spans[reserve->free_span_count++] =
+                (void *)(((uintptr_t)vm_span + (i - 1) * MM_SPAN_ALIGNMENT) | zeroed);
     }
+    pthread_mutex_unlock(&span_reserve_lock);
 }
 
-void *
-xcalloc(char *struct_name, int units)
+void mm_set_page_reserve(uint32_t chunk_spans, uint32_t min_free_spans, uint32_t max_free_spans)
 {
-    vm_page_family_t *page_family = lookup_page_family_by_name(struct_name);
-    if (!page_family)
+    uint32_t node, mode;
+    if (!chunk_spans || min_free_spans > max_free_spans || chunk_spans > max_free_spans)
     {
-        printf("Error: Stucture %s is not registered with memory manager\n", struct_name);
-        return NULL;
+        printf("Error: %s() Invalid reserve configuration\n", __FUNCTION__);
+        return;
     }
-    if (units * page_family->struct_size > mm_max_page_allocatable_memory(1))
+    pthread_mutex_lock(&span_reserve_lock);
+    for (node = 0; node < MM_MAX_NUMA_NODES; node++)
     {
-        printf("Error: Memory requested exceeds page size\n");
-        return NULL;
+        for (mode = 0; mode < MM_HUGE_PAGE_MODES; mode++)
+        {
+            mm_span_reserve_t *reserve = &span_reserves[node][mode];
+            reserve->chunk_spans = chunk_spans;
+            reserve->min_free_spans = min_free_spans;
+            reserve->max_free_spans = max_free_spans;
+            if (reserve->free_span_count > max_free_spans)
+                mm_span_reserve_release(reserve, max_free_spans);
+        }
     }
-    block_meta_data_t *free_block_meta_data = NULL;
-    free_block_meta_data = mm_allocate_free_data_block(page_family, units * page_family->struct_size);
-    if (free_block_meta_data)
+    pthread_mutex_unlock(&span_reserve_lock);
+}
+
+void mm_trim_page_reserve()
+{
+    uint32_t node, mode;
+    pthread_mutex_lock(&span_reserve_lock);
+    for (node = 0; node < MM_MAX_NUMA_NODES; node++)
     {
-        memset((char *)(free_block_meta_data + 1), 0, free_block_meta_data->block_size);
-        return (void *)(free_block_meta_data + 1);
+        for (mode = 0; mode < MM_HUGE_PAGE_MODES; mode++)
+            mm_span_reserve_release(&span_reserves[node][mode], 0);
     }
-    return NULL;
+    pthread_mutex_unlock(&span_reserve_lock);
 }
 
-static void
-dump_vm_data_page(vm_page_t *vm_page, int page_count)
+void mm_set_huge_pages(mm_huge_page_mode_t mode)
 {
-    printf("%d  Page %d\n", vm_page, page_count);
-    printf("next -> %d ", vm_page->next);
-    printf("prev -> %d ", vm_page->prev);
+    if ((uint32_t)mode >= MM_HUGE_PAGE_MODES)
+    {
+        printf("Error: %s() Invalid huge page mode\n", __FUNCTION__);
+        return;
+    }
+    __atomic_store_n(&default_huge_page_mode, mode, __ATOMIC_RELAXED);
 }
 
-static void
-dump_meta_block_data(block_meta_data_t *block_meta, int count)
+static inline uint32_t
+mm_max_page_allocatable_memory(int units)
 {
-    printf("%d    ", block_meta);
-    printf("Block %d    ", count);
-    if (block_meta->is_free)
-        printf("F R E E D    ");
-    else
-        printf("ALLOCATED    ");
-    printf("block-size = %d    ", block_meta->block_size);
-    printf("next = %d    ", block_meta->next_block);
-    printf("prev = %d    ", block_meta->prev_block);
+    return (uint32_t)((uint32_t)SYSTEM_PAGE_SIZE * units - (uint32_t)offset_of(vm_page_t, page_memory));
 }
 
-static void
-dump_memory_usage_for_page_family(vm_page_family_t *pg_family)
+/* Smallest power of two span holding MM_SPAN_MIN_OBJECTS structs */
+static uint32_t
+mm_family_span_pages(uint32_t struct_size)
 {
-    vm_page_t *vm_page_curr = NULL;
-    int count = 0, page_count = 0;
-    ITERATE_VM_PAGE_BEGIN(pg_family, vm_page_curr)
-    {
+    uint32_t span_pages = 1;
+    while (span_pages < MM_MAX_SPAN_PAGES &&
+           mm_max_page_allocatable_memory(span_pages) < (uint64_t)struct_size * MM_SPAN_MIN_OBJECTS)
+        span_pages <<= 1;
+    return span_pages;
+}
 
-        dump_vm_data_page(vm_page_curr, page_count);
-        printf("\n");
+/* Requests that do not fit a fresh page of the family, padding for the
+ * alignment and a debug canary included, are mapped as large objects */
+static inline vm_bool_t
+mm_is_large_request(vm_page_family_t *vm_page_family, uint64_t req_size, uint32_t alignment)
+{
+    uint64_t size = req_size + debug_canary_bytes;
+    if (alignment > 1)
+        size = MM_ALIGNED_REQUEST_SIZE(size, alignment);
+    return size > mm_max_page_allocatable_memory(vm_page_family->span_pages) ? MM_TRUE : MM_FALSE;
+}
 
-        block_meta_data_t *block_meta_curr = NULL;
-        ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page_curr, block_meta_curr)
-        {
-            dump_meta_block_data(block_meta_curr, count);
-            printf("\n");
-            count++;
-        }
-        ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page_curr, block_meta_curr)
-        page_count++;
-        printf("\n");
-    }
-    ITERATE_VM_PAGE_END(pg_family, vm_page_curr)
+/* Bytes of units structs of the family, 0 for a unit count below one or
+ * an object too large to map */
+static inline uint64_t
+mm_request_size(vm_page_family_t *vm_page_family, int units)
+{
+    uint64_t req_size = (uint64_t)units * vm_page_family->struct_size;
+    if (units <= 0 || req_size / SYSTEM_PAGE_SIZE >= MM_MAX_OBJECT_PAGES)
+        return 0;
+    return req_size;
 }
 
-void mm_print_memory_usage(char *struct_name)
+static mm_family_hash_table_t family_hash_table = {0, 0, NULL};
+
+static uint32_t
+mm_hash_struct_name(char *struct_name)
 {
-    if (!struct_name)
+    /* FNV-1a over at most MM_MAX_STRUCT_NAME characters */
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+    for (i = 0; i < MM_MAX_STRUCT_NAME && struct_name[i]; i++)
     {
-        vm_page_family_t *pg_family_curr = NULL;
-        ITERATE_PAGE_FAMILIES_BEGIN(first_vm_page_for_family, pg_family_curr)
-        {
-            printf("Page family -> %s", pg_family_curr->struct_name);
-            printf("\n");
-            dump_memory_usage_for_page_family(pg_family_curr);
-        }
-        ITERATE_PAGE_FAMILIES_END(first_vm_page_for_family, pg_family_curr)
+        hash ^= (unsigned char)struct_name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    else
-    {
-        vm_page_family_t *pg_family = lookup_page_family_by_name(struct_name);
-        dump_memory_usage_for_page_family(pg_family);
-    }
+static inline int
+mm_family_hash_table_units(uint32_t capacity)
+{
+    return (int)((capacity * sizeof(vm_page_family_t *) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
 }
 
-static int
-mm_get_hard_internal_frag_size(block_meta_data_t *first, block_meta_data_t *second)
+static void
+mm_family_hash_table_place(vm_page_family_t **buckets, uint32_t capacity, vm_page_family_t *vm_page_family)
 {
-    block_meta_data_t *next_block = NEXT_META_BLOCK_BY_SIZE(first);
-    return (int)((unsigned long)second - (unsigned long)next_block);
+    uint32_t index = vm_page_family->name_hash & (capacity - 1);
+    while (buckets[index])
+        index = (index + 1) & (capacity - 1);
+    buckets[index] = vm_page_family;
 }
 
-static block_meta_data_t *
-mm_free_blocks(block_meta_data_t *to_be_free_block)
+static vm_bool_t
+mm_family_hash_table_resize(uint32_t new_capacity)
+{
+    uint32_t i;
+    vm_page_family_t **new_buckets = (vm_page_family_t **)mm_get_new_vm_page_from_kernel(mm_family_hash_table_units(new_capacity));
+    if (!new_buckets)
+        return MM_FALSE;
+    for (i = 0; i < family_hash_table.capacity; i++)
+    {
+        if (family_hash_table.buckets[i])
+            mm_family_hash_table_place(new_buckets, new_capacity, family_hash_table.buckets[i]);
+    }
+    if (family_hash_table.buckets)
+        mm_return_vm_page_to_kernel((void *)family_hash_table.buckets, mm_family_hash_table_units(family_hash_table.capacity));
+    family_hash_table.buckets = new_buckets;
+    family_hash_table.capacity = new_capacity;
+    return MM_TRUE;
+}
+
+/* Grows the index ahead of an insert, so that a family is never
+ * registered without being found by name. Keeps the load factor at or
+ * below one half so probe chains stay short */
+static vm_bool_t
+mm_family_hash_table_make_room(void)
+{
+    uint32_t new_capacity = family_hash_table.capacity ? family_hash_table.capacity * 2 : MM_FAMILY_HASH_MIN_CAPACITY;
+    if ((family_hash_table.count + 1) * 2 <= family_hash_table.capacity)
+        return MM_TRUE;
+    if (mm_family_hash_table_resize(new_capacity) == MM_FALSE)
+    {
+        printf("Error: %s() Could not grow the page family index\n", __FUNCTION__);
+        return MM_FALSE;
+    }
+    return MM_TRUE;
+}
+
+/* After mm_family_hash_table_make_room() */
+static void
+mm_family_hash_table_insert(vm_page_family_t *vm_page_family)
+{
+    mm_family_hash_table_place(family_hash_table.buckets, family_hash_table.capacity, vm_page_family);
+    family_hash_table.count++;
+}
+
+static vm_page_family_t *
+mm_family_hash_table_lookup(char *struct_name, uint32_t name_hash)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    if (!family_hash_table.capacity)
+        return NULL;
+    uint32_t index = name_hash & (family_hash_table.capacity - 1);
+    while ((vm_page_family = family_hash_table.buckets[index]) != NULL)
+    {
+        if (vm_page_family->name_hash == name_hash &&
+            strncmp(vm_page_family->struct_name, struct_name, MM_MAX_STRUCT_NAME) == 0)
+            return vm_page_family;
+        index = (index + 1) & (family_hash_table.capacity - 1);
+    }
+    return NULL;
+}
+
+/* NUMA topology */
+
+/* Parses a sysfs cpulist such as "0-3,8-11" */
+static void
+mm_numa_parse_cpulist(char *cpulist, uint32_t numa_node)
+{
+    char *curr = cpulist;
+    while (*curr >= '0' && *curr <= '9')
+    {
+        unsigned long cpu = strtoul(curr, &curr, 10), last_cpu = cpu;
+        if (*curr == '-')
+            last_cpu = strtoul(curr + 1, &curr, 10);
+        for (; cpu <= last_cpu && cpu < MM_NUMA_MAX_CPUS; cpu++)
+            numa_topology.cpu_to_node[cpu] = (uint8_t)numa_node;
+        if (*curr == ',')
+            curr++;
+    }
+}
+
+/* Without sysfs the machine is taken to be a single node */
+static void
+mm_numa_init(void)
+{
+    char path[64], cpulist[4096];
+    uint32_t numa_node;
+    FILE *fp = NULL;
+    if (span_reserves_ready == MM_FALSE)
+        mm_span_reserves_init();
+    /* Families already registered have their node pools sized */
+    if (family_hash_table.count || numa_topology.simulated == MM_TRUE)
+        return;
+    numa_topology.node_count = 1;
+    memset(numa_topology.cpu_to_node, 0, sizeof(numa_topology.cpu_to_node));
+    for (numa_node = 0; numa_node < MM_MAX_NUMA_NODES; numa_node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", numa_node);
+        fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        if (fgets(cpulist, sizeof(cpulist), fp))
+            mm_numa_parse_cpulist(cpulist, numa_node);
+        fclose(fp);
+        numa_topology.node_count = numa_node + 1;
+    }
+}
+
+/* The calling thread's node. Also refreshes the node the thread cache
+ * compares against, which is why slow paths ask rather than remember */
+static uint32_t
+mm_numa_current_node(void)
+{
+    int cpu;
+    uint32_t numa_node = 0;
+    if (numa_topology.node_count == 1)
+        return 0;
+    if (thread_numa_binding >= 0)
+        numa_node = (uint32_t)thread_numa_binding;
+    else if ((cpu = sched_getcpu()) >= 0 && cpu < MM_NUMA_MAX_CPUS)
+        numa_node = numa_topology.cpu_to_node[cpu];
+    thread_numa_node = numa_node;
+    return numa_node;
+}
+
+uint32_t
+mm_numa_node_count()
+{
+    return numa_topology.node_count;
+}
+
+int mm_numa_simulate(uint32_t node_count)
+{
+    uint32_t cpu;
+    if (!node_count || node_count > MM_MAX_NUMA_NODES)
+    {
+        printf("Error: %s() Invalid node count %u\n", __FUNCTION__, node_count);
+        return -1;
+    }
+    pthread_mutex_lock(&family_registry_lock);
+    if (family_hash_table.count)
+    {
+        pthread_mutex_unlock(&family_registry_lock);
+        printf("Error: %s() Page families are already registered\n", __FUNCTION__);
+        return -1;
+    }
+    for (cpu = 0; cpu < MM_NUMA_MAX_CPUS; cpu++)
+        numa_topology.cpu_to_node[cpu] = (uint8_t)(cpu % node_count);
+    numa_topology.node_count = node_count;
+    numa_topology.simulated = MM_TRUE;
+    pthread_mutex_unlock(&family_registry_lock);
+    return 0;
+}
+
+int mm_numa_set_thread_node(int numa_node)
+{
+    if (numa_node >= (int)numa_topology.node_count)
+    {
+        printf("Error: %s() Invalid node %d\n", __FUNCTION__, numa_node);
+        return -1;
+    }
+    thread_numa_binding = numa_node < 0 ? -1 : numa_node;
+    mm_numa_current_node();
+    return 0;
+}
+
+/* Node pools of all families are cut from shared pages. Registry lock held */
+static char *family_nodes_bump = NULL;
+static char *family_nodes_limit = NULL;
+
+static vm_bool_t
+mm_reserve_family_nodes(size_t size)
+{
+    int units = 0;
+    if (family_nodes_bump && family_nodes_bump + size <= family_nodes_limit)
+        return MM_TRUE;
+    units = (int)((size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
+    family_nodes_bump = (char *)mm_get_new_vm_page_from_kernel(units);
+    if (!family_nodes_bump)
+    {
+        family_nodes_limit = NULL;
+        return MM_FALSE;
+    }
+    family_nodes_limit = family_nodes_bump + units * SYSTEM_PAGE_SIZE;
+    return MM_TRUE;
+}
+
+static mm_family_node_t *
+mm_allocate_family_nodes(uint32_t node_count)
+{
+    size_t size = node_count * sizeof(mm_family_node_t);
+    mm_family_node_t *nodes = NULL;
+    uint32_t numa_node, i;
+    if (mm_reserve_family_nodes(size) == MM_FALSE)
+        return NULL;
+    nodes = (mm_family_node_t *)family_nodes_bump;
+    family_nodes_bump += size;
+    /* Fresh pages are zero, only the lists need setting up */
+    for (numa_node = 0; numa_node < node_count; numa_node++)
+    {
+        for (i = 0; i < MM_PAGE_OCCUPANCY_CLASSES * MM_PAGE_FREE_BINS; i++)
+            init_glthread(&nodes[numa_node].partial_pages[i / MM_PAGE_FREE_BINS][i % MM_PAGE_FREE_BINS]);
+        init_glthread(&nodes[numa_node].full_pages);
+        init_glthread(&nodes[numa_node].slab_partial_pages);
+    }
+    return nodes;
+}
+
+static vm_bool_t
+mm_family_has_pages(vm_page_family_t *vm_page_family)
+{
+    uint32_t numa_node;
+    if (vm_page_family->first_page)
+        return MM_TRUE;
+    for (numa_node = 0; numa_node < vm_page_family->node_count; numa_node++)
+    {
+        if (vm_page_family->nodes[numa_node].slab_page_count)
+            return MM_TRUE;
+    }
+    return MM_FALSE;
+}
+
+/* Returns MM_FALSE if the node pools could not be allocated */
+static vm_bool_t
+mm_init_page_family(vm_page_family_t *vm_page_family, char *struct_name, uint32_t struct_size)
+{
+    vm_page_family->node_count = numa_topology.node_count;
+    vm_page_family->nodes = mm_allocate_family_nodes(vm_page_family->node_count);
+    if (!vm_page_family->nodes)
+        return MM_FALSE;
+    strncpy(vm_page_family->struct_name, struct_name, MM_MAX_STRUCT_NAME);
+    vm_page_family->struct_size = struct_size;
+    vm_page_family->first_page = NULL;
+    vm_page_family->name_hash = mm_hash_struct_name(vm_page_family->struct_name);
+    vm_page_family->family_id = family_registry.count;
+    vm_page_family->span_pages = mm_family_span_pages(struct_size);
+    pthread_mutex_init(&vm_page_family->family_lock, NULL);
+    vm_page_family->slab_mode = MM_FALSE;
+    vm_page_family->alignment = 1;
+    vm_page_family->relocate = NULL;
+    vm_page_family->relocate_arg = NULL;
+    vm_page_family->compacting = MM_FALSE;
+    vm_page_family->size_class = NULL;
+    vm_page_family->is_size_class = MM_FALSE;
+    vm_page_family->shared_objects = 0;
+    vm_page_family->shared_bytes = 0;
+    vm_page_family->huge_mode = __atomic_load_n(&default_huge_page_mode, __ATOMIC_RELAXED);
+    /* Huge page backed slots are resident as a whole, use all of them */
+    if (vm_page_family->huge_mode != MM_HUGE_PAGES_NONE)
+        vm_page_family->span_pages = MM_MAX_SPAN_PAGES;
+    return MM_TRUE;
+}
+
+/* Registry lock held. Size class families are added without a name
+ * in the index */
+static vm_page_family_t *
+mm_registry_add_family(char *struct_name, uint32_t struct_size)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    if (!family_registry.families)
+    {
+        /* Only the part holding registered families is ever backed */
+        void *families = mmap(NULL, (size_t)MM_MAX_FAMILIES * sizeof(vm_page_family_t), PROT_READ | PROT_WRITE,
+                              MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (families == MAP_FAILED)
+        {
+            printf("Error: %s() Could not reserve the page family registry\n", __FUNCTION__);
+            return NULL;
+        }
+        family_registry.families = (vm_page_family_t *)families;
+    }
+    if (family_registry.count == MM_MAX_FAMILIES)
+    {
+        printf("Error: %s() No room for page family %s\n", __FUNCTION__, struct_name);
+        return NULL;
+    }
+    vm_page_family = &family_registry.families[family_registry.count];
+    if (mm_init_page_family(vm_page_family, struct_name, struct_size) == MM_FALSE)
+    {
+        printf("Error: %s() Could not allocate the node pools of page family %s\n", __FUNCTION__, struct_name);
+        return NULL;
+    }
+    family_registry.count++;
+    return vm_page_family;
+}
+
+static vm_bool_t
+mm_family_join_size_class(vm_page_family_t *vm_page_family);
+
+/* Registry lock held */
+static vm_page_family_t *
+mm_register_page_family(char *struct_name, uint32_t struct_size)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    if (mm_family_hash_table_lookup(struct_name, mm_hash_struct_name(struct_name)))
+    {
+        printf("Error: %s() Page family %s is already registered\n", __FUNCTION__, struct_name);
+        return NULL;
+    }
+    if (mm_family_hash_table_make_room() == MM_FALSE)
+        return NULL;
+    vm_page_family = mm_registry_add_family(struct_name, struct_size);
+    if (!vm_page_family)
+        return NULL;
+    mm_family_hash_table_insert(vm_page_family);
+    if (__atomic_load_n(&size_class_sharing, __ATOMIC_RELAXED) && struct_size <= MM_SIZE_CLASS_MAX)
+        mm_family_join_size_class(vm_page_family);
+    return vm_page_family;
+}
+
+vm_page_family_t *
+mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    pthread_mutex_lock(&family_registry_lock);
+    vm_page_family = mm_register_page_family(struct_name, struct_size);
+    pthread_mutex_unlock(&family_registry_lock);
+    return vm_page_family;
+}
+
+uint32_t
+mm_instantiate_page_families(const mm_family_spec_t *specs, uint32_t count, mm_family_handle_t *handles)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    uint32_t i, registered = 0;
+    uint32_t capacity = MM_FAMILY_HASH_MIN_CAPACITY;
+    pthread_mutex_lock(&family_registry_lock);
+    /* Size the index for the whole table at once instead of doubling it
+     * along the way */
+    while ((uint64_t)(family_hash_table.count + count) * 2 > capacity && capacity < MM_MAX_FAMILIES * 2)
+        capacity *= 2;
+    if (capacity > family_hash_table.capacity && mm_family_hash_table_resize(capacity) == MM_FALSE)
+        printf("Error: %s() Could not grow the page family index\n", __FUNCTION__);
+    /* Likewise the node pools, from a single mapping */
+    mm_reserve_family_nodes((size_t)count * numa_topology.node_count * sizeof(mm_family_node_t));
+    for (i = 0; i < count; i++)
+    {
+        vm_page_family = mm_register_page_family((char *)specs[i].struct_name, specs[i].struct_size);
+        if (vm_page_family)
+            registered++;
+        if (handles)
+            handles[i] = vm_page_family;
+    }
+    pthread_mutex_unlock(&family_registry_lock);
+    return registered;
+}
+
+void mm_print_registered_page_families()
+{
+    vm_page_family_t *vm_page_family_curr = NULL;
+    printf("System page size: %d\n", (int)SYSTEM_PAGE_SIZE);
+    pthread_mutex_lock(&family_registry_lock);
+    printf("Registered page families: %u\n", family_registry.count);
+    ITERATE_PAGE_FAMILIES_BEGIN(&family_registry, vm_page_family_curr)
+    {
+        printf("Page family: %s, Struct size: %d\n", vm_page_family_curr->struct_name, vm_page_family_curr->struct_size);
+    }
+    ITERATE_PAGE_FAMILIES_END(&family_registry, vm_page_family_curr)
+    pthread_mutex_unlock(&family_registry_lock);
+}
+
+vm_page_family_t *
+lookup_page_family_by_name(char *struct_name)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    uint32_t name_hash = mm_hash_struct_name(struct_name);
+    pthread_mutex_lock(&family_registry_lock);
+    vm_page_family = mm_family_hash_table_lookup(struct_name, name_hash);
+    pthread_mutex_unlock(&family_registry_lock);
+    return vm_page_family;
+}
+
+mm_family_handle_t
+mm_get_family_handle(char *struct_name)
+{
+    return lookup_page_family_by_name(struct_name);
+}
+
+static void
+mm_union_free_blocks(block_meta_data_t *first, block_meta_data_t *second)
+{
+    assert(MM_BLOCK_IS_FREE(first) == MM_TRUE && MM_BLOCK_IS_FREE(second) == MM_TRUE);
+    mm_block_set_size(first, MM_BLOCK_SIZE(first) + sizeof(block_meta_data_t) + MM_BLOCK_SIZE(second));
+    MM_LINK_NEXT_META_BLOCK(first);
+}
+
+vm_bool_t
+mm_is_vm_page_empty(vm_page_t *vm_page)
+{
+    /* One free block reaching the end of the page */
+    block_meta_data_t *meta_block = &vm_page->block_meta_data;
+    if (MM_BLOCK_IS_FREE(meta_block) == MM_TRUE && NEXT_META_BLOCK(meta_block) == NULL)
+        return MM_TRUE;
+    return MM_FALSE;
+}
+
+/* Family lock held. Moves a block page to the list matching its use
+ * and its largest free block, pages without a free block a unit fits
+ * in count as full */
+static void
+mm_page_update_occupancy(vm_page_t *vm_page)
+{
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    uint32_t capacity = mm_max_page_allocatable_memory(vm_page->span_pages);
+    uint32_t occupancy_class = MM_PAGE_FULL, free_bin = 0;
+    if (vm_page->largest_free && vm_page->largest_free >= vm_page->pg_family->struct_size)
+    {
+        occupancy_class = (uint32_t)((uint64_t)(capacity - vm_page->free_bytes) * MM_PAGE_OCCUPANCY_CLASSES / (capacity + 1));
+        free_bin = mm_page_free_bin_index(vm_page->largest_free);
+    }
+    if (occupancy_class == vm_page->occupancy_class && free_bin == vm_page->free_bin)
+        return;
+    remove_glthread(&vm_page->partial_glue);
+    if (vm_page->occupancy_class != MM_PAGE_FULL &&
+        IS_GLTHREAD_LIST_EMPTY(&node_pool->partial_pages[vm_page->occupancy_class][vm_page->free_bin]))
+        node_pool->partial_bin_bitmap[vm_page->occupancy_class] &= ~(1u << vm_page->free_bin);
+    if (occupancy_class == MM_PAGE_FULL)
+        glthread_add_next(&node_pool->full_pages, &vm_page->partial_glue);
+    else
+    {
+        glthread_add_next(&node_pool->partial_pages[occupancy_class][free_bin], &vm_page->partial_glue);
+        node_pool->partial_bin_bitmap[occupancy_class] |= (1u << free_bin);
+    }
+    vm_page->occupancy_class = occupancy_class;
+    vm_page->free_bin = free_bin;
+}
+
+/* Family lock held. Follows a page's largest free block going from
+ * old_largest to its current size. Blocks a unit does not fit in are not
+ * counted. Only when the last page holding the node's largest block
+ * shrinks are the pages of the highest free bin searched again */
+static void
+mm_node_update_largest_free(vm_page_t *vm_page, uint32_t old_largest)
+{
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    uint32_t struct_size = vm_page->pg_family->struct_size;
+    uint32_t new_largest = vm_page->largest_free >= struct_size ? vm_page->largest_free : 0;
+    uint32_t occupancy_class, bins = 0;
+    glthread_t *curr = NULL;
+    if (old_largest < struct_size)
+        old_largest = 0;
+    if (new_largest == old_largest)
+        return;
+    if (new_largest > node_pool->largest_free)
+    {
+        node_pool->largest_free = new_largest;
+        node_pool->largest_free_pages = 1;
+        return;
+    }
+    if (new_largest == node_pool->largest_free)
+        node_pool->largest_free_pages++;
+    if (old_largest != node_pool->largest_free || --node_pool->largest_free_pages)
+        return;
+    node_pool->largest_free = 0;
+    for (occupancy_class = 0; occupancy_class < MM_PAGE_OCCUPANCY_CLASSES; occupancy_class++)
+        bins |= node_pool->partial_bin_bitmap[occupancy_class];
+    if (!bins)
+        return;
+    for (occupancy_class = 0; occupancy_class < MM_PAGE_OCCUPANCY_CLASSES; occupancy_class++)
+    {
+        glthread_t *list = &node_pool->partial_pages[occupancy_class][31 - __builtin_clz(bins)];
+        ITERATE_GLTHREAD_BEGIN(list, curr)
+        {
+            vm_page_t *partial_page = glthread_to_partial_page(curr);
+            if (partial_page->largest_free > node_pool->largest_free)
+            {
+                node_pool->largest_free = partial_page->largest_free;
+                node_pool->largest_free_pages = 0;
+            }
+            if (partial_page->largest_free == node_pool->largest_free)
+                node_pool->largest_free_pages++;
+        }
+        ITERATE_GLTHREAD_END(list, curr);
+    }
+}
+
+static void
+mm_add_free_block_meta_data_to_free_block_list(vm_page_family_t *vm_page_family, block_meta_data_t *free_block)
+{
+    assert(MM_BLOCK_IS_FREE(free_block) == MM_TRUE);
+    vm_page_t *vm_page = MM_GET_PAGE_FROM_META_BLOCK(free_block);
+    mm_family_node_t *node_pool = &vm_page_family->nodes[vm_page->numa_node];
+    uint32_t bin = mm_page_free_bin_index(MM_BLOCK_SIZE(free_block));
+    init_glthread(MM_BLOCK_GLUE(free_block));
+    glthread_add_next(&vm_page->free_blocks[bin], MM_BLOCK_GLUE(free_block));
+    vm_page->free_bin_bitmap |= 1u << bin;
+    vm_page->free_bytes += MM_BLOCK_SIZE(free_block);
+    node_pool->free_block_count++;
+    node_pool->free_block_bytes += MM_BLOCK_SIZE(free_block);
+    if (vm_page->largest_free < MM_BLOCK_SIZE(free_block))
+    {
+        uint32_t old_largest = vm_page->largest_free;
+        vm_page->largest_free = MM_BLOCK_SIZE(free_block);
+        mm_page_update_occupancy(vm_page);
+        mm_node_update_largest_free(vm_page, old_largest);
+        return;
+    }
+    mm_page_update_occupancy(vm_page);
+}
+
+/* Must be called before the block size changes. Unlinking zeroes the
+ * glue, so the payload is as zero as before it was filed and stays
+ * covered by the page's dirty limit */
+static void
+mm_remove_free_block_meta_data_from_free_block_list(vm_page_family_t *vm_page_family, block_meta_data_t *free_block)
+{
+    vm_page_t *vm_page = MM_GET_PAGE_FROM_META_BLOCK(free_block);
+    mm_family_node_t *node_pool = &vm_page_family->nodes[vm_page->numa_node];
+    uint32_t bin = mm_page_free_bin_index(MM_BLOCK_SIZE(free_block));
+    remove_glthread(MM_BLOCK_GLUE(free_block));
+    if (IS_GLTHREAD_LIST_EMPTY(&vm_page->free_blocks[bin]))
+        vm_page->free_bin_bitmap &= ~(1u << bin);
+    vm_page->free_bytes -= MM_BLOCK_SIZE(free_block);
+    node_pool->free_block_count--;
+    node_pool->free_block_bytes -= MM_BLOCK_SIZE(free_block);
+    if (MM_BLOCK_SIZE(free_block) == vm_page->largest_free)
+    {
+        block_meta_data_t *largest = mm_get_largest_free_block_of_page(vm_page);
+        vm_page->largest_free = largest ? MM_BLOCK_SIZE(largest) : 0;
+        /* Refiled first, a rescan of the node sees the page where it now is */
+        mm_page_update_occupancy(vm_page);
+        mm_node_update_largest_free(vm_page, MM_BLOCK_SIZE(free_block));
+        return;
+    }
+    mm_page_update_occupancy(vm_page);
+}
+
+/* Best fit within the page. It is in the request's own bin, or else in
+ * the lowest non-empty bin above it, where every block fits. An exact
+ * fit ends the walk */
+static block_meta_data_t *
+mm_find_free_block_of_page(vm_page_t *vm_page, uint32_t req_size)
+{
+    glthread_t *list = NULL, *curr = NULL;
+    block_meta_data_t *block_meta_data = NULL, *best = NULL;
+    uint32_t bin = mm_page_free_bin_index(req_size);
+    uint32_t bins = vm_page->free_bin_bitmap & ~((1u << bin) - 1);
+    while (bins && !best)
+    {
+        list = &vm_page->free_blocks[__builtin_ctz(bins)];
+        bins &= bins - 1;
+        ITERATE_GLTHREAD_BEGIN(list, curr)
+        {
+            block_meta_data = glthread_to_block_meta_data(curr);
+            if (MM_BLOCK_SIZE(block_meta_data) < req_size)
+                continue;
+            if (!best || MM_BLOCK_SIZE(block_meta_data) < MM_BLOCK_SIZE(best))
+                best = block_meta_data;
+            if (MM_BLOCK_SIZE(best) == req_size)
+                break;
+        }
+        ITERATE_GLTHREAD_END(list, curr);
+    }
+    return best;
+}
+
+/* The fullest page with room for the request is preferred. Within an
+ * occupancy class the first page of the request's own bin is tried,
+ * then any page of a higher bin, which always has room. Only when no
+ * class has such a page are the request's own bins scanned */
+static block_meta_data_t *
+mm_find_free_block_for_size(mm_family_node_t *node_pool, uint32_t req_size)
+{
+    glthread_t *list = NULL, *curr = NULL;
+    vm_page_t *vm_page = NULL;
+    uint32_t bin = mm_page_free_bin_index(req_size);
+    uint32_t higher_bins = ~((2u << bin) - 1);
+    int occupancy_class;
+
+    for (occupancy_class = MM_PAGE_OCCUPANCY_CLASSES - 1; occupancy_class >= 0; occupancy_class--)
+    {
+        uint32_t bins = node_pool->partial_bin_bitmap[occupancy_class];
+        if (bins & (1u << bin))
+        {
+            list = &node_pool->partial_pages[occupancy_class][bin];
+            vm_page = glthread_to_partial_page(list->right);
+            if (vm_page->largest_free >= req_size)
+                return mm_find_free_block_of_page(vm_page, req_size);
+            /* Step it back, so the next request tries another page */
+            glthread_t *next = vm_page->partial_glue.right;
+            if (next)
+            {
+                remove_glthread(&vm_page->partial_glue);
+                glthread_add_next(next, &vm_page->partial_glue);
+            }
+        }
+        if (bins & higher_bins)
+        {
+            list = &node_pool->partial_pages[occupancy_class][__builtin_ctz(bins & higher_bins)];
+            return mm_find_free_block_of_page(glthread_to_partial_page(list->right), req_size);
+        }
+    }
+    for (occupancy_class = MM_PAGE_OCCUPANCY_CLASSES - 1; occupancy_class >= 0; occupancy_class--)
+    {
+        list = &node_pool->partial_pages[occupancy_class][bin];
+        ITERATE_GLTHREAD_BEGIN(list, curr)
+        {
+            vm_page = glthread_to_partial_page(curr);
+            if (vm_page->largest_free >= req_size)
+                return mm_find_free_block_of_page(vm_page, req_size);
+        }
+        ITERATE_GLTHREAD_END(list, curr);
+    }
+    return NULL;
+}
+
+/* Remote memory is the last resort, when the local node cannot supply
+ * a new page. Nodes are tried in order, not by distance */
+static block_meta_data_t *
+mm_find_remote_free_block_for_size(vm_page_family_t *vm_page_family, uint32_t local_node, uint32_t req_size)
+{
+    uint32_t numa_node;
+    block_meta_data_t *free_block = NULL;
+    for (numa_node = 0; numa_node < vm_page_family->node_count && !free_block; numa_node++)
+    {
+        if (numa_node != local_node)
+            free_block = mm_find_free_block_for_size(&vm_page_family->nodes[numa_node], req_size);
+    }
+    return free_block;
+}
+
+/* Records that [start, end) of the page is about to be handed out or
+ * written, returns MM_TRUE if that range is still known to be zero */
+static inline vm_bool_t
+mm_vm_page_mark_dirty(vm_page_t *vm_page, char *start, char *end)
+{
+    uint32_t start_offset = (uint32_t)(start - (char *)vm_page);
+    uint32_t end_offset = (uint32_t)(end - (char *)vm_page);
+    vm_bool_t is_zeroed = start_offset >= vm_page->dirty_limit ? MM_TRUE : MM_FALSE;
+    if (end_offset > vm_page->dirty_limit)
+        vm_page->dirty_limit = end_offset;
+    return is_zeroed;
+}
+
+/* Debug mode */
+
+static inline uint64_t
+mm_debug_canary(void *app_data)
+{
+    return ((uint64_t)(uintptr_t)app_data * 0x9E3779B97F4A7C15ull) ^ debug_canary_secret;
+}
+
+/* The canary follows the payload, slab slots leave room for one after
+ * the largest object their family holds */
+static inline char *
+mm_debug_canary_address(vm_page_t *vm_page, void *app_data)
+{
+    if (vm_page->page_kind == MM_PAGE_SLAB)
+        return (char *)app_data + vm_page->pg_family->struct_size;
+    if (vm_page->page_kind == MM_PAGE_LARGE)
+        return (char *)app_data + vm_page->large_object_size;
+    return (char *)app_data + MM_BLOCK_SIZE((block_meta_data_t *)app_data - 1);
+}
+
+/* Block pages must have been marked dirty up to the canary's end */
+static inline void
+mm_debug_arm_canary(void *app_data)
+{
+    uint64_t canary = mm_debug_canary(app_data);
+    memcpy(mm_debug_canary_address(MM_GET_PAGE_FROM_APP_DATA(app_data), app_data), &canary, sizeof(canary));
+}
+
+/* Freed into a thread cache or the quarantine */
+static inline vm_bool_t
+mm_debug_canary_is_freed(vm_page_t *vm_page, void *app_data)
+{
+    uint64_t canary = 0;
+    memcpy(&canary, mm_debug_canary_address(vm_page, app_data), sizeof(canary));
+    return canary == (mm_debug_canary(app_data) ^ MM_DEBUG_CANARY_FREED) ? MM_TRUE : MM_FALSE;
+}
+
+/* Blocks are allocated with room for the canary, which then moves from
+ * the payload to the tail so that the block keeps its requested size */
+static inline void
+mm_debug_trim_block(block_meta_data_t *block_meta_data)
+{
+    mm_block_set_size(block_meta_data, MM_BLOCK_SIZE(block_meta_data) - MM_DEBUG_CANARY_BYTES);
+    mm_block_set_tail(block_meta_data, MM_BLOCK_TAIL(block_meta_data) + MM_DEBUG_CANARY_BYTES);
+    MM_PAGE_NODE_POOL(MM_GET_PAGE_FROM_META_BLOCK(block_meta_data))->bytes_in_use -= MM_DEBUG_CANARY_BYTES;
+}
+
+vm_page_t *
+allocate_vm_page(vm_page_family_t *vm_page_family, uint32_t numa_node)
+{
+    uint32_t i;
+    vm_bool_t is_zeroed = MM_FALSE;
+    vm_page_t *vm_page = mm_get_new_vm_span(mm_family_span_reserve(vm_page_family, numa_node),
+                                            vm_page_family->span_pages, &is_zeroed);
+    if (!vm_page)
+        return NULL;
+    MARK_VM_PAGE_EMPTY(vm_page);
+    vm_page->span_pages = vm_page_family->span_pages;
+    vm_page->dirty_limit = is_zeroed == MM_TRUE ? (uint32_t)(uintptr_t)offset_of(vm_page_t, page_memory)
+                                                : vm_page->span_pages * (uint32_t)SYSTEM_PAGE_SIZE;
+    mm_block_set_size(&vm_page->block_meta_data, mm_max_page_allocatable_memory(vm_page->span_pages));
+    vm_page->next = NULL;
+    vm_page->prev = NULL;
+    vm_page->pg_family = vm_page_family;
+    vm_page->page_kind = MM_PAGE_BLOCKS;
+    vm_page->sampled_objects = 0;
+    vm_page->numa_node = numa_node;
+    for (i = 0; i < MM_PAGE_FREE_BINS; i++)
+        init_glthread(&vm_page->free_blocks[i]);
+    vm_page->free_bin_bitmap = 0;
+    vm_page->free_bytes = 0;
+    vm_page->largest_free = 0;
+    vm_page->occupancy_class = MM_PAGE_FULL;
+    vm_page->free_bin = 0;
+    init_glthread(&vm_page->partial_glue);
+    glthread_add_next(&vm_page_family->nodes[numa_node].full_pages, &vm_page->partial_glue);
+    vm_page_family->nodes[numa_node].block_page_count++;
+
+    if (!vm_page_family->first_page)
+    {
+        vm_page_family->first_page = vm_page;
+        return vm_page;
+    }
+    vm_page->next = vm_page_family->first_page;
+    vm_page_family->first_page->prev = vm_page;
+    vm_page_family->first_page = vm_page;
+    return vm_page;
+}
+
+void mm_vm_page_delete_and_free(vm_page_t *vm_page)
+{
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    mm_span_reserve_t *reserve = mm_family_span_reserve(vm_page_family, vm_page->numa_node);
+    MM_PAGE_NODE_POOL(vm_page)->block_page_count--;
+    /* Its last free block is off the page's list by now */
+    remove_glthread(&vm_page->partial_glue);
+    if (vm_page_family->first_page == vm_page)
+    {
+        vm_page_family->first_page = vm_page->next;
+        if (vm_page->next)
+            vm_page->next->prev = NULL;
+        vm_page->next = NULL;
+        vm_page->prev = NULL;
+        mm_return_vm_span(reserve, (void *)vm_page);
+        return;
+    }
+    if (vm_page->next)
+        vm_page->next->prev = vm_page->prev;
+    vm_page->prev->next = vm_page->next;
+    mm_return_vm_span(reserve, (void *)vm_page);
+    return;
+}
+
+static vm_page_t *
+mm_family_new_page_add(vm_page_family_t *vm_page_family, uint32_t numa_node)
+{
+
+    vm_page_t *vm_page = allocate_vm_page(vm_page_family, numa_node);
+
+    if (!vm_page)
+        return NULL;
+
+    /* The new page is like one free block, add it to the
+     * free block list*/
+    mm_add_free_block_meta_data_to_free_block_list(
+        vm_page_family, &vm_page->block_meta_data);
+
+    return vm_page;
+}
+
+/* is_zeroed tells whether the size bytes of payload are known zero, which
+ * must be asked before the header split off behind them is written */
+static vm_bool_t
+mm_split_free_data_block_for_allocation(vm_page_family_t *page_family, block_meta_data_t *free_block, uint32_t size,
+                                        vm_bool_t *is_zeroed)
+{
+    assert(MM_BLOCK_IS_FREE(free_block) == MM_TRUE);
+    block_meta_data_t *next_meta_block = NULL;
+    uint32_t free_size = MM_BLOCK_SIZE(free_block), extent = MM_BLOCK_EXTENT(size);
+    if (free_size < size)
+    {
+        return MM_FALSE;
+    }
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(MM_GET_PAGE_FROM_META_BLOCK(free_block));
+    mm_remove_free_block_meta_data_from_free_block_list(page_family, free_block);
+    *is_zeroed = mm_vm_page_mark_dirty(MM_GET_PAGE_FROM_META_BLOCK(free_block), (char *)(free_block + 1),
+                                       (char *)(free_block + 1) + size);
+    node_pool->objects_in_use++;
+    node_pool->bytes_in_use += size;
+
+    /* Case 1: No split. Hard internal fragmentation, whatever is left
+     * cannot hold a free block and becomes the tail */
+    if (free_size < extent + MM_MIN_FREE_BLOCK)
+    {
+        mm_block_init(free_block, MM_FALSE, size, free_size - size);
+        return MM_TRUE;
+    }
+
+    /* Case 2: Split */
+    mm_block_init(free_block, MM_FALSE, size, extent - size);
+    next_meta_block = (block_meta_data_t *)MM_BLOCK_END(free_block);
+    mm_block_init(next_meta_block, MM_TRUE, free_size - extent - sizeof(block_meta_data_t), 0);
+    mm_vm_page_mark_dirty(MM_GET_PAGE_FROM_META_BLOCK(free_block), (char *)next_meta_block, (char *)(next_meta_block + 1));
+    mm_bind_blocks_for_allocation(free_block, next_meta_block);
+    mm_add_free_block_meta_data_to_free_block_list(page_family, next_meta_block);
+    return MM_TRUE;
+}
+
+/* Local free blocks first, then a new local page, then remote blocks */
+static block_meta_data_t *
+mm_get_free_block_on_node(vm_page_family_t *page_family, uint32_t numa_node, uint32_t req_size)
+{
+    block_meta_data_t *free_block = mm_find_free_block_for_size(&page_family->nodes[numa_node], req_size);
+    if (free_block || page_family->compacting == MM_TRUE)
+        return free_block;
+    vm_page_t *vm_page = mm_family_new_page_add(page_family, numa_node);
+    if (vm_page)
+        return &vm_page->block_meta_data;
+    return mm_find_remote_free_block_for_size(page_family, numa_node, req_size);
+}
+
+static block_meta_data_t *
+mm_allocate_free_data_block(vm_page_family_t *page_family, uint32_t numa_node, uint32_t req_size, vm_bool_t *is_zeroed)
+{
+    block_meta_data_t *free_block = mm_get_free_block_on_node(page_family, numa_node, req_size);
+    if (!free_block)
+        return NULL;
+    if (mm_split_free_data_block_for_allocation(page_family, free_block, req_size, is_zeroed) == MM_TRUE)
+        return free_block;
+    return NULL;
+}
+
+/* Moves the header of free_block, which is off its list, gap bytes
+ * forward. The gap goes to the tail of the previous block, or is split
+ * off as a free block of its own when it can hold one. Returns the
+ * moved free block, filed again */
+static block_meta_data_t *
+mm_shift_free_block(vm_page_family_t *page_family, block_meta_data_t *free_block, uint32_t gap)
+{
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(free_block);
+    block_meta_data_t *shifted_block = (block_meta_data_t *)((char *)free_block + gap);
+    /* The two headers overlap when the gap is small */
+    block_meta_data_t *prev_block = PREV_META_BLOCK(free_block);
+    uint32_t block_size = MM_BLOCK_SIZE(free_block);
+    mm_vm_page_mark_dirty(hosting_page, (char *)shifted_block, (char *)(shifted_block + 1));
+    mm_block_init(shifted_block, MM_TRUE, block_size - gap, 0);
+    if (gap < MM_MIN_FREE_BLOCK)
+    {
+        /* Hard internal fragmentation, reclaimed when the previous block is freed */
+        mm_block_set_tail(prev_block, MM_BLOCK_TAIL(prev_block) + gap);
+        mm_bind_blocks_for_allocation(prev_block, shifted_block);
+    }
+    else
+    {
+        mm_block_set_size(free_block, gap - sizeof(block_meta_data_t));
+        mm_bind_blocks_for_allocation(free_block, shifted_block);
+        mm_add_free_block_meta_data_to_free_block_list(page_family, free_block);
+    }
+    mm_add_free_block_meta_data_to_free_block_list(page_family, shifted_block);
+    return shifted_block;
+}
+
+static block_meta_data_t *
+mm_allocate_aligned_data_block(vm_page_family_t *page_family, uint32_t numa_node, uint32_t req_size, uint32_t alignment,
+                               vm_bool_t *is_zeroed)
+{
+    block_meta_data_t *free_block =
+        mm_get_free_block_on_node(page_family, numa_node, (uint32_t)MM_ALIGNED_REQUEST_SIZE(req_size, alignment));
+    if (!free_block)
+        return NULL;
+    uintptr_t payload = (uintptr_t)(free_block + 1);
+    uint32_t gap = (uint32_t)(MM_ALIGN_UP(payload, alignment) - payload);
+    /* The first block of a page is part of the page header and stays put,
+     * and a tail only has room for MM_BLOCK_MAX_TAIL bytes */
+    block_meta_data_t *prev_block = PREV_META_BLOCK(free_block);
+    while (gap && gap < MM_MIN_FREE_BLOCK && (!prev_block || MM_BLOCK_TAIL(prev_block) + gap > MM_BLOCK_MAX_TAIL))
+        gap += alignment;
+    if (gap)
+    {
+        mm_remove_free_block_meta_data_from_free_block_list(page_family, free_block);
+        free_block = mm_shift_free_block(page_family, free_block, gap);
+    }
+    if (mm_split_free_data_block_for_allocation(page_family, free_block, req_size, is_zeroed) == MM_TRUE)
+        return free_block;
+    return NULL;
+}
+
+/* Cuts up to max_count single unit blocks off the front of one free
+ * block in a single pass. The free block leaves its list once, and only
+ * what is left after the last block is filed again, by the regular
+ * split. Returns the number of blocks carved, their payloads in out */
+static int
+mm_carve_free_blocks(vm_page_family_t *page_family, uint32_t numa_node, int max_count, void **out, vm_bool_t *is_zeroed)
+{
+    uint32_t size = page_family->struct_size, extent = MM_BLOCK_EXTENT(size + debug_canary_bytes);
+    int count = 0;
+    block_meta_data_t *next_meta_block = NULL;
+    block_meta_data_t *free_block = mm_get_free_block_on_node(page_family, numa_node, size + debug_canary_bytes);
+    if (!free_block)
+        return 0;
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(free_block);
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(hosting_page);
+    mm_remove_free_block_meta_data_from_free_block_list(page_family, free_block);
+
+    while (count + 1 < max_count && MM_BLOCK_SIZE(free_block) - extent >= sizeof(block_meta_data_t) + extent)
+    {
+        uint32_t remaining_size = MM_BLOCK_SIZE(free_block) - extent - sizeof(block_meta_data_t);
+        /* Before the next header is written right behind the payload */
+        is_zeroed[count] = mm_vm_page_mark_dirty(hosting_page, (char *)(free_block + 1),
+                                                 (char *)(free_block + 1) + size + debug_canary_bytes);
+        mm_block_init(free_block, MM_FALSE, size, extent - size);
+        next_meta_block = (block_meta_data_t *)MM_BLOCK_END(free_block);
+        mm_block_init(next_meta_block, MM_TRUE, remaining_size, 0);
+        mm_vm_page_mark_dirty(hosting_page, (char *)next_meta_block, (char *)(next_meta_block + 1));
+        mm_bind_blocks_for_allocation(free_block, next_meta_block);
+        node_pool->objects_in_use++;
+        node_pool->bytes_in_use += size;
+
+        if (debug_canary_bytes)
+            mm_debug_arm_canary(free_block + 1);
+        out[count++] = (void *)(free_block + 1);
+        free_block = next_meta_block;
+    }
+
+    mm_add_free_block_meta_data_to_free_block_list(page_family, free_block);
+    mm_split_free_data_block_for_allocation(page_family, free_block, size + debug_canary_bytes, &is_zeroed[count]);
+    if (debug_canary_bytes)
+    {
+        mm_debug_trim_block(free_block);
+        mm_debug_arm_canary(free_block + 1);
+    }
+    out[count++] = (void *)(free_block + 1);
+    return count;
+}
+
+static block_meta_data_t *
+mm_free_blocks(block_meta_data_t *to_be_free_block);
+
+static vm_page_t *
+mm_slab_page_add(vm_page_family_t *vm_page_family, uint32_t numa_node)
+{
+    vm_bool_t is_zeroed = MM_FALSE;
+    vm_page_t *vm_page = mm_get_new_vm_span(mm_family_span_reserve(vm_page_family, numa_node),
+                                            vm_page_family->span_pages, &is_zeroed);
+    if (!vm_page)
+        return NULL;
+    vm_page->pg_family = vm_page_family;
+    vm_page->page_kind = MM_PAGE_SLAB;
+    vm_page->sampled_objects = 0;
+    vm_page->numa_node = numa_node;
+    vm_page->span_pages = vm_page_family->span_pages;
+    vm_page->dirty_limit = is_zeroed == MM_TRUE ? (uint32_t)(uintptr_t)offset_of(vm_page_t, page_memory)
+                                                : vm_page->span_pages * (uint32_t)SYSTEM_PAGE_SIZE;
+    vm_page->slab_in_use = 0;
+    vm_page->slab_carved = 0;
+    vm_page->slab_free_head = NULL;
+    init_glthread(&vm_page->partial_glue);
+    glthread_add_next(&vm_page_family->nodes[numa_node].slab_partial_pages, &vm_page->partial_glue);
+    vm_page_family->nodes[numa_node].slab_page_count++;
+    return vm_page;
+}
+
+/* Same order of preference as for blocks: local partial pages, a new
+ * local page, then partial pages of other nodes */
+static vm_page_t *
+mm_slab_get_partial_page(vm_page_family_t *vm_page_family, uint32_t numa_node)
+{
+    uint32_t remote_node;
+    vm_page_t *vm_page = NULL;
+    if (!IS_GLTHREAD_LIST_EMPTY(&vm_page_family->nodes[numa_node].slab_partial_pages))
+        return glthread_to_partial_page(vm_page_family->nodes[numa_node].slab_partial_pages.right);
+    if (vm_page_family->compacting == MM_TRUE)
+        return NULL;
+    vm_page = mm_slab_page_add(vm_page_family, numa_node);
+    for (remote_node = 0; !vm_page && remote_node < vm_page_family->node_count; remote_node++)
+    {
+        if (!IS_GLTHREAD_LIST_EMPTY(&vm_page_family->nodes[remote_node].slab_partial_pages))
+            vm_page = glthread_to_partial_page(vm_page_family->nodes[remote_node].slab_partial_pages.right);
+    }
+    return vm_page;
+}
+
+static void *
+mm_slab_allocate_object(vm_page_family_t *vm_page_family, uint32_t numa_node, vm_bool_t *is_zeroed)
+{
+    void *app_data = NULL;
+    vm_page_t *vm_page = mm_slab_get_partial_page(vm_page_family, numa_node);
+    if (!vm_page)
+        return NULL;
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+
+    /* Reuse freed slots first, then carve untouched ones lazily */
+    if (vm_page->slab_free_head)
+    {
+        app_data = vm_page->slab_free_head;
+        vm_page->slab_free_head = *(void **)app_data;
+        *is_zeroed = MM_FALSE;
+    }
+    else
+    {
+        app_data = (char *)vm_page + vm_page_family->slab_first_slot + vm_page->slab_carved * vm_page_family->slab_slot_size;
+        vm_page->slab_carved++;
+        *is_zeroed = mm_vm_page_mark_dirty(vm_page, (char *)app_data, (char *)app_data + vm_page_family->slab_slot_size);
+    }
+    vm_page->slab_in_use++;
+    node_pool->slab_object_count++;
+    node_pool->objects_in_use++;
+    node_pool->bytes_in_use += vm_page_family->struct_size;
+    if (vm_page->slab_in_use == vm_page_family->slab_slots_per_page)
+        remove_glthread(&vm_page->partial_glue);
+    return app_data;
+}
+
+static void
+mm_slab_free_object(vm_page_t *vm_page, void *app_data)
+{
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    if (vm_page->slab_in_use == vm_page_family->slab_slots_per_page)
+        glthread_add_next(&node_pool->slab_partial_pages, &vm_page->partial_glue);
+    *(void **)app_data = vm_page->slab_free_head;
+    vm_page->slab_free_head = app_data;
+    vm_page->slab_in_use--;
+    node_pool->slab_object_count--;
+    node_pool->objects_in_use--;
+    node_pool->bytes_in_use -= vm_page_family->struct_size;
+    if (!vm_page->slab_in_use)
+    {
+        remove_glthread(&vm_page->partial_glue);
+        node_pool->slab_page_count--;
+        mm_return_vm_span(mm_family_span_reserve(vm_page_family, vm_page->numa_node), (void *)vm_page);
+    }
+}
+
+static inline uint16_t *
+mm_size_class_owner_tag(vm_page_t *vm_page, void *app_data)
+{
+    vm_page_family_t *size_class = vm_page->pg_family;
+    uint32_t slot = (uint32_t)((char *)app_data - (char *)vm_page - size_class->slab_first_slot) / size_class->slab_slot_size;
+    return &MM_SLAB_OWNER_TAGS(vm_page)[slot];
+}
+
+static inline vm_page_family_t *
+mm_size_class_owner(vm_page_t *vm_page, void *app_data)
+{
+    return &family_registry.families[*mm_size_class_owner_tag(vm_page, app_data)];
+}
+
+/* Records the family an object of a size class family was allocated
+ * for, only slab slots are shared */
+static void
+mm_size_class_set_owner(vm_page_family_t *owner, void *app_data)
+{
+    vm_page_t *vm_page = MM_GET_PAGE_FROM_APP_DATA(app_data);
+    if (vm_page->page_kind != MM_PAGE_SLAB)
+        return;
+    *mm_size_class_owner_tag(vm_page, app_data) = (uint16_t)owner->family_id;
+    if (owner->size_class)
+    {
+        __atomic_fetch_add(&owner->shared_objects, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&owner->shared_bytes, owner->struct_size, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+mm_size_class_release_owner(vm_page_t *vm_page, void *app_data)
+{
+    vm_page_family_t *owner = mm_size_class_owner(vm_page, app_data);
+    if (owner->size_class)
+    {
+        __atomic_fetch_sub(&owner->shared_objects, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&owner->shared_bytes, owner->struct_size, __ATOMIC_RELAXED);
+    }
+}
+
+/* Slots are aligned like the family's payloads and hold the free stack
+ * link, and the payload's canary in debug mode */
+static void
+mm_family_update_slab_layout(vm_page_family_t *vm_page_family)
+{
+    uint32_t slot_alignment = vm_page_family->alignment > sizeof(void *) ? vm_page_family->alignment : sizeof(void *);
+    uint32_t slot_size = vm_page_family->struct_size + debug_canary_bytes;
+    if (slot_size < sizeof(void *))
+        slot_size = sizeof(void *);
+    uint32_t header_size = (uint32_t)(uintptr_t)offset_of(vm_page_t, page_memory);
+    uint32_t span_size = (uint32_t)SYSTEM_PAGE_SIZE * vm_page_family->span_pages;
+    vm_page_family->slab_slot_size = MM_ALIGN_UP(slot_size, slot_alignment);
+    if (vm_page_family->is_size_class == MM_TRUE)
+    {
+        /* Owner tags go between the header and slot 0 */
+        vm_page_family->slab_slots_per_page = (span_size - header_size - slot_alignment) /
+                                              (vm_page_family->slab_slot_size + sizeof(uint16_t));
+        vm_page_family->slab_first_slot = MM_ALIGN_UP(header_size + vm_page_family->slab_slots_per_page *
+                                                      (uint32_t)sizeof(uint16_t), slot_alignment);
+        return;
+    }
+    vm_page_family->slab_first_slot = MM_ALIGN_UP(header_size, slot_alignment);
+    vm_page_family->slab_slots_per_page = (span_size - vm_page_family->slab_first_slot) / vm_page_family->slab_slot_size;
+}
+
+mm_family_handle_t
+mm_page_family_enable_slab(mm_family_handle_t vm_page_family)
+{
+    if (!vm_page_family)
+        return NULL;
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    if (mm_family_has_pages(vm_page_family) == MM_TRUE)
+    {
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        printf("Error: %s() Page family %s already has pages allocated\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    vm_page_family->slab_mode = MM_TRUE;
+    mm_family_update_slab_layout(vm_page_family);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return vm_page_family;
+}
+
+mm_family_handle_t
+mm_page_family_set_huge_pages(mm_family_handle_t vm_page_family, mm_huge_page_mode_t mode)
+{
+    if (!vm_page_family)
+        return NULL;
+    if ((uint32_t)mode >= MM_HUGE_PAGE_MODES)
+    {
+        printf("Error: %s() Invalid huge page mode\n", __FUNCTION__);
+        return NULL;
+    }
+    if (vm_page_family->shm_heap && mode != MM_HUGE_PAGES_NONE)
+    {
+        printf("Error: %s() Page family %s lives in a shm heap\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    if (mm_family_has_pages(vm_page_family) == MM_TRUE)
+    {
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        printf("Error: %s() Page family %s already has pages allocated\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    vm_page_family->huge_mode = mode;
+    vm_page_family->span_pages = mode == MM_HUGE_PAGES_NONE ? mm_family_span_pages(vm_page_family->struct_size)
+                                                            : MM_MAX_SPAN_PAGES;
+    if (vm_page_family->slab_mode == MM_TRUE)
+        mm_family_update_slab_layout(vm_page_family);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return vm_page_family;
+}
+
+mm_family_handle_t
+mm_page_family_set_alignment(mm_family_handle_t vm_page_family, uint32_t alignment)
+{
+    if (!vm_page_family)
+        return NULL;
+    if (!alignment || (alignment & (alignment - 1)) || alignment > SYSTEM_PAGE_SIZE)
+    {
+        printf("Error: %s() Invalid alignment %u\n", __FUNCTION__, alignment);
+        return NULL;
+    }
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    if (mm_family_has_pages(vm_page_family) == MM_TRUE)
+    {
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        printf("Error: %s() Page family %s already has pages allocated\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    if (vm_page_family->size_class && alignment > sizeof(void *))
+    {
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        printf("Error: %s() Page family %s shares pointer aligned pages\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    vm_page_family->alignment = alignment;
+    if (vm_page_family->slab_mode == MM_TRUE)
+        mm_family_update_slab_layout(vm_page_family);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return vm_page_family;
+}
+
+/* Registry lock held, and the family's lock unless it is being
+ * registered. The family must not have any pages */
+static vm_bool_t
+mm_family_join_size_class(vm_page_family_t *vm_page_family)
+{
+    uint32_t index = 0;
+    char class_name[MM_MAX_STRUCT_NAME];
+    vm_page_family_t *size_class = NULL;
+    if (vm_page_family->struct_size > MM_SIZE_CLASS_MAX || vm_page_family->alignment > sizeof(void *) ||
+        vm_page_family->is_size_class == MM_TRUE || vm_page_family->shm_heap)
+        return MM_FALSE;
+    while (size_class_sizes[index] < vm_page_family->struct_size)
+        index++;
+    size_class = size_class_families[index];
+    if (!size_class)
+    {
+        snprintf(class_name, sizeof(class_name), "size_class_%u", size_class_sizes[index]);
+        size_class = mm_registry_add_family(class_name, size_class_sizes[index]);
+        if (!size_class)
+            return MM_FALSE;
+        size_class->is_size_class = MM_TRUE;
+        size_class->slab_mode = MM_TRUE;
+        mm_family_update_slab_layout(size_class);
+        size_class_families[index] = size_class;
+    }
+    vm_page_family->size_class = size_class;
+    return MM_TRUE;
+}
+
+mm_family_handle_t
+mm_page_family_share_size_class(mm_family_handle_t vm_page_family)
+{
+    vm_bool_t is_shared = MM_FALSE;
+    if (!vm_page_family)
+        return NULL;
+    pthread_mutex_lock(&family_registry_lock);
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    if (mm_family_has_pages(vm_page_family) == MM_TRUE)
+    {
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        pthread_mutex_unlock(&family_registry_lock);
+        printf("Error: %s() Page family %s already has pages allocated\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    is_shared = vm_page_family->size_class ? MM_TRUE : mm_family_join_size_class(vm_page_family);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    pthread_mutex_unlock(&family_registry_lock);
+    if (is_shared == MM_FALSE)
+    {
+        printf("Error: %s() Page family %s has no size class\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    return vm_page_family;
+}
+
+void mm_set_size_class_sharing(int enable)
+{
+    __atomic_store_n(&size_class_sharing, enable, __ATOMIC_RELAXED);
+}
+
+mm_family_handle_t
+mm_page_family_size_class(mm_family_handle_t vm_page_family)
+{
+    return vm_page_family ? vm_page_family->size_class : NULL;
+}
+
+/* Large objects bypass the family's spans and its lock for the mapping
+ * itself, the lock only protects the family's counters */
+static void *
+mm_allocate_large_object(vm_page_family_t *vm_page_family, uint64_t req_size, uint32_t alignment)
+{
+    /* The payload may start anywhere within the first span alignment
+     * of the mapping, see MM_GET_PAGE_FROM_APP_DATA */
+    uint64_t payload_offset = MM_ALIGN_UP((uint64_t)(uintptr_t)offset_of(vm_page_t, page_memory), alignment);
+    uint64_t object_size = req_size + debug_canary_bytes;
+    uint64_t span_pages = (payload_offset + object_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE;
+    /* The slots of a shm heap are reused for pages, they get no guard page */
+    uint32_t guard_pages = (debug_flags & MM_DEBUG_GUARD_PAGES) && !vm_page_family->shm_heap ? 1 : 0;
+    uint32_t numa_node = mm_numa_current_node();
+    vm_page_t *vm_page = NULL;
+    if (vm_page_family->shm_heap)
+        vm_page = mm_shm_heap_get_large_span(vm_page_family->shm_heap, span_pages);
+    else
+        vm_page = mm_get_new_vm_span_from_kernel(span_pages + guard_pages);
+    if (!vm_page)
+        return NULL;
+    if (guard_pages)
+    {
+        if (mprotect((char *)vm_page + span_pages * SYSTEM_PAGE_SIZE, SYSTEM_PAGE_SIZE, PROT_NONE))
+        {
+            printf("Error: %s() Could not protect guard page, errno %d\n", __FUNCTION__, errno);
+            mm_return_vm_page_to_kernel((void *)vm_page, (int)(span_pages + guard_pages));
+            return NULL;
+        }
+        /* Still within the first page, overruns run into the guard page */
+        payload_offset = (span_pages * SYSTEM_PAGE_SIZE - object_size) & ~((uint64_t)alignment - 1);
+    }
+    /* Before the header below first touches the mapping */
+    if (!vm_page_family->shm_heap)
+        mm_numa_bind_memory((void *)vm_page, span_pages * SYSTEM_PAGE_SIZE, numa_node);
+#ifdef MADV_HUGEPAGE
+    if (vm_page_family->huge_mode != MM_HUGE_PAGES_NONE && span_pages * SYSTEM_PAGE_SIZE >= MM_HUGE_PAGE_SIZE)
+        madvise((void *)vm_page, span_pages * SYSTEM_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+    vm_page->pg_family = vm_page_family;
+    vm_page->page_kind = MM_PAGE_LARGE;
+    vm_page->span_pages = (uint32_t)span_pages;
+    vm_page->sampled_objects = 0;
+    vm_page->numa_node = numa_node;
+    vm_page->large_object_size = req_size;
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    node_pool->large_object_count++;
+    node_pool->large_object_pages += span_pages;
+    node_pool->objects_in_use++;
+    node_pool->bytes_in_use += vm_page->large_object_size;
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    if (debug_canary_bytes)
+        mm_debug_arm_canary((char *)vm_page + payload_offset);
+    return (void *)((char *)vm_page + payload_offset);
+}
+
+static void
+mm_free_large_object(vm_page_t *vm_page)
+{
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    node_pool->large_object_count--;
+    node_pool->large_object_pages -= vm_page->span_pages;
+    node_pool->objects_in_use--;
+    node_pool->bytes_in_use -= vm_page->large_object_size;
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    if (vm_page_family->shm_heap)
+        mm_shm_heap_return_large_span(vm_page_family->shm_heap, (void *)vm_page, vm_page->span_pages);
+    else
+        mm_return_vm_page_to_kernel((void *)vm_page, vm_page->span_pages + (debug_flags & MM_DEBUG_GUARD_PAGES ? 1 : 0));
+}
+
+static void
+mm_debug_report(const char *caller, const char *problem, vm_page_t *hosting_page, void *app_data)
+{
+    printf("Error: %s() %s, object %p of family %s\n", caller, problem, app_data, hosting_page->pg_family->struct_name);
+    fflush(stdout);
+    abort();
+}
+
+/* Family lock held. The block's neighbours must point back at it */
+static vm_bool_t
+mm_debug_block_header_ok(block_meta_data_t *block_meta_data)
+{
+    block_meta_data_t *prev_block = PREV_META_BLOCK(block_meta_data);
+    block_meta_data_t *next_block = NULL;
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(block_meta_data);
+    if (MM_BLOCK_END(block_meta_data) > (char *)hosting_page + hosting_page->span_pages * SYSTEM_PAGE_SIZE)
+        return MM_FALSE;
+    if (prev_block ? NEXT_META_BLOCK(prev_block) != block_meta_data : block_meta_data != &hosting_page->block_meta_data)
+        return MM_FALSE;
+    next_block = NEXT_META_BLOCK(block_meta_data);
+    return !next_block || PREV_META_BLOCK(next_block) == block_meta_data ? MM_TRUE : MM_FALSE;
+}
+
+/* The family lock must be held by the caller for the two routines below.
+ * The object is not cleared, is_zeroed tells whether it is known zero */
+static void *
+mm_allocate_object(vm_page_family_t *vm_page_family, uint32_t numa_node, int units, uint32_t alignment,
+                   vm_bool_t *is_zeroed)
+{
+    block_meta_data_t *block_meta_data = NULL;
+    void *app_data = NULL;
+    uint32_t req_size = units * vm_page_family->struct_size + debug_canary_bytes;
+    if (units == 1 && vm_page_family->slab_mode == MM_TRUE && alignment <= vm_page_family->alignment)
+    {
+        app_data = mm_slab_allocate_object(vm_page_family, numa_node, is_zeroed);
+        if (app_data && debug_canary_bytes)
+            mm_debug_arm_canary(app_data);
+        return app_data;
+    }
+    if (alignment > 1)
+        block_meta_data = mm_allocate_aligned_data_block(vm_page_family, numa_node, req_size, alignment, is_zeroed);
+    else
+        block_meta_data = mm_allocate_free_data_block(vm_page_family, numa_node, req_size, is_zeroed);
+    if (!block_meta_data)
+        return NULL;
+    if (debug_canary_bytes)
+        mm_debug_trim_block(block_meta_data);
+    app_data = (void *)(block_meta_data + 1);
+    if (debug_canary_bytes)
+        mm_debug_arm_canary(app_data);
+    return app_data;
+}
+
+static void
+mm_free_object(vm_page_t *hosting_page, void *app_data)
+{
+    if (hosting_page->page_kind == MM_PAGE_SLAB)
+    {
+        mm_slab_free_object(hosting_page, app_data);
+        return;
+    }
+    /* Merging with neighbours that do not point back would wreck the page */
+    if (MM_DEBUG_ENABLED() && mm_debug_block_header_ok((block_meta_data_t *)app_data - 1) == MM_FALSE)
+        mm_debug_report(__FUNCTION__, "Corrupt block header", hosting_page, app_data);
+    mm_free_blocks((block_meta_data_t *)app_data - 1);
+}
+
+static void
+mm_thread_cache_destroy(void *arg);
+
+static void
+mm_thread_cache_key_create(void)
+{
+    pthread_key_create(&thread_cache_key, mm_thread_cache_destroy);
+}
+
+/* Maps the block of bins holding family_id. The thread cache destructor
+ * unmaps it, so the key is set before the block is handed out */
+static mm_thread_cache_bin_t *
+mm_thread_cache_map_block(uint32_t family_id)
+{
+    uint32_t block = family_id / MM_THREAD_CACHE_FAMILIES;
+    mm_thread_cache_bin_t *bins = mm_get_new_vm_page_from_kernel(MM_THREAD_CACHE_BLOCK_PAGES);
+    if (!bins)
+        return NULL;
+    pthread_once(&thread_cache_key_once, mm_thread_cache_key_create);
+    pthread_setspecific(thread_cache_key, &thread_cache);
+    thread_cache.bin_blocks[block] = bins;
+    return &bins[family_id % MM_THREAD_CACHE_FAMILIES];
+}
+
+static inline mm_thread_cache_bin_t *
+mm_thread_cache_bin(vm_page_family_t *vm_page_family)
+{
+    uint32_t family_id = vm_page_family->family_id;
+    mm_thread_cache_bin_t *bins = NULL;
+    /* Families whose single units are large objects have nothing to cache */
+    if (mm_is_large_request(vm_page_family, vm_page_family->struct_size, vm_page_family->alignment) == MM_TRUE)
+        return NULL;
+    /* Block payloads must be able to hold the cache link */
+    if (vm_page_family->slab_mode == MM_FALSE && vm_page_family->struct_size < sizeof(void *))
+        return NULL;
+    if (family_id < MM_THREAD_CACHE_FAMILIES)
+        return &thread_cache.bins[family_id];
+    bins = thread_cache.bin_blocks[family_id / MM_THREAD_CACHE_FAMILIES];
+    if (__builtin_expect(!bins, 0))
+        return mm_thread_cache_map_block(family_id);
+    return &bins[family_id % MM_THREAD_CACHE_FAMILIES];
+}
+
+static inline void
+mm_thread_cache_push(mm_thread_cache_bin_t *bin, void *app_data, vm_bool_t is_zeroed)
+{
+    void **head = is_zeroed == MM_TRUE ? &bin->zeroed_head : &bin->head;
+    MM_THREAD_CACHE_NEXT(app_data) = *head;
+    *head = app_data;
+    bin->count++;
+}
+
+/* Pops from the stack matching the caller's preference first, the link
+ * word of a zeroed object is the only part that needs clearing */
+static inline void *
+mm_thread_cache_pop(mm_thread_cache_bin_t *bin, vm_bool_t prefer_zeroed, vm_bool_t *is_zeroed)
+{
+    void **head = NULL;
+    if (prefer_zeroed == MM_TRUE)
+        head = bin->zeroed_head ? &bin->zeroed_head : &bin->head;
+    else
+        head = bin->head ? &bin->head : &bin->zeroed_head;
+    void *app_data = *head;
+    if (!app_data)
+        return NULL;
+    *head = MM_THREAD_CACHE_NEXT(app_data);
+    bin->count--;
+    *is_zeroed = head == &bin->zeroed_head ? MM_TRUE : MM_FALSE;
+    if (*is_zeroed == MM_TRUE)
+        MM_THREAD_CACHE_NEXT(app_data) = NULL;
+    return app_data;
+}
+
+/* Takes the family lock once to carve a whole batch of objects */
+static void *
+mm_thread_cache_refill(vm_page_family_t *vm_page_family, mm_thread_cache_bin_t *bin,
+                       vm_bool_t prefer_zeroed, vm_bool_t *is_zeroed)
+{
+    uint32_t i;
+    void *app_data = NULL;
+    vm_bool_t object_zeroed = MM_FALSE;
+    uint32_t numa_node = mm_numa_current_node();
+    pthread_once(&thread_cache_key_once, mm_thread_cache_key_create);
+    pthread_setspecific(thread_cache_key, &thread_cache);
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    for (i = 0; i < MM_THREAD_CACHE_BATCH; i++)
+    {
+        app_data = mm_allocate_object(vm_page_family, numa_node, 1, vm_page_family->alignment, &object_zeroed);
+        if (!app_data)
+            break;
+        mm_thread_cache_push(bin, app_data, object_zeroed);
+    }
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return mm_thread_cache_pop(bin, prefer_zeroed, is_zeroed);
+}
+
+/* Returns cached objects to their family until at most keep remain */
+static void
+mm_thread_cache_drain(vm_page_family_t *vm_page_family, mm_thread_cache_bin_t *bin, uint32_t keep)
+{
+    void *app_data = NULL;
+    vm_bool_t is_zeroed = MM_FALSE;
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    while (bin->count > keep)
+    {
+        app_data = mm_thread_cache_pop(bin, MM_FALSE, &is_zeroed);
+        mm_free_object(MM_GET_PAGE_FROM_APP_DATA(app_data), app_data);
+    }
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+}
+
+static void
+mm_debug_flush_quarantine(mm_debug_quarantine_t *quarantine);
+
+static void
+mm_thread_cache_destroy(void *arg)
+{
+    mm_thread_cache_t *cache = (mm_thread_cache_t *)arg;
+    uint32_t block, i;
+    /* Released objects may land in the bins below */
+    mm_debug_flush_quarantine(&cache->quarantine);
+    for (block = 0; block < MM_THREAD_CACHE_BLOCKS; block++)
+    {
+        mm_thread_cache_bin_t *bins = block ? cache->bin_blocks[block] : cache->bins;
+        if (!bins)
+            continue;
+        for (i = 0; i < MM_THREAD_CACHE_FAMILIES; i++)
+        {
+            mm_thread_cache_bin_t *bin = &bins[i];
+            if (!bin->count)
+                continue;
+            vm_page_t *hosting_page = MM_GET_PAGE_FROM_APP_DATA(bin->head ? bin->head : bin->zeroed_head);
+            mm_thread_cache_drain(hosting_page->pg_family, bin, 0);
+        }
+        if (block)
+        {
+            mm_return_vm_page_to_kernel(bins, MM_THREAD_CACHE_BLOCK_PAGES);
+            cache->bin_blocks[block] = NULL;
+        }
+    }
+}
+
+/* Objects freed by a thread other than the one that allocated them join
+ * the freeing thread's cache. A thread that never allocates from the
+ * family, like the consumer of a producer, would only hand them back on
+ * overflow or exit, so it returns them a batch at a time */
+static vm_bool_t
+mm_thread_cache_put(vm_page_t *hosting_page, void *app_data)
+{
+    vm_page_family_t *vm_page_family = hosting_page->pg_family;
+    mm_thread_cache_bin_t *bin = mm_thread_cache_bin(vm_page_family);
+    if (!bin)
+        return MM_FALSE;
+    /* Only single unit objects may be handed out again from the cache */
+    if (hosting_page->page_kind == MM_PAGE_BLOCKS &&
+        MM_BLOCK_SIZE((block_meta_data_t *)app_data - 1) != vm_page_family->struct_size)
+        return MM_FALSE;
+    /* A remote object would be handed out again on this node, send it home */
+    if (numa_topology.node_count > 1 && hosting_page->numa_node != thread_numa_node)
+        return MM_FALSE;
+    if (!bin->count)
+    {
+        pthread_once(&thread_cache_key_once, mm_thread_cache_key_create);
+        pthread_setspecific(thread_cache_key, &thread_cache);
+    }
+    mm_thread_cache_push(bin, app_data, MM_FALSE);
+    if (bin->count > MM_THREAD_CACHE_DEPTH)
+        mm_thread_cache_drain(vm_page_family, bin, MM_THREAD_CACHE_DEPTH / 2);
+    else if (bin->allocates == MM_FALSE && bin->count >= MM_THREAD_CACHE_BATCH)
+        mm_thread_cache_drain(vm_page_family, bin, 0);
+    return MM_TRUE;
+}
+
+/* Heap profiler */
+
+/* ln(x) for x > 0, to about 1e-5, so that sampling needs no libm */
+static double
+mm_profile_log(double x)
+{
+    union
+    {
+        double d;
+        uint64_t u;
+    } v = {x};
+    int exponent = (int)((v.u >> 52) & 0x7ff) - 1023;
+    v.u = (v.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    double t = (v.d - 1) / (v.d + 1), t2 = t * t;
+    return exponent * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+}
+
+/* exp(-x) for x >= 0 */
+static double
+mm_profile_exp_neg(double x)
+{
+    union
+    {
+        double d;
+        uint64_t u;
+    } scale;
+    if (x > 700)
+        return 0;
+    int k = (int)(x / 0.6931471805599453);
+    double r = x - k * 0.6931471805599453, term = 1, sum = 1;
+    int i;
+    for (i = 1; i < 12; i++)
+    {
+        term *= -r / i;
+        sum += term;
+    }
+    scale.u = (uint64_t)(1023 - k) << 52;
+    return sum * scale.d;
+}
+
+/* Distance to the next sample, exponentially distributed so that
+ * sampling is a Poisson process over the bytes allocated */
+static int64_t
+mm_profile_next_sample_distance(uint64_t sample_interval)
+{
+    if (!profile_rand_state)
+        profile_rand_state = (uintptr_t)&profile_rand_state ^ 0x9E3779B97F4A7C15ull;
+    profile_rand_state ^= profile_rand_state >> 12;
+    profile_rand_state ^= profile_rand_state << 25;
+    profile_rand_state ^= profile_rand_state >> 27;
+    uint64_t bits = (profile_rand_state * 2685821657736338717ull) >> 11;
+    double u = (bits + 1.0) / 9007199254740993.0;
+    return (int64_t)(-mm_profile_log(u) * sample_interval) + 1;
+}
+
+static inline uint32_t
+mm_profile_table_index(void *app_data)
+{
+    return (uint32_t)(((uintptr_t)app_data >> 3) * 0x9E3779B97F4A7C15ull >> 40) & (MM_PROFILE_TABLE_SIZE - 1);
+}
+
+/* Profile lock held */
+static mm_profile_event_t *
+mm_profile_table_lookup(void *app_data)
+{
+    uint32_t index = mm_profile_table_index(app_data);
+    while (heap_profile.live_samples[index].app_data)
+    {
+        if (heap_profile.live_samples[index].app_data == app_data)
+            return &heap_profile.live_samples[index];
+        index = (index + 1) & (MM_PROFILE_TABLE_SIZE - 1);
+    }
+    return NULL;
+}
+
+/* Profile lock held. Backward shift deletion keeps probe runs intact */
+static void
+mm_profile_table_remove(mm_profile_event_t *sample)
+{
+    uint32_t hole = (uint32_t)(sample - heap_profile.live_samples);
+    uint32_t index = hole;
+    for (;;)
+    {
+        index = (index + 1) & (MM_PROFILE_TABLE_SIZE - 1);
+        void *app_data = heap_profile.live_samples[index].app_data;
+        if (!app_data)
+            break;
+        uint32_t home = mm_profile_table_index(app_data);
+        if (((index - home) & (MM_PROFILE_TABLE_SIZE - 1)) >= ((index - hole) & (MM_PROFILE_TABLE_SIZE - 1)))
+        {
+            heap_profile.live_samples[hole] = heap_profile.live_samples[index];
+            hole = index;
+        }
+    }
+    heap_profile.live_samples[hole].app_data = NULL;
+    heap_profile.live_count--;
+}
+
+static void
+mm_profile_ring_push(mm_profile_event_t *event)
+{
+    uint64_t pos = __atomic_load_n(&heap_profile.ring_head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        mm_profile_ring_slot_t *slot = &heap_profile.ring[pos & (MM_PROFILE_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&heap_profile.ring_head, &pos, pos + 1, MM_TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                slot->event = *event;
+                __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* Full, the reader is behind */
+            __atomic_fetch_add(&heap_profile.dropped_samples, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&heap_profile.ring_head, __ATOMIC_RELAXED);
+    }
+}
+
+static vm_bool_t
+mm_profile_ring_pop(mm_profile_event_t *event)
+{
+    uint64_t pos = __atomic_load_n(&heap_profile.ring_tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        mm_profile_ring_slot_t *slot = &heap_profile.ring[pos & (MM_PROFILE_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&heap_profile.ring_tail, &pos, pos + 1, MM_TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *event = slot->event;
+                __atomic_store_n(&slot->sequence, pos + MM_PROFILE_RING_SIZE, __ATOMIC_RELEASE);
+                return MM_TRUE;
+            }
+        }
+        else if (diff < 0)
+            return MM_FALSE;
+        else
+            pos = __atomic_load_n(&heap_profile.ring_tail, __ATOMIC_RELAXED);
+    }
+}
+
+/* Called for every allocation while the profiler is on */
+static void
+mm_profile_sample_alloc(vm_page_family_t *vm_page_family, void *app_data, uint64_t size)
+{
+    uint64_t sample_interval = __atomic_load_n(&heap_profile.sample_interval, __ATOMIC_RELAXED);
+    if (!sample_interval || !app_data)
+        return;
+    profile_bytes_until_sample -= (int64_t)size;
+    if (profile_bytes_until_sample > 0)
+        return;
+    /* A thread starts with no credit, it is not sampled before
+     * its first full distance has gone by */
+    vm_bool_t first = profile_bytes_until_sample + (int64_t)size == 0 ? MM_TRUE : MM_FALSE;
+    profile_bytes_until_sample = mm_profile_next_sample_distance(sample_interval);
+    if (first == MM_TRUE)
+        return;
+
+    mm_profile_event_t event;
+    event.type = MM_PROFILE_ALLOC;
+    event.app_data = app_data;
+    event.size = size;
+    event.weight = (uint64_t)(size / (1 - mm_profile_exp_neg((double)size / sample_interval)));
+    event.struct_name = vm_page_family->struct_name;
+    /* Drop this frame and the allocator entry point */
+    void *frames[MM_PROFILE_MAX_DEPTH + 2];
+    int depth = backtrace(frames, MM_PROFILE_MAX_DEPTH + 2);
+    event.depth = depth > 2 ? depth - 2 : 0;
+    memcpy(event.frames, frames + 2, event.depth * sizeof(void *));
+
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_APP_DATA(app_data);
+    pthread_mutex_lock(&heap_profile.lock);
+    if (heap_profile.live_count >= MM_PROFILE_TABLE_SIZE * 3 / 4)
+    {
+        heap_profile.dropped_samples++;
+        pthread_mutex_unlock(&heap_profile.lock);
+        return;
+    }
+    uint32_t index = mm_profile_table_index(app_data);
+    while (heap_profile.live_samples[index].app_data)
+        index = (index + 1) & (MM_PROFILE_TABLE_SIZE - 1);
+    heap_profile.live_samples[index] = event;
+    heap_profile.live_count++;
+    __atomic_fetch_add(&hosting_page->sampled_objects, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heap_profile.lock);
+    mm_profile_ring_push(&event);
+}
+
+/* Called on free only for objects of pages holding samples */
+static void
+mm_profile_sample_free(vm_page_t *hosting_page, void *app_data)
+{
+    mm_profile_event_t event;
+    pthread_mutex_lock(&heap_profile.lock);
+    mm_profile_event_t *sample = mm_profile_table_lookup(app_data);
+    if (!sample)
+    {
+        pthread_mutex_unlock(&heap_profile.lock);
+        return;
+    }
+    event = *sample;
+    mm_profile_table_remove(sample);
+    __atomic_fetch_sub(&hosting_page->sampled_objects, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heap_profile.lock);
+    event.type = MM_PROFILE_FREE;
+    mm_profile_ring_push(&event);
+}
+
+#define MM_PROFILE_PAGE_SAMPLED(hosting_page) \
+    __builtin_expect(__atomic_load_n(&(hosting_page)->sampled_objects, __ATOMIC_RELAXED) != 0, 0)
+
+int mm_profile_start(uint64_t sample_interval)
+{
+    uint32_t i;
+    pthread_mutex_lock(&heap_profile.lock);
+    if (!heap_profile.live_samples)
+    {
+        int table_units = (int)((sizeof(mm_profile_event_t) * MM_PROFILE_TABLE_SIZE + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
+        int ring_units = (int)((sizeof(mm_profile_ring_slot_t) * MM_PROFILE_RING_SIZE + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
+        heap_profile.live_samples = (mm_profile_event_t *)mm_get_new_vm_page_from_kernel(table_units);
+        heap_profile.ring = (mm_profile_ring_slot_t *)mm_get_new_vm_page_from_kernel(ring_units);
+        if (!heap_profile.live_samples || !heap_profile.ring)
+        {
+            pthread_mutex_unlock(&heap_profile.lock);
+            printf("Error: %s() Could not map the profiler tables\n", __FUNCTION__);
+            return -1;
+        }
+        for (i = 0; i < MM_PROFILE_RING_SIZE; i++)
+            heap_profile.ring[i].sequence = i;
+    }
+    if (sample_interval)
+        heap_profile.last_sample_interval = sample_interval;
+    __atomic_store_n(&heap_profile.sample_interval, sample_interval, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heap_profile.lock);
+    return 0;
+}
+
+void mm_profile_stop()
+{
+    __atomic_store_n(&heap_profile.sample_interval, 0, __ATOMIC_RELAXED);
+}
+
+uint32_t
+mm_profile_read_events(mm_profile_event_t *events, uint32_t max_events)
+{
+    uint32_t count = 0;
+    if (!heap_profile.ring)
+        return 0;
+    while (count < max_events && mm_profile_ring_pop(&events[count]) == MM_TRUE)
+        count++;
+    return count;
+}
+
+static void
+mm_profile_write_collapsed(FILE *fp, mm_profile_event_t *sample)
+{
+    char **symbols = backtrace_symbols(sample->frames, sample->depth);
+    int i;
+    /* Outermost caller first, the family as the leaf */
+    for (i = (int)sample->depth - 1; i >= 0; i--)
+    {
+        char *name = symbols ? strchr(symbols[i], '(') : NULL;
+        size_t length = name ? strcspn(name + 1, "+)") : 0;
+        if (length)
+            fprintf(fp, "%.*s;", (int)length, name + 1);
+        else
+            fprintf(fp, "%p;", sample->frames[i]);
+    }
+    fprintf(fp, "%s %lu\n", sample->struct_name, (unsigned long)sample->weight);
+    free(symbols);
+}
+
+int mm_profile_dump(char *path, mm_profile_format_t format)
+{
+    uint64_t objects = 0, bytes = 0;
+    uint32_t i, j;
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        printf("Error: %s() Could not open %s\n", __FUNCTION__, path);
+        return -1;
+    }
+    pthread_mutex_lock(&heap_profile.lock);
+    for (i = 0; heap_profile.live_samples && i < MM_PROFILE_TABLE_SIZE; i++)
+    {
+        if (!heap_profile.live_samples[i].app_data)
+            continue;
+        objects++;
+        bytes += heap_profile.live_samples[i].size;
+    }
+    if (format == MM_PROFILE_FORMAT_PPROF)
+    {
+        /* pprof scales the raw samples back up itself from the interval */
+        fprintf(fp, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n",
+                (unsigned long)objects, (unsigned long)bytes, (unsigned long)objects, (unsigned long)bytes,
+                (unsigned long)heap_profile.last_sample_interval);
+    }
+    for (i = 0; heap_profile.live_samples && i < MM_PROFILE_TABLE_SIZE; i++)
+    {
+        mm_profile_event_t *sample = &heap_profile.live_samples[i];
+        if (!sample->app_data)
+            continue;
+        if (format == MM_PROFILE_FORMAT_COLLAPSED)
+        {
+            mm_profile_write_collapsed(fp, sample);
+            continue;
+        }
+        fprintf(fp, "1: %lu [1: %lu] @", (unsigned long)sample->size, (unsigned long)sample->size);
+        for (j = 0; j < sample->depth; j++)
+            fprintf(fp, " %p", sample->frames[j]);
+        fprintf(fp, "\n");
+    }
+    pthread_mutex_unlock(&heap_profile.lock);
+    if (format == MM_PROFILE_FORMAT_PPROF)
+    {
+        FILE *maps = fopen("/proc/self/maps", "r");
+        char line[512];
+        fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+        while (maps && fgets(line, sizeof(line), maps))
+            fputs(line, fp);
+        if (maps)
+            fclose(maps);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Objects more aligned than the family's own bypass the thread cache */
+static void *
+mm_allocate_by_handle(vm_page_family_t *page_family, int units, uint32_t alignment, vm_bool_t zero)
+{
+    uint64_t req_size = 0;
+    vm_page_family_t *owner = page_family;
+    void *app_data = NULL;
+    vm_bool_t is_zeroed = MM_FALSE;
+    /* A handle looked up for a struct that was never registered */
+    if (!page_family)
+    {
+        printf("Error: %s() No page family\n", __FUNCTION__);
+        return NULL;
+    }
+    req_size = mm_request_size(page_family, units);
+    if (!req_size)
+    {
+        printf("Error: %s() Invalid unit count %d for page family %s\n", __FUNCTION__, units, page_family->struct_name);
+        return NULL;
+    }
+    if (alignment < page_family->alignment)
+        alignment = page_family->alignment;
+    if (page_family->size_class && units == 1 && alignment == page_family->alignment)
+    {
+        page_family = page_family->size_class;
+        alignment = page_family->alignment;
+    }
+    /* Fresh mappings are already zero filled */
+    if (mm_is_large_request(page_family, req_size, alignment) == MM_TRUE)
+    {
+        app_data = mm_allocate_large_object(page_family, req_size, alignment);
+        if (MM_PROFILE_ENABLED())
+            mm_profile_sample_alloc(page_family, app_data, req_size);
+        return app_data;
+    }
+    mm_thread_cache_bin_t *bin = units == 1 && alignment == page_family->alignment ? mm_thread_cache_bin(page_family) : NULL;
+    if (bin)
+    {
+        bin->allocates = MM_TRUE;
+        app_data = mm_thread_cache_pop(bin, zero, &is_zeroed);
+        if (!app_data)
+            app_data = mm_thread_cache_refill(page_family, bin, zero, &is_zeroed);
+        /* Its canary was flipped when it was freed into the cache */
+        if (app_data && debug_canary_bytes)
+            mm_debug_arm_canary(app_data);
+    }
+    else
+    {
+        uint32_t numa_node = mm_numa_current_node();
+        pthread_mutex_lock(&page_family->family_lock);
+        app_data = mm_allocate_object(page_family, numa_node, units, alignment, &is_zeroed);
+        pthread_mutex_unlock(&page_family->family_lock);
+    }
+    if (app_data && page_family->is_size_class == MM_TRUE)
+        mm_size_class_set_owner(owner, app_data);
+    if (app_data && zero == MM_TRUE && is_zeroed == MM_FALSE)
+        memset(app_data, 0, req_size);
+    if (MM_PROFILE_ENABLED())
+        mm_profile_sample_alloc(owner, app_data, req_size);
+    return app_data;
+}
+
+void *
+xcalloc_by_handle(mm_family_handle_t page_family, int units)
+{
+    return mm_allocate_by_handle(page_family, units, 1, MM_TRUE);
+}
+
+void *
+xmalloc_by_handle(mm_family_handle_t page_family, int units)
+{
+    return mm_allocate_by_handle(page_family, units, 1, MM_FALSE);
+}
+
+void *
+xcalloc_aligned_by_handle(mm_family_handle_t page_family, int units, uint32_t alignment)
+{
+    if (!alignment || (alignment & (alignment - 1)) || alignment > SYSTEM_PAGE_SIZE)
+    {
+        printf("Error: %s() Invalid alignment %u\n", __FUNCTION__, alignment);
+        return NULL;
+    }
+    return mm_allocate_by_handle(page_family, units, alignment, MM_TRUE);
+}
+
+void *
+xcalloc(char *struct_name, int units)
+{
+    vm_page_family_t *page_family = lookup_page_family_by_name(struct_name);
+    if (!page_family)
+    {
+        printf("Error: Stucture %s is not registered with memory manager\n", struct_name);
+        return NULL;
+    }
+    return xcalloc_by_handle(page_family, units);
+}
+
+void *
+xmalloc(char *struct_name, int units)
+{
+    vm_page_family_t *page_family = lookup_page_family_by_name(struct_name);
+    if (!page_family)
+    {
+        printf("Error: Stucture %s is not registered with memory manager\n", struct_name);
+        return NULL;
+    }
+    return xmalloc_by_handle(page_family, units);
+}
+
+void *
+xcalloc_aligned(char *struct_name, int units, uint32_t alignment)
+{
+    vm_page_family_t *page_family = lookup_page_family_by_name(struct_name);
+    if (!page_family)
+    {
+        printf("Error: Stucture %s is not registered with memory manager\n", struct_name);
+        return NULL;
+    }
+    return xcalloc_aligned_by_handle(page_family, units, alignment);
+}
+
+int xcalloc_batch_by_handle(mm_family_handle_t page_family, int n, void **out)
+{
+    int count = 0, i;
+    vm_bool_t is_zeroed[MM_BATCH_CHUNK];
+    uint32_t numa_node = 0;
+    if (!page_family)
+    {
+        printf("Error: %s() No page family\n", __FUNCTION__);
+        return 0;
+    }
+    numa_node = mm_numa_current_node();
+
+    if (page_family->size_class)
+    {
+        count = xcalloc_batch_by_handle(page_family->size_class, n, out);
+        for (i = 0; i < count; i++)
+            mm_size_class_set_owner(page_family, out[i]);
+        return count;
+    }
+
+    /* Single units that do not fit a span are all large objects */
+    if (mm_is_large_request(page_family, page_family->struct_size, page_family->alignment) == MM_TRUE)
+    {
+        for (count = 0; count < n; count++)
+        {
+            out[count] = mm_allocate_large_object(page_family, page_family->struct_size, page_family->alignment);
+            if (!out[count])
+                break;
+            if (MM_PROFILE_ENABLED())
+                mm_profile_sample_alloc(page_family, out[count], page_family->struct_size);
+        }
+        return count;
+    }
+
+    while (count < n)
+    {
+        int chunk = n - count < MM_BATCH_CHUNK ? n - count : MM_BATCH_CHUNK;
+        int carved = 0;
+        pthread_mutex_lock(&page_family->family_lock);
+        if (page_family->slab_mode == MM_TRUE)
+        {
+            for (carved = 0; carved < chunk; carved++)
+            {
+                out[count + carved] = mm_slab_allocate_object(page_family, numa_node, &is_zeroed[carved]);
+                if (!out[count + carved])
+                    break;
+                if (debug_canary_bytes)
+                    mm_debug_arm_canary(out[count + carved]);
+            }
+        }
+        else if (page_family->alignment > 1)
+        {
+            /* Carving packs blocks back to back, aligned ones are placed one by one */
+            for (carved = 0; carved < chunk; carved++)
+            {
+                out[count + carved] = mm_allocate_object(page_family, numa_node, 1, page_family->alignment,
+                                                         &is_zeroed[carved]);
+                if (!out[count + carved])
+                    break;
+            }
+        }
+        else
+        {
+            while (carved < chunk)
+            {
+                int got = mm_carve_free_blocks(page_family, numa_node, chunk - carved, out + count + carved, is_zeroed + carved);
+                if (!got)
+                    break;
+                carved += got;
+            }
+        }
+        pthread_mutex_unlock(&page_family->family_lock);
+        for (i = 0; i < carved; i++)
+        {
+            if (page_family->is_size_class == MM_TRUE)
+                mm_size_class_set_owner(page_family, out[count + i]);
+            if (is_zeroed[i] == MM_FALSE)
+                memset(out[count + i], 0, page_family->struct_size);
+            if (MM_PROFILE_ENABLED())
+                mm_profile_sample_alloc(page_family, out[count + i], page_family->struct_size);
+        }
+        count += carved;
+        if (carved < chunk)
+            break;
+    }
+    return count;
+}
+
+int xcalloc_batch(char *struct_name, int n, void **out)
+{
+    vm_page_family_t *page_family = lookup_page_family_by_name(struct_name);
+    if (!page_family)
+    {
+        printf("Error: Stucture %s is not registered with memory manager\n", struct_name);
+        return 0;
+    }
+    return xcalloc_batch_by_handle(page_family, n, out);
+}
+
+/* Arenas */
+
+static void
+mm_arena_init_page(vm_page_t *vm_page, uint32_t span_pages, uint32_t numa_node, vm_bool_t is_zeroed)
+{
+    vm_page->next = NULL;
+    vm_page->prev = NULL;
+    vm_page->pg_family = NULL;
+    vm_page->page_kind = MM_PAGE_ARENA;
+    vm_page->span_pages = span_pages;
+    vm_page->dirty_limit = is_zeroed == MM_TRUE ? (uint32_t)(uintptr_t)offset_of(vm_page_t, page_memory)
+                                                : span_pages * (uint32_t)SYSTEM_PAGE_SIZE;
+    vm_page->sampled_objects = 0;
+    vm_page->numa_node = numa_node;
+}
+
+static void
+mm_arena_use_page(mm_arena_t *arena, vm_page_t *vm_page)
+{
+    arena->current_page = vm_page;
+    arena->bump = vm_page->page_memory;
+    if (vm_page == arena->first_page)
+        arena->bump += MM_ARENA_ROUND_UP(sizeof(mm_arena_t));
+    arena->limit = (char *)vm_page + (uint64_t)vm_page->span_pages * SYSTEM_PAGE_SIZE;
+}
+
+mm_arena_handle_t
+mm_arena_create()
+{
+    vm_bool_t is_zeroed = MM_FALSE;
+    mm_span_reserve_t *reserve = &span_reserves[mm_numa_current_node()]
+                                               [__atomic_load_n(&default_huge_page_mode, __ATOMIC_RELAXED)];
+    vm_page_t *vm_page = mm_get_new_vm_span(reserve, MM_MAX_SPAN_PAGES, &is_zeroed);
+    if (!vm_page)
+        return NULL;
+    mm_arena_init_page(vm_page, MM_MAX_SPAN_PAGES, reserve->numa_node, is_zeroed);
+    mm_arena_t *arena = (mm_arena_t *)vm_page->page_memory;
+    mm_vm_page_mark_dirty(vm_page, (char *)arena, (char *)(arena + 1));
+    arena->span_reserve = reserve;
+    arena->first_page = vm_page;
+    arena->large_pages = NULL;
+    mm_arena_use_page(arena, vm_page);
+    return arena;
+}
+
+void *
+xcalloc_in_by_handle(mm_arena_handle_t arena, mm_family_handle_t page_family, int units)
+{
+    uint64_t req_size = 0;
+    uint32_t alignment = 0;
+    vm_bool_t is_zeroed = MM_FALSE;
+    void *app_data = NULL;
+    if (!arena || !page_family)
+    {
+        printf("Error: %s() No arena or page family\n", __FUNCTION__);
+        return NULL;
+    }
+    req_size = mm_request_size(page_family, units);
+    if (!req_size)
+    {
+        printf("Error: %s() Invalid unit count %d for page family %s\n", __FUNCTION__, units, page_family->struct_name);
+        return NULL;
+    }
+    req_size = MM_ARENA_ROUND_UP(req_size);
+    alignment = page_family->alignment > MM_ARENA_ALIGNMENT ? page_family->alignment : MM_ARENA_ALIGNMENT;
+
+    /* Fresh mappings are already zero filled */
+    if (req_size + alignment > mm_max_page_allocatable_memory(MM_MAX_SPAN_PAGES))
+    {
+        uint64_t payload_offset = MM_ALIGN_UP((uint64_t)(uintptr_t)offset_of(vm_page_t, page_memory), alignment);
+        uint64_t span_pages = (payload_offset + req_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE;
+        vm_page_t *vm_page = mm_get_new_vm_span_from_kernel(span_pages);
+        if (!vm_page)
+            return NULL;
+        mm_numa_bind_memory((void *)vm_page, span_pages * SYSTEM_PAGE_SIZE, arena->span_reserve->numa_node);
+        mm_arena_init_page(vm_page, (uint32_t)span_pages, arena->span_reserve->numa_node, MM_TRUE);
+        vm_page->next = arena->large_pages;
+        arena->large_pages = vm_page;
+        return (void *)((char *)vm_page + payload_offset);
+    }
+
+    arena->bump = (char *)MM_ALIGN_UP((uintptr_t)arena->bump, alignment);
+    if (arena->bump + req_size > arena->limit)
+    {
+        /* Spans kept by a reset are reused before new ones are added */
+        vm_page_t *vm_page = arena->current_page->next;
+        if (!vm_page)
+        {
+            vm_page = mm_get_new_vm_span(arena->span_reserve, MM_MAX_SPAN_PAGES, &is_zeroed);
+            if (!vm_page)
+                return NULL;
+            mm_arena_init_page(vm_page, MM_MAX_SPAN_PAGES, arena->span_reserve->numa_node, is_zeroed);
+            vm_page->prev = arena->current_page;
+            arena->current_page->next = vm_page;
+        }
+        mm_arena_use_page(arena, vm_page);
+        arena->bump = (char *)MM_ALIGN_UP((uintptr_t)arena->bump, alignment);
+    }
+    app_data = arena->bump;
+    arena->bump += req_size;
+    if (mm_vm_page_mark_dirty(arena->current_page, (char *)app_data, (char *)app_data + req_size) == MM_FALSE)
+        memset(app_data, 0, req_size);
+    return app_data;
+}
+
+void *
+xcalloc_in(mm_arena_handle_t arena, char *struct_name, int units)
+{
+    vm_page_family_t *page_family = lookup_page_family_by_name(struct_name);
+    if (!page_family)
+    {
+        printf("Error: Stucture %s is not registered with memory manager\n", struct_name);
+        return NULL;
+    }
+    return xcalloc_in_by_handle(arena, page_family, units);
+}
+
+static void
+mm_arena_release_large_pages(mm_arena_t *arena)
+{
+    vm_page_t *vm_page = arena->large_pages, *next_page = NULL;
+    for (; vm_page; vm_page = next_page)
+    {
+        next_page = vm_page->next;
+        mm_return_vm_page_to_kernel((void *)vm_page, vm_page->span_pages);
+    }
+    arena->large_pages = NULL;
+}
+
+void mm_arena_reset(mm_arena_handle_t arena)
+{
+    mm_arena_release_large_pages(arena);
+    mm_arena_use_page(arena, arena->first_page);
+}
+
+void mm_arena_destroy(mm_arena_handle_t arena)
+{
+    vm_page_t *vm_page = NULL, *next_page = NULL;
+    mm_arena_release_large_pages(arena);
+    /* The arena itself lives in its first span, returned last */
+    for (vm_page = arena->first_page->next; vm_page; vm_page = next_page)
+    {
+        next_page = vm_page->next;
+        mm_return_vm_span(arena->span_reserve, (void *)vm_page);
+    }
+    mm_return_vm_span(arena->span_reserve, (void *)arena->first_page);
+}
+
+/* Shm heaps */
+
+mm_shm_heap_handle_t
+mm_shm_heap_create(const char *path, uint64_t size)
+{
+    mm_shm_heap_t *shm_heap = NULL;
+    char *base = NULL;
+    int fd;
+    size = MM_ALIGN_UP(size, (uint64_t)MM_SPAN_ALIGNMENT);
+    if (size < 2 * MM_SPAN_ALIGNMENT)
+    {
+        printf("Error: %s() Heap size too small\n", __FUNCTION__);
+        return NULL;
+    }
+    fd = path ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : memfd_create("mm_shm_heap", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        printf("Error: %s() Could not create the heap file, errno %d\n", __FUNCTION__, errno);
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)size))
+    {
+        printf("Error: %s() Could not size the heap file, errno %d\n", __FUNCTION__, errno);
+        close(fd);
+        return NULL;
+    }
+    /* Mapped over an aligned reservation, its spans are found by masking */
+    base = (char *)mm_map_aligned_from_kernel(size, MM_SPAN_ALIGNMENT);
+    shm_heap = (mm_shm_heap_t *)mm_get_new_vm_page_from_kernel(1);
+    if (!base || !shm_heap ||
+        mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        printf("Error: %s() Could not map the heap file, errno %d\n", __FUNCTION__, errno);
+        if (base)
+            munmap(base, size);
+        if (shm_heap)
+            mm_return_vm_page_to_kernel((void *)shm_heap, 1);
+        close(fd);
+        return NULL;
+    }
+    shm_heap->header = (mm_shm_heap_header_t *)base;
+    shm_heap->header->magic = MM_SHM_HEAP_MAGIC;
+    shm_heap->header->size = size;
+    shm_heap->size = size;
+    shm_heap->next_slot = MM_SPAN_ALIGNMENT;
+    shm_heap->fd = fd;
+    shm_heap->read_only = MM_FALSE;
+    /* Slots are punched out of the file as they are parked, and all of
+     * them fit on the stack at once, so it never releases a slot */
+    shm_heap->reserve.chunk_spans = MM_RESERVE_CHUNK_SPANS;
+    shm_heap->reserve.min_free_spans = MM_RESERVE_MIN_FREE_SPANS;
+    shm_heap->reserve.max_free_spans = (uint32_t)(size / MM_SPAN_ALIGNMENT);
+    shm_heap->reserve.huge_mode = MM_HUGE_PAGES_NONE;
+    shm_heap->reserve.shm_heap = shm_heap;
+    pthread_mutex_lock(&span_reserve_lock);
+    mm_span_reserve_ensure_capacity(&shm_heap->reserve, 0);
+    pthread_mutex_unlock(&span_reserve_lock);
+    return shm_heap;
+}
+
+mm_shm_heap_handle_t
+mm_shm_heap_attach(int fd)
+{
+    mm_shm_heap_t *shm_heap = NULL;
+    mm_shm_heap_header_t *header = NULL;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) || (uint64_t)file_stat.st_size < 2 * MM_SPAN_ALIGNMENT)
+    {
+        printf("Error: %s() File %d is not a shm heap\n", __FUNCTION__, fd);
+        return NULL;
+    }
+    header = mmap(0, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+    {
+        printf("Error: %s() Could not map the heap file, errno %d\n", __FUNCTION__, errno);
+        return NULL;
+    }
+    if (header->magic != MM_SHM_HEAP_MAGIC || header->size != (uint64_t)file_stat.st_size)
+    {
+        printf("Error: %s() File %d is not a shm heap\n", __FUNCTION__, fd);
+        munmap(header, (size_t)file_stat.st_size);
+        return NULL;
+    }
+    shm_heap = (mm_shm_heap_t *)mm_get_new_vm_page_from_kernel(1);
+    if (!shm_heap)
+    {
+        munmap(header, (size_t)file_stat.st_size);
+        return NULL;
+    }
+    shm_heap->header = header;
+    shm_heap->size = header->size;
+    shm_heap->fd = fd;
+    shm_heap->read_only = MM_TRUE;
+    return shm_heap;
+}
+
+int mm_shm_heap_detach(mm_shm_heap_handle_t shm_heap)
+{
+    if (!shm_heap || shm_heap->read_only == MM_FALSE)
+    {
+        printf("Error: %s() Only attached heaps can be detached\n", __FUNCTION__);
+        return -1;
+    }
+    munmap((void *)shm_heap->header, shm_heap->size);
+    mm_return_vm_page_to_kernel((void *)shm_heap, 1);
+    return 0;
+}
+
+/* Registry lock held. Whether a family bound to the heap still has
+ * objects, after the calling thread's cached ones are handed back */
+static vm_bool_t
+mm_shm_heap_in_use(mm_shm_heap_t *shm_heap)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    mm_thread_cache_bin_t *bin = NULL;
+    vm_bool_t in_use = MM_FALSE;
+    uint32_t numa_node;
+    ITERATE_PAGE_FAMILIES_BEGIN(&family_registry, vm_page_family)
+    {
+        if (vm_page_family->shm_heap == shm_heap)
+        {
+            bin = mm_thread_cache_bin(vm_page_family);
+            if (bin && bin->count)
+                mm_thread_cache_drain(vm_page_family, bin, 0);
+            pthread_mutex_lock(&vm_page_family->family_lock);
+            if (mm_family_has_pages(vm_page_family) == MM_TRUE)
+                in_use = MM_TRUE;
+            for (numa_node = 0; numa_node < vm_page_family->node_count; numa_node++)
+            {
+                if (vm_page_family->nodes[numa_node].large_object_count)
+                    in_use = MM_TRUE;
+            }
+            pthread_mutex_unlock(&vm_page_family->family_lock);
+        }
+    }
+    ITERATE_PAGE_FAMILIES_END(&family_registry, vm_page_family)
+    return in_use;
+}
+
+int mm_shm_heap_destroy(mm_shm_heap_handle_t shm_heap)
+{
+    vm_page_family_t *vm_page_family = NULL;
+    if (!shm_heap || shm_heap->read_only == MM_TRUE)
+    {
+        printf("Error: %s() Only created heaps can be destroyed\n", __FUNCTION__);
+        return -1;
+    }
+    pthread_mutex_lock(&family_registry_lock);
+    if (mm_shm_heap_in_use(shm_heap) == MM_TRUE)
+    {
+        pthread_mutex_unlock(&family_registry_lock);
+        printf("Error: %s() Page families still have objects in the heap\n", __FUNCTION__);
+        return -1;
+    }
+    ITERATE_PAGE_FAMILIES_BEGIN(&family_registry, vm_page_family)
+    {
+        if (vm_page_family->shm_heap == shm_heap)
+        {
+            pthread_mutex_lock(&vm_page_family->family_lock);
+            vm_page_family->shm_heap = NULL;
+            vm_page_family->span_pages = mm_family_span_pages(vm_page_family->struct_size);
+            if (vm_page_family->slab_mode == MM_TRUE)
+                mm_family_update_slab_layout(vm_page_family);
+            pthread_mutex_unlock(&vm_page_family->family_lock);
+        }
+    }
+    ITERATE_PAGE_FAMILIES_END(&family_registry, vm_page_family)
+    pthread_mutex_unlock(&family_registry_lock);
+    /* Parked slots are part of the mapping, only the stack is separate */
+    if (shm_heap->reserve.free_spans)
+        mm_return_vm_page_to_kernel((void *)shm_heap->reserve.free_spans,
+                                    mm_span_reserve_units(shm_heap->reserve.capacity));
+    munmap((void *)shm_heap->header, shm_heap->size);
+    close(shm_heap->fd);
+    mm_return_vm_page_to_kernel((void *)shm_heap, 1);
+    return 0;
+}
+
+int mm_shm_heap_fd(mm_shm_heap_handle_t shm_heap)
+{
+    return shm_heap ? shm_heap->fd : -1;
+}
+
+uint64_t
+mm_shm_heap_offset(mm_shm_heap_handle_t shm_heap, const void *app_data)
+{
+    uint64_t offset = (uint64_t)((uintptr_t)app_data - (uintptr_t)shm_heap->header);
+    return app_data && offset >= MM_SPAN_ALIGNMENT && offset < shm_heap->size ? offset : 0;
+}
+
+void *
+mm_shm_heap_pointer(mm_shm_heap_handle_t shm_heap, uint64_t offset)
+{
+    return offset >= MM_SPAN_ALIGNMENT && offset < shm_heap->size ? (char *)shm_heap->header + offset : NULL;
+}
+
+int mm_shm_heap_set_root(mm_shm_heap_handle_t shm_heap, void *app_data)
+{
+    uint64_t offset = mm_shm_heap_offset(shm_heap, app_data);
+    if (shm_heap->read_only == MM_TRUE || (app_data && !offset))
+    {
+        printf("Error: %s() Object %p cannot be the root of the heap\n", __FUNCTION__, app_data);
+        return -1;
+    }
+    /* Publishes everything written to the heap before */
+    __atomic_store_n(&shm_heap->header->root_offset, offset, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *
+mm_shm_heap_root(mm_shm_heap_handle_t shm_heap)
+{
+    return mm_shm_heap_pointer(shm_heap, __atomic_load_n(&shm_heap->header->root_offset, __ATOMIC_ACQUIRE));
+}
+
+mm_family_handle_t
+mm_page_family_set_shm_heap(mm_family_handle_t vm_page_family, mm_shm_heap_handle_t shm_heap)
+{
+    if (!vm_page_family || !shm_heap)
+        return NULL;
+    if (shm_heap->read_only == MM_TRUE || vm_page_family->is_size_class == MM_TRUE)
+    {
+        printf("Error: %s() Page family %s cannot allocate from this heap\n", __FUNCTION__,
+               vm_page_family->struct_name);
+        return NULL;
+    }
+    pthread_mutex_lock(&family_registry_lock);
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    if (mm_family_has_pages(vm_page_family) == MM_TRUE ||
+        __atomic_load_n(&vm_page_family->shared_objects, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        pthread_mutex_unlock(&family_registry_lock);
+        printf("Error: %s() Page family %s already has pages allocated\n", __FUNCTION__, vm_page_family->struct_name);
+        return NULL;
+    }
+    /* Its objects must all live in the heap, size class pages do not */
+    vm_page_family->size_class = NULL;
+    vm_page_family->shm_heap = shm_heap;
+    vm_page_family->huge_mode = MM_HUGE_PAGES_NONE;
+    vm_page_family->span_pages = mm_family_span_pages(vm_page_family->struct_size);
+    if (vm_page_family->slab_mode == MM_TRUE)
+        mm_family_update_slab_layout(vm_page_family);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    pthread_mutex_unlock(&family_registry_lock);
+    return vm_page_family;
+}
+
+/* Family lock held. Reads the counters of the node pools first_node to
+ * last_node */
+static void
+mm_fill_family_stats(vm_page_family_t *vm_page_family, uint32_t first_node, uint32_t last_node,
+                     mm_family_stats_t *stats)
+{
+    uint64_t span_pages = vm_page_family->span_pages;
+    uint64_t largest_free_block = 0, free_slots = 0;
+    uint32_t numa_node;
+
+    stats->struct_name = vm_page_family->struct_name;
+    stats->struct_size = vm_page_family->struct_size;
+    stats->pages_in_use = 0;
+    stats->objects_allocated = 0;
+    stats->bytes_requested = 0;
+    stats->free_blocks = 0;
+    stats->bytes_free = 0;
+    for (numa_node = first_node; numa_node <= last_node; numa_node++)
+    {
+        mm_family_node_t *node_pool = &vm_page_family->nodes[numa_node];
+        if (largest_free_block < node_pool->largest_free)
+            largest_free_block = node_pool->largest_free;
+        stats->pages_in_use += (node_pool->block_page_count + node_pool->slab_page_count) * span_pages +
+                               node_pool->large_object_pages;
+        stats->objects_allocated += node_pool->objects_in_use;
+        stats->bytes_requested += node_pool->bytes_in_use;
+        stats->free_blocks += node_pool->free_block_count;
+        stats->bytes_free += node_pool->free_block_bytes;
+        if (vm_page_family->slab_mode == MM_TRUE)
+            free_slots += (uint64_t)node_pool->slab_page_count * vm_page_family->slab_slots_per_page -
+                          node_pool->slab_object_count;
+    }
+    stats->bytes_reserved = stats->pages_in_use * SYSTEM_PAGE_SIZE;
+    if (free_slots)
+    {
+        stats->free_blocks += free_slots;
+        stats->bytes_free += free_slots * vm_page_family->slab_slot_size;
+        if (largest_free_block < vm_page_family->slab_slot_size)
+            largest_free_block = vm_page_family->slab_slot_size;
+    }
+    stats->largest_free_block = largest_free_block;
+    stats->internal_frag_bytes = stats->bytes_reserved - stats->bytes_requested - stats->bytes_free;
+    stats->external_frag = stats->bytes_free ? 1.0 - (double)largest_free_block / stats->bytes_free : 0;
+}
+
+int mm_get_family_stats(mm_family_handle_t vm_page_family, mm_family_stats_t *stats)
+{
+    if (!vm_page_family)
+        return -1;
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    mm_fill_family_stats(vm_page_family, 0, vm_page_family->node_count - 1, stats);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    /* The pages of these are reported by the size class */
+    stats->objects_allocated += __atomic_load_n(&vm_page_family->shared_objects, __ATOMIC_RELAXED);
+    stats->bytes_requested += __atomic_load_n(&vm_page_family->shared_bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int mm_get_family_node_stats(mm_family_handle_t vm_page_family, uint32_t numa_node, mm_family_stats_t *stats)
+{
+    if (!vm_page_family || numa_node >= vm_page_family->node_count)
+        return -1;
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    mm_fill_family_stats(vm_page_family, numa_node, numa_node, stats);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return 0;
+}
+
+uint32_t
+mm_get_memory_stats(mm_family_stats_t *stats, uint32_t max_families)
+{
+    vm_page_family_t *vm_page_family_curr = NULL;
+    uint32_t filled = 0;
+    pthread_mutex_lock(&family_registry_lock);
+    ITERATE_PAGE_FAMILIES_BEGIN(&family_registry, vm_page_family_curr)
+    {
+        if (filled == max_families)
+            break;
+        mm_get_family_stats(vm_page_family_curr, &stats[filled++]);
+    }
+    ITERATE_PAGE_FAMILIES_END(&family_registry, vm_page_family_curr)
+    pthread_mutex_unlock(&family_registry_lock);
+    return filled;
+}
+
+static void
+dump_vm_data_page(vm_page_t *vm_page, int page_count)
+{
+    printf("%p  Page %d  (%u system pages)\n", (void *)vm_page, page_count, vm_page->span_pages);
+    printf("next -> %p ", (void *)vm_page->next);
+    printf("prev -> %p ", (void *)vm_page->prev);
+}
+
+static void
+dump_meta_block_data(block_meta_data_t *block_meta, int count)
+{
+    printf("%p    ", (void *)block_meta);
+    printf("Block %d    ", count);
+    if (MM_BLOCK_IS_FREE(block_meta) == MM_TRUE)
+        printf("F R E E D    ");
+    else
+        printf("ALLOCATED    ");
+    printf("block-size = %u    ", MM_BLOCK_SIZE(block_meta));
+    printf("next = %p    ", (void *)NEXT_META_BLOCK(block_meta));
+    printf("prev = %p    ", (void *)PREV_META_BLOCK(block_meta));
+}
+
+static void
+dump_memory_usage_for_page_family(vm_page_family_t *pg_family)
+{
+    vm_page_t *vm_page_curr = NULL;
+    int count = 0, page_count = 0;
+    pthread_mutex_lock(&pg_family->family_lock);
+    ITERATE_VM_PAGE_BEGIN(pg_family, vm_page_curr)
+    {
+
+        dump_vm_data_page(vm_page_curr, page_count);
+        printf("\n");
+
+        block_meta_data_t *block_meta_curr = NULL;
+        ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page_curr, block_meta_curr)
+        {
+            dump_meta_block_data(block_meta_curr, count);
+            printf("\n");
+            count++;
+        }
+        ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page_curr, block_meta_curr)
+        page_count++;
+        printf("\n");
+    }
+    ITERATE_VM_PAGE_END(pg_family, vm_page_curr)
+    uint32_t numa_node, large_object_count = 0, slab_page_count = 0;
+    uint64_t large_object_pages = 0;
+    for (numa_node = 0; numa_node < pg_family->node_count; numa_node++)
+    {
+        large_object_count += pg_family->nodes[numa_node].large_object_count;
+        large_object_pages += pg_family->nodes[numa_node].large_object_pages;
+        slab_page_count += pg_family->nodes[numa_node].slab_page_count;
+    }
+    if (large_object_count)
+    {
+        printf("Large objects = %u    pages = %lu\n", large_object_count, (unsigned long)large_object_pages);
+    }
+    if (pg_family->slab_mode == MM_TRUE)
+    {
+        printf("Slab pages = %u    slot-size = %u    slots-per-page = %u\n",
+               slab_page_count, pg_family->slab_slot_size, pg_family->slab_slots_per_page);
+    }
+    if (pg_family->size_class)
+    {
+        printf("Shared objects = %lu    requested = %lu    size class = %s\n",
+               (unsigned long)__atomic_load_n(&pg_family->shared_objects, __ATOMIC_RELAXED),
+               (unsigned long)__atomic_load_n(&pg_family->shared_bytes, __ATOMIC_RELAXED),
+               pg_family->size_class->struct_name);
+    }
+    mm_family_stats_t stats;
+    mm_fill_family_stats(pg_family, 0, pg_family->node_count - 1, &stats);
+    printf("Objects = %lu    requested = %lu    reserved = %lu    free = %lu    internal-frag = %lu    external-frag = %.2f\n",
+           (unsigned long)stats.objects_allocated, (unsigned long)stats.bytes_requested,
+           (unsigned long)stats.bytes_reserved, (unsigned long)stats.bytes_free,
+           (unsigned long)stats.internal_frag_bytes, stats.external_frag);
+    for (numa_node = 0; pg_family->node_count > 1 && numa_node < pg_family->node_count; numa_node++)
+    {
+        mm_fill_family_stats(pg_family, numa_node, numa_node, &stats);
+        printf("  Node %u    objects = %lu    requested = %lu    reserved = %lu    free = %lu\n", numa_node,
+               (unsigned long)stats.objects_allocated, (unsigned long)stats.bytes_requested,
+               (unsigned long)stats.bytes_reserved, (unsigned long)stats.bytes_free);
+    }
+    pthread_mutex_unlock(&pg_family->family_lock);
+}
+
+void mm_print_memory_usage(char *struct_name)
+{
+    if (!struct_name)
+    {
+        vm_page_family_t *pg_family_curr = NULL;
+        pthread_mutex_lock(&family_registry_lock);
+        ITERATE_PAGE_FAMILIES_BEGIN(&family_registry, pg_family_curr)
+        {
+            printf("Page family -> %s", pg_family_curr->struct_name);
+            printf("\n");
+            dump_memory_usage_for_page_family(pg_family_curr);
+        }
+        ITERATE_PAGE_FAMILIES_END(&family_registry, pg_family_curr)
+        pthread_mutex_unlock(&family_registry_lock);
+    }
+
+    else
+    {
+        vm_page_family_t *pg_family = lookup_page_family_by_name(struct_name);
+        dump_memory_usage_for_page_family(pg_family);
+    }
+}
+
+/* Grows a block being freed over its tail, the hard IF bytes that
+ * separate it from its next block or from the end of the page */
+static void
+mm_reclaim_hard_internal_frag(block_meta_data_t *block_meta_data)
+{
+    mm_block_set_size(block_meta_data, MM_BLOCK_SIZE(block_meta_data) + MM_BLOCK_TAIL(block_meta_data));
+    mm_block_set_tail(block_meta_data, 0);
+}
+
+static block_meta_data_t *
+mm_free_blocks(block_meta_data_t *to_be_free_block)
 {
     block_meta_data_t *return_block = NULL;
-    assert(to_be_free_block->is_free == MM_FALSE);
+    assert(MM_BLOCK_IS_FREE(to_be_free_block) == MM_FALSE);
     vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(to_be_free_block);
     vm_page_family_t *vm_page_family = hosting_page->pg_family;
-    return_block = to_be_free_block;
-    to_be_free_block->is_free = MM_TRUE;
-    block_meta_data_t *next_block = NEXT_META_BLOCK(to_be_free_block);
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(hosting_page);
+    return_block = to_be_free_block;
+    mm_block_set_free(to_be_free_block, MM_TRUE);
+    node_pool->objects_in_use--;
+    node_pool->bytes_in_use -= MM_BLOCK_SIZE(to_be_free_block);
+    block_meta_data_t *next_block = NEXT_META_BLOCK(to_be_free_block);
+    mm_reclaim_hard_internal_frag(to_be_free_block);
+
+    /* Perform merging, neighbours leave their lists before they grow */
+    if (next_block && MM_BLOCK_IS_FREE(next_block) == MM_TRUE)
+    {
+        mm_remove_free_block_meta_data_from_free_block_list(vm_page_family, next_block);
+        mm_union_free_blocks(to_be_free_block, next_block);
+        return_block = to_be_free_block;
+    }
+    block_meta_data_t *prev_block = PREV_META_BLOCK(to_be_free_block);
+    if (prev_block && MM_BLOCK_IS_FREE(prev_block) == MM_TRUE)
+    {
+        mm_remove_free_block_meta_data_from_free_block_list(vm_page_family, prev_block);
+        mm_union_free_blocks(prev_block, to_be_free_block);
+        return_block = prev_block;
+    }
+
+    if (mm_is_vm_page_empty(hosting_page))
+    {
+        mm_vm_page_delete_and_free(hosting_page);
+        return NULL;
+    }
+    mm_add_free_block_meta_data_to_free_block_list(hosting_page->pg_family, return_block);
+    return return_block;
+}
+
+static void
+mm_release_object(vm_page_t *hosting_page, void *app_data)
+{
+    vm_page_family_t *vm_page_family = hosting_page->pg_family;
+    if (MM_PROFILE_PAGE_SAMPLED(hosting_page))
+        mm_profile_sample_free(hosting_page, app_data);
+    if (hosting_page->page_kind == MM_PAGE_LARGE)
+    {
+        mm_free_large_object(hosting_page);
+        return;
+    }
+    if (hosting_page->page_kind == MM_PAGE_BLOCKS)
+        assert(MM_BLOCK_IS_FREE((block_meta_data_t *)app_data - 1) == MM_FALSE);
+    else if (vm_page_family->is_size_class == MM_TRUE)
+        mm_size_class_release_owner(hosting_page, app_data);
+    if (mm_thread_cache_put(hosting_page, app_data) == MM_TRUE)
+        return;
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    mm_free_object(hosting_page, app_data);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+}
+
+/* Aborts unless app_data is a live object with its canary intact */
+static void
+mm_debug_check_object(const char *caller, vm_page_t *hosting_page, void *app_data)
+{
+    uint64_t canary = 0;
+    if (hosting_page->page_kind == MM_PAGE_BLOCKS && MM_BLOCK_IS_FREE((block_meta_data_t *)app_data - 1) == MM_TRUE)
+        mm_debug_report(caller, "Double free", hosting_page, app_data);
+    if (!debug_canary_bytes)
+        return;
+    memcpy(&canary, mm_debug_canary_address(hosting_page, app_data), sizeof(canary));
+    if (canary == (mm_debug_canary(app_data) ^ MM_DEBUG_CANARY_FREED))
+        mm_debug_report(caller, "Double free", hosting_page, app_data);
+    if (canary != mm_debug_canary(app_data))
+        mm_debug_report(caller, "Buffer overrun", hosting_page, app_data);
+}
+
+/* Bytes of a quarantined object that are poisoned, from its start */
+static uint32_t
+mm_debug_poisoned_size(vm_page_t *hosting_page, void *app_data)
+{
+    uint32_t size = hosting_page->page_kind == MM_PAGE_SLAB ? hosting_page->pg_family->struct_size
+                                                            : MM_BLOCK_SIZE((block_meta_data_t *)app_data - 1);
+    return size < MM_DEBUG_POISON_MAX_BYTES ? size : MM_DEBUG_POISON_MAX_BYTES;
+}
+
+/* Releases the oldest quarantined object, which must still be poisoned */
+static void
+mm_debug_quarantine_evict(mm_debug_quarantine_t *quarantine)
+{
+    void *app_data = quarantine->objects[quarantine->head];
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_APP_DATA(app_data);
+    uint32_t size = mm_debug_poisoned_size(hosting_page, app_data), offset;
+    uint64_t word = 0, diff = 0;
+    /* No early exit, the word loop vectorizes */
+    for (offset = 0; offset + sizeof(word) <= size; offset += sizeof(word))
+    {
+        memcpy(&word, (char *)app_data + offset, sizeof(word));
+        diff |= word ^ MM_DEBUG_POISON_WORD;
+    }
+    for (; offset < size; offset++)
+        diff |= ((unsigned char *)app_data)[offset] ^ MM_DEBUG_POISON;
+    if (diff || mm_debug_canary_is_freed(hosting_page, app_data) == MM_FALSE)
+        mm_debug_report(__FUNCTION__, "Write after free", hosting_page, app_data);
+    quarantine->head = (quarantine->head + 1) % MM_DEBUG_QUARANTINE_DEPTH;
+    quarantine->count--;
+    mm_release_object(hosting_page, app_data);
+}
+
+static void
+mm_debug_flush_quarantine(mm_debug_quarantine_t *quarantine)
+{
+    while (quarantine->count)
+        mm_debug_quarantine_evict(quarantine);
+}
+
+/* Checks an object being freed and flips its canary. Returns MM_TRUE if
+ * the quarantine took it over. Large objects are unmapped when freed,
+ * touching them afterwards faults without any quarantine */
+static vm_bool_t
+mm_debug_free(vm_page_t *hosting_page, void *app_data)
+{
+    mm_debug_quarantine_t *quarantine = &thread_cache.quarantine;
+    uint64_t canary = 0;
+    mm_debug_check_object("xfree", hosting_page, app_data);
+    if (!debug_canary_bytes || hosting_page->page_kind == MM_PAGE_LARGE)
+        return MM_FALSE;
+    canary = mm_debug_canary(app_data) ^ MM_DEBUG_CANARY_FREED;
+    memcpy(mm_debug_canary_address(hosting_page, app_data), &canary, sizeof(canary));
+    if (!(debug_flags & MM_DEBUG_QUARANTINE))
+        return MM_FALSE;
+    memset(app_data, MM_DEBUG_POISON, mm_debug_poisoned_size(hosting_page, app_data));
+    if (!quarantine->count)
+    {
+        pthread_once(&thread_cache_key_once, mm_thread_cache_key_create);
+        pthread_setspecific(thread_cache_key, &thread_cache);
+    }
+    if (quarantine->count == MM_DEBUG_QUARANTINE_DEPTH)
+        mm_debug_quarantine_evict(quarantine);
+    quarantine->objects[(quarantine->head + quarantine->count) % MM_DEBUG_QUARANTINE_DEPTH] = app_data;
+    quarantine->count++;
+    return MM_TRUE;
+}
+
+int mm_set_debug(uint32_t flags)
+{
+    if (flags & ~(uint32_t)(MM_DEBUG_CANARIES | MM_DEBUG_GUARD_PAGES | MM_DEBUG_QUARANTINE))
+    {
+        printf("Error: %s() Invalid debug flags 0x%x\n", __FUNCTION__, flags);
+        return -1;
+    }
+    pthread_mutex_lock(&family_registry_lock);
+    if (family_registry.count)
+    {
+        pthread_mutex_unlock(&family_registry_lock);
+        printf("Error: %s() Page families are already registered\n", __FUNCTION__);
+        return -1;
+    }
+    if (flags & MM_DEBUG_QUARANTINE)
+        flags |= MM_DEBUG_CANARIES;
+    debug_canary_secret = ((uint64_t)getpid() << 32) ^ (uintptr_t)&debug_canary_secret ^ 0xC2B2AE3D27D4EB4Full;
+    debug_canary_bytes = flags & MM_DEBUG_CANARIES ? MM_DEBUG_CANARY_BYTES : 0;
+    debug_flags = flags;
+    pthread_mutex_unlock(&family_registry_lock);
+    return 0;
+}
+
+/* Family lock held. Walks the blocks of a page, returns the number of
+ * problems found */
+static uint32_t
+mm_verify_page_blocks(vm_page_t *vm_page)
+{
+    block_meta_data_t *curr = NULL, *prev = NULL;
+    char *page_end = (char *)vm_page + vm_page->span_pages * SYSTEM_PAGE_SIZE;
+    uint64_t free_bytes = 0, canary = 0;
+    uint32_t problems = 0;
+
+    for (curr = &vm_page->block_meta_data; curr; prev = curr, curr = NEXT_META_BLOCK(curr))
+    {
+        const char *problem = NULL;
+        if (MM_BLOCK_END(curr) > page_end)
+            problem = "Block runs past the end of its page";
+        else if (PREV_META_BLOCK(curr) != prev)
+            problem = "Block does not link back to the previous one";
+        else if (MM_BLOCK_IS_FREE(curr) == MM_TRUE)
+        {
+            free_bytes += MM_BLOCK_SIZE(curr);
+            if (prev && MM_BLOCK_IS_FREE(prev) == MM_TRUE)
+                problem = "Adjacent free blocks";
+            else if (MM_BLOCK_TAIL(curr))
+                problem = "Free block with a tail";
+            else if (!MM_BLOCK_GLUE(curr)->left)
+                problem = "Free block missing from its free list";
+        }
+        else if (debug_canary_bytes)
+        {
+            /* Objects in a thread cache or the quarantine are flipped */
+            memcpy(&canary, mm_debug_canary_address(vm_page, curr + 1), sizeof(canary));
+            if (canary != mm_debug_canary(curr + 1) && mm_debug_canary_is_freed(vm_page, curr + 1) == MM_FALSE)
+                problem = "Buffer overrun";
+        }
+        if (!problem)
+            continue;
+        printf("Error: %s() %s, block %p of family %s\n", __FUNCTION__, problem, (void *)curr, vm_page->pg_family->struct_name);
+        problems++;
+        if (MM_BLOCK_END(curr) > page_end)
+            break;
+    }
+    if (!problems && free_bytes != vm_page->free_bytes)
+    {
+        printf("Error: %s() Page %p of family %s has %lu bytes in free blocks, %u on its lists\n", __FUNCTION__,
+               (void *)vm_page, vm_page->pg_family->struct_name, (unsigned long)free_bytes, vm_page->free_bytes);
+        problems++;
+    }
+    return problems;
+}
+
+uint32_t
+mm_verify_heap()
+{
+    vm_page_family_t *vm_page_family = NULL;
+    vm_page_t *vm_page = NULL;
+    uint32_t problems = 0;
+    pthread_mutex_lock(&family_registry_lock);
+    ITERATE_PAGE_FAMILIES_BEGIN(&family_registry, vm_page_family)
+    {
+        pthread_mutex_lock(&vm_page_family->family_lock);
+        ITERATE_VM_PAGE_BEGIN(vm_page_family, vm_page)
+        {
+            problems += mm_verify_page_blocks(vm_page);
+        }
+        ITERATE_VM_PAGE_END(vm_page_family, vm_page);
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+    }
+    ITERATE_PAGE_FAMILIES_END(&family_registry, vm_page_family)
+    pthread_mutex_unlock(&family_registry_lock);
+    return problems;
+}
+
+void xfree(void *app_data)
+{
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_APP_DATA(app_data);
+    /* Arena objects go back with their arena */
+    if (hosting_page->page_kind == MM_PAGE_ARENA)
+        return;
+    if (MM_DEBUG_ENABLED() && mm_debug_free(hosting_page, app_data) == MM_TRUE)
+        return;
+    mm_release_object(hosting_page, app_data);
+}
+
+/* Family lock held. Frees blocks of one page, given in ascending address
+ * order. Each block merges backwards into the run being built, so every
+ * coalesced run is filed once instead of once per block. A block is
+ * on a free list exactly when its glue has a left neighbour */
+static void
+mm_free_blocks_of_page(vm_page_t *hosting_page, void **ptrs, int n)
+{
+    vm_page_family_t *vm_page_family = hosting_page->pg_family;
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(hosting_page);
+    block_meta_data_t **runs = (block_meta_data_t **)ptrs;
+    int i, run_count = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        block_meta_data_t *block_meta_data = (block_meta_data_t *)ptrs[i] - 1;
+        assert(MM_BLOCK_IS_FREE(block_meta_data) == MM_FALSE);
+        mm_block_set_free(block_meta_data, MM_TRUE);
+        node_pool->objects_in_use--;
+        node_pool->bytes_in_use -= MM_BLOCK_SIZE(block_meta_data);
+        mm_reclaim_hard_internal_frag(block_meta_data);
+        init_glthread(MM_BLOCK_GLUE(block_meta_data));
+
+        block_meta_data_t *next_block = NEXT_META_BLOCK(block_meta_data);
+        if (next_block && MM_BLOCK_IS_FREE(next_block) == MM_TRUE)
+        {
+            mm_remove_free_block_meta_data_from_free_block_list(vm_page_family, next_block);
+            mm_union_free_blocks(block_meta_data, next_block);
+        }
+        block_meta_data_t *prev_block = PREV_META_BLOCK(block_meta_data);
+        if (prev_block && MM_BLOCK_IS_FREE(prev_block) == MM_TRUE)
+        {
+            vm_bool_t prev_is_run = MM_BLOCK_GLUE(prev_block)->left ? MM_FALSE : MM_TRUE;
+            if (prev_is_run == MM_FALSE)
+                mm_remove_free_block_meta_data_from_free_block_list(vm_page_family, prev_block);
+            mm_union_free_blocks(prev_block, block_meta_data);
+            if (prev_is_run == MM_FALSE)
+                runs[run_count++] = prev_block;
+            continue;
+        }
+        runs[run_count++] = block_meta_data;
+    }
+
+    if (mm_is_vm_page_empty(hosting_page))
+    {
+        mm_vm_page_delete_and_free(hosting_page);
+        return;
+    }
+    for (i = 0; i < run_count; i++)
+        mm_add_free_block_meta_data_to_free_block_list(vm_page_family, runs[i]);
+}
+
+/* Sorts ptrs by address, which groups them by hosting page, and takes
+ * each page's family lock once for all of that page's objects */
+void xfree_batch(void **ptrs, int n)
+{
+    int i = 0, j;
+    if (MM_DEBUG_ENABLED())
+    {
+        for (i = 0; i < n; i++)
+            xfree(ptrs[i]);
+        return;
+    }
+    qsort(ptrs, n, sizeof(void *), mm_compare_addresses);
+    while (i < n)
+    {
+        vm_page_t *hosting_page = MM_GET_PAGE_FROM_APP_DATA(ptrs[i]);
+        vm_page_family_t *vm_page_family = hosting_page->pg_family;
+        for (j = i + 1; j < n && MM_GET_PAGE_FROM_APP_DATA(ptrs[j]) == hosting_page; j++)
+        {
+            if (MM_PROFILE_PAGE_SAMPLED(hosting_page))
+                mm_profile_sample_free(hosting_page, ptrs[j]);
+        }
+        if (MM_PROFILE_PAGE_SAMPLED(hosting_page))
+            mm_profile_sample_free(hosting_page, ptrs[i]);
+        if (hosting_page->page_kind == MM_PAGE_ARENA)
+        {
+            i = j;
+            continue;
+        }
+        if (hosting_page->page_kind == MM_PAGE_LARGE)
+        {
+            mm_free_large_object(hosting_page);
+            i = j;
+            continue;
+        }
+        pthread_mutex_lock(&vm_page_family->family_lock);
+        if (hosting_page->page_kind == MM_PAGE_SLAB)
+        {
+            for (; i < j; i++)
+            {
+                if (vm_page_family->is_size_class == MM_TRUE)
+                    mm_size_class_release_owner(hosting_page, ptrs[i]);
+                mm_slab_free_object(hosting_page, ptrs[i]);
+            }
+        }
+        else
+            mm_free_blocks_of_page(hosting_page, ptrs + i, j - i);
+        pthread_mutex_unlock(&vm_page_family->family_lock);
+        i = j;
+    }
+}
 
-    /* Handle hard IF memory */
+/* Family lock held. Resizes a block over its tail and a free next block,
+ * whatever is left of them is split off as a free block again. is_zeroed
+ * is set if the bytes a grown block gains read zero */
+static vm_bool_t
+mm_resize_block_in_place(vm_page_family_t *vm_page_family, block_meta_data_t *block_meta_data, uint32_t new_size,
+                         vm_bool_t *is_zeroed)
+{
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(block_meta_data);
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(hosting_page);
+    block_meta_data_t *next_block = NEXT_META_BLOCK(block_meta_data), *free_block = NULL;
+    uint32_t old_size = MM_BLOCK_SIZE(block_meta_data), extent = 0;
+    uint32_t available = old_size + MM_BLOCK_TAIL(block_meta_data);
+    char *zero_start = NULL, *zero_end = NULL;
+    if (next_block && MM_BLOCK_IS_FREE(next_block) == MM_FALSE)
+        next_block = NULL;
+    /* With room for the canary in debug mode */
+    new_size += debug_canary_bytes;
+    extent = MM_BLOCK_EXTENT(new_size);
+    if (new_size > available + (next_block ? sizeof(block_meta_data_t) + MM_BLOCK_SIZE(next_block) : 0))
+        return MM_FALSE;
+    /* Past the old end lie the tail and the header of the free neighbour,
+     * which are cleared here, and then the neighbour's payload. Asked
+     * before a new free block's header is written into that range */
+    zero_start = (char *)(block_meta_data + 1) + old_size;
+    zero_end = next_block ? (char *)(next_block + 1) : zero_start;
+    *is_zeroed = MM_FALSE;
+    if (new_size > old_size)
+        *is_zeroed = mm_vm_page_mark_dirty(hosting_page, zero_end, (char *)(block_meta_data + 1) + new_size);
     if (next_block)
     {
-        to_be_free_block->block_size += mm_get_hard_internal_frag_size(to_be_free_block, next_block);
+        mm_remove_free_block_meta_data_from_free_block_list(vm_page_family, next_block);
+        available += sizeof(block_meta_data_t) + MM_BLOCK_SIZE(next_block);
+    }
+    if (*is_zeroed == MM_TRUE)
+        memset(zero_start, 0, zero_end - zero_start);
+    mm_block_set_size(block_meta_data, new_size);
+    if (available - extent < MM_MIN_FREE_BLOCK)
+    {
+        mm_block_set_tail(block_meta_data, available - new_size);
+        MM_LINK_NEXT_META_BLOCK(block_meta_data);
     }
     else
     {
-        char *end_address_of_vm_page = (char *)((char *)hosting_page + SYSTEM_PAGE_SIZE);
-        char *end_addr_of_free_data_block = (char *)((to_be_free_block + 1) + to_be_free_block->block_size);
-        to_be_free_block->block_size += (int)((unsigned long)end_address_of_vm_page - (unsigned long)end_addr_of_free_data_block);
+        mm_block_set_tail(block_meta_data, extent - new_size);
+        free_block = (block_meta_data_t *)MM_BLOCK_END(block_meta_data);
+        mm_block_init(free_block, MM_TRUE, available - extent - sizeof(block_meta_data_t), 0);
+        mm_vm_page_mark_dirty(hosting_page, (char *)free_block, (char *)(free_block + 1));
+        mm_bind_blocks_for_allocation(block_meta_data, free_block);
+        mm_add_free_block_meta_data_to_free_block_list(vm_page_family, free_block);
+    }
+    node_pool->bytes_in_use += new_size;
+    node_pool->bytes_in_use -= old_size;
+    if (debug_canary_bytes)
+    {
+        mm_debug_trim_block(block_meta_data);
+        mm_vm_page_mark_dirty(hosting_page, (char *)(block_meta_data + 1),
+                              (char *)(block_meta_data + 1) + MM_BLOCK_SIZE(block_meta_data) + debug_canary_bytes);
+        mm_debug_arm_canary(block_meta_data + 1);
     }
+    return MM_TRUE;
+}
 
-    /* Perform merging */
-    if (next_block && next_block->is_free == MM_TRUE)
+/* Family lock held. A large object keeps its mapping as long as the new
+ * size fits, whole pages it no longer reaches are unmapped unless they
+ * are slots of a shm heap. One that ends on a guard page has to move */
+static vm_bool_t
+mm_resize_large_object_in_place(vm_page_t *vm_page, void *app_data, uint64_t new_size)
+{
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    uint64_t payload_offset = (uint64_t)((char *)app_data - (char *)vm_page);
+    uint64_t span_pages = (payload_offset + new_size + debug_canary_bytes + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE;
+    if (span_pages > vm_page->span_pages || (debug_flags & MM_DEBUG_GUARD_PAGES))
+        return MM_FALSE;
+    /* Unmapping part of a huge page would split it */
+    if (span_pages < vm_page->span_pages && vm_page->pg_family->huge_mode == MM_HUGE_PAGES_NONE &&
+        !vm_page->pg_family->shm_heap)
     {
-        mm_union_free_blocks(to_be_free_block, next_block);
-        return_block = to_be_free_block;
+        munmap((char *)vm_page + span_pages * SYSTEM_PAGE_SIZE, (vm_page->span_pages - span_pages) * SYSTEM_PAGE_SIZE);
+        node_pool->large_object_pages -= vm_page->span_pages - span_pages;
+        vm_page->span_pages = (uint32_t)span_pages;
     }
-    block_meta_data_t *prev_block = PREV_META_BLOCK(to_be_free_block);
-    if (prev_block && prev_block->is_free == MM_TRUE)
+    node_pool->bytes_in_use += new_size;
+    node_pool->bytes_in_use -= vm_page->large_object_size;
+    vm_page->large_object_size = new_size;
+    if (debug_canary_bytes)
+        mm_debug_arm_canary(app_data);
+    return MM_TRUE;
+}
+
+void *
+xrealloc(void *app_data, int units)
+{
+    vm_page_t *hosting_page = NULL;
+    vm_page_family_t *vm_page_family = NULL;
+    uint64_t old_size = 0, new_size;
+    vm_bool_t is_resized = MM_FALSE, is_zeroed = MM_FALSE;
+    void *new_app_data = NULL;
+    if (!app_data || units <= 0)
     {
-        mm_union_free_blocks(prev_block, to_be_free_block);
-        return_block = prev_block;
+        printf("Error: %s() Invalid object or unit count %d\n", __FUNCTION__, units);
+        return NULL;
     }
+    hosting_page = MM_GET_PAGE_FROM_APP_DATA(app_data);
+    vm_page_family = hosting_page->pg_family;
+    if (hosting_page->page_kind == MM_PAGE_ARENA)
+    {
+        printf("Error: %s() Arena objects cannot be resized\n", __FUNCTION__);
+        return NULL;
+    }
+    if (MM_DEBUG_ENABLED())
+        mm_debug_check_object(__FUNCTION__, hosting_page, app_data);
+    /* Resized as an object of the family it was allocated for */
+    if (hosting_page->page_kind == MM_PAGE_SLAB && vm_page_family->is_size_class == MM_TRUE)
+        vm_page_family = mm_size_class_owner(hosting_page, app_data);
+    new_size = (uint64_t)units * vm_page_family->struct_size;
+    vm_bool_t is_large = mm_is_large_request(vm_page_family, new_size, vm_page_family->alignment);
 
-    if (mm_is_vm_page_empty(hosting_page))
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    if (hosting_page->page_kind == MM_PAGE_SLAB)
     {
-        mm_vm_page_delete_and_free(hosting_page);
+        old_size = vm_page_family->struct_size;
+        is_resized = new_size == old_size ? MM_TRUE : MM_FALSE;
+    }
+    else if (hosting_page->page_kind == MM_PAGE_LARGE)
+    {
+        old_size = hosting_page->large_object_size;
+        if (is_large == MM_TRUE)
+            is_resized = mm_resize_large_object_in_place(hosting_page, app_data, new_size);
+    }
+    else
+    {
+        old_size = MM_BLOCK_SIZE((block_meta_data_t *)app_data - 1);
+        if (is_large == MM_FALSE)
+            is_resized = mm_resize_block_in_place(vm_page_family, (block_meta_data_t *)app_data - 1, (uint32_t)new_size,
+                                                  &is_zeroed);
+    }
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+
+    if (is_resized == MM_TRUE)
+    {
+        if (new_size > old_size && is_zeroed == MM_FALSE)
+            memset((char *)app_data + old_size, 0, new_size - old_size);
+        return app_data;
+    }
+    new_app_data = mm_allocate_by_handle(vm_page_family, units, vm_page_family->alignment, MM_FALSE);
+    if (!new_app_data)
+        return NULL;
+    memcpy(new_app_data, app_data, new_size < old_size ? new_size : old_size);
+    if (new_size > old_size)
+        memset((char *)new_app_data + old_size, 0, new_size - old_size);
+    xfree(app_data);
+    return new_app_data;
+}
+
+/* Compaction */
+
+mm_family_handle_t
+mm_page_family_set_relocator(mm_family_handle_t vm_page_family, mm_relocate_fn_t relocate, void *arg)
+{
+    if (!vm_page_family)
         return NULL;
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    vm_page_family->relocate = relocate;
+    vm_page_family->relocate_arg = arg;
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return vm_page_family;
+}
+
+/* Whole system pages of a free block that may have been written, those
+ * past its free list glue and below the page's dirty limit. Returns
+ * their size, the range is [*start, *end) */
+static uint64_t
+mm_free_block_idle_range(vm_page_t *vm_page, block_meta_data_t *free_block, char **start, char **end)
+{
+    uintptr_t first = MM_ALIGN_UP((uintptr_t)(MM_BLOCK_GLUE(free_block) + 1), SYSTEM_PAGE_SIZE);
+    uintptr_t last = (uintptr_t)MM_BLOCK_END(free_block) & ~(uintptr_t)(SYSTEM_PAGE_SIZE - 1);
+    uintptr_t dirty_end = MM_ALIGN_UP((uintptr_t)vm_page + vm_page->dirty_limit, SYSTEM_PAGE_SIZE);
+    if (last > dirty_end)
+        last = dirty_end;
+    if (last <= first)
+        return 0;
+    *start = (char *)first;
+    *end = (char *)last;
+    return last - first;
+}
+
+/* Family lock held. Adds up the resident idle bytes of the free blocks
+ * on the family's pages, and gives them back to the kernel if release
+ * is set. Huge page backed pages are left alone, advising part of a
+ * huge page would split it */
+static uint64_t
+mm_compaction_idle_bytes(vm_page_family_t *vm_page_family, vm_bool_t release)
+{
+    vm_page_t *vm_page = NULL;
+    block_meta_data_t *block_meta_data = NULL;
+    char *start = NULL, *end = NULL;
+    unsigned char resident[MM_MAX_SPAN_PAGES];
+    uint64_t idle_bytes = 0, range_bytes, range_pages, i;
+    if (vm_page_family->huge_mode != MM_HUGE_PAGES_NONE)
+        return 0;
+    ITERATE_VM_PAGE_BEGIN(vm_page_family, vm_page)
+    {
+        ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page, block_meta_data)
+        {
+            if (MM_BLOCK_IS_FREE(block_meta_data) == MM_FALSE)
+                continue;
+            range_bytes = mm_free_block_idle_range(vm_page, block_meta_data, &start, &end);
+            if (!range_bytes)
+                continue;
+            range_pages = range_bytes / SYSTEM_PAGE_SIZE;
+            if (mincore(start, range_bytes, resident))
+                memset(resident, 1, range_pages);
+            for (i = 0; i < range_pages; i++)
+                idle_bytes += (resident[i] & 1) ? SYSTEM_PAGE_SIZE : 0;
+            if (release == MM_FALSE ||
+                mm_discard_pages(start, range_bytes, vm_page_family->shm_heap ? MM_TRUE : MM_FALSE))
+                continue;
+            /* What the kernel took back reads as zero again */
+            if (end >= (char *)vm_page + vm_page->dirty_limit)
+                vm_page->dirty_limit = (uint32_t)(start - (char *)vm_page);
+        }
+        ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page, block_meta_data);
     }
-    mm_add_free_block_meta_data_to_free_block_list(hosting_page->pg_family, return_block);
-    return return_block;
+    ITERATE_VM_PAGE_END(vm_page_family, vm_page);
+    return idle_bytes;
 }
 
-void xfree(void *app_data)
+static int
+mm_compare_candidates(const void *a, const void *b)
+{
+    const mm_compaction_candidate_t *first = (const mm_compaction_candidate_t *)a;
+    const mm_compaction_candidate_t *second = (const mm_compaction_candidate_t *)b;
+    return (first->occupancy > second->occupancy) - (first->occupancy < second->occupancy);
+}
+
+static vm_bool_t
+mm_compaction_check_page(vm_page_t *vm_page, uint32_t max_occupancy, mm_compaction_candidate_t *candidate)
+{
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    block_meta_data_t *block_meta_data = NULL;
+    uint64_t capacity;
+    candidate->vm_page = vm_page;
+    candidate->objects = 0;
+    candidate->bytes_in_use = 0;
+    if (vm_page->page_kind == MM_PAGE_SLAB)
+    {
+        candidate->objects = vm_page->slab_in_use;
+        candidate->bytes_in_use = (uint64_t)vm_page->slab_in_use * vm_page_family->struct_size;
+        capacity = (uint64_t)vm_page_family->slab_slots_per_page * vm_page_family->struct_size;
+    }
+    else
+    {
+        ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page, block_meta_data)
+        {
+            if (MM_BLOCK_IS_FREE(block_meta_data) == MM_FALSE)
+            {
+                candidate->objects++;
+                candidate->bytes_in_use += MM_BLOCK_SIZE(block_meta_data);
+            }
+        }
+        ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page, block_meta_data);
+        capacity = mm_max_page_allocatable_memory(vm_page->span_pages);
+    }
+    candidate->occupancy = (uint32_t)(candidate->bytes_in_use * 1000 / capacity);
+    return candidate->objects && candidate->bytes_in_use * 100 <= max_occupancy * capacity ? MM_TRUE : MM_FALSE;
+}
+
+/* Family lock held. Finds the sparse block and slab pages of one node,
+ * all slab pages that are not full wait on the node's partial list.
+ * Fills candidates, unless it is NULL, and returns how many there are */
+static uint32_t
+mm_compaction_scan_node(vm_page_family_t *vm_page_family, uint32_t numa_node, uint32_t max_occupancy,
+                        mm_compaction_candidate_t *candidates, mm_compaction_stats_t *stats)
+{
+    mm_compaction_candidate_t candidate;
+    vm_page_t *vm_page = NULL;
+    glthread_t *curr = NULL;
+    uint32_t count = 0;
+    ITERATE_VM_PAGE_BEGIN(vm_page_family, vm_page)
+    {
+        if (vm_page->numa_node != numa_node || mm_compaction_check_page(vm_page, max_occupancy, &candidate) == MM_FALSE)
+            continue;
+        if (candidates)
+            candidates[count] = candidate;
+        count++;
+        stats->sparse_objects += candidate.objects;
+        stats->sparse_bytes += candidate.bytes_in_use;
+    }
+    ITERATE_VM_PAGE_END(vm_page_family, vm_page);
+    ITERATE_GLTHREAD_BEGIN(&vm_page_family->nodes[numa_node].slab_partial_pages, curr)
+    {
+        vm_page = glthread_to_partial_page(curr);
+        if (mm_compaction_check_page(vm_page, max_occupancy, &candidate) == MM_FALSE)
+            continue;
+        if (candidates)
+            candidates[count] = candidate;
+        count++;
+        stats->sparse_objects += candidate.objects;
+        stats->sparse_bytes += candidate.bytes_in_use;
+    }
+    ITERATE_GLTHREAD_END(&vm_page_family->nodes[numa_node].slab_partial_pages, curr);
+    stats->sparse_pages += count;
+    return count;
+}
+
+int mm_get_compaction_stats(mm_family_handle_t vm_page_family, uint32_t max_occupancy, mm_compaction_stats_t *stats)
+{
+    uint32_t numa_node;
+    if (!vm_page_family)
+        return -1;
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    for (numa_node = 0; numa_node < vm_page_family->node_count; numa_node++)
+        mm_compaction_scan_node(vm_page_family, numa_node, max_occupancy, NULL, stats);
+    stats->idle_bytes = mm_compaction_idle_bytes(vm_page_family, MM_FALSE);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    return 0;
+}
+
+/* A page being emptied is hidden from allocation, its free space is
+ * taken off the page's free list or the page off the slab partial list */
+static void
+mm_compaction_hide_page(vm_page_t *vm_page)
+{
+    block_meta_data_t *block_meta_data = NULL;
+    if (vm_page->page_kind == MM_PAGE_SLAB)
+    {
+        remove_glthread(&vm_page->partial_glue);
+        return;
+    }
+    ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page, block_meta_data)
+    {
+        if (MM_BLOCK_IS_FREE(block_meta_data) == MM_TRUE)
+            mm_remove_free_block_meta_data_from_free_block_list(vm_page->pg_family, block_meta_data);
+    }
+    ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page, block_meta_data);
+}
+
+/* Makes a hidden page's free space available again, merging the blocks
+ * freed by moving objects away, or releases the page if it is empty.
+ * Returns MM_TRUE if the page was released */
+static vm_bool_t
+mm_compaction_restore_page(vm_page_t *vm_page)
+{
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    block_meta_data_t *block_meta_data = NULL, *next_block = NULL;
+    if (vm_page->page_kind == MM_PAGE_SLAB)
+    {
+        glthread_add_next(&MM_PAGE_NODE_POOL(vm_page)->slab_partial_pages, &vm_page->partial_glue);
+        return MM_FALSE;
+    }
+    ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page, block_meta_data)
+    {
+        if (MM_BLOCK_IS_FREE(block_meta_data) == MM_FALSE)
+            continue;
+        while ((next_block = NEXT_META_BLOCK(block_meta_data)) && MM_BLOCK_IS_FREE(next_block) == MM_TRUE)
+            mm_union_free_blocks(block_meta_data, next_block);
+    }
+    ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page, block_meta_data);
+    if (mm_is_vm_page_empty(vm_page))
+    {
+        mm_vm_page_delete_and_free(vm_page);
+        return MM_TRUE;
+    }
+    ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page, block_meta_data)
+    {
+        if (MM_BLOCK_IS_FREE(block_meta_data) == MM_TRUE)
+            mm_add_free_block_meta_data_to_free_block_list(vm_page_family, block_meta_data);
+    }
+    ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page, block_meta_data);
+    return MM_FALSE;
+}
+
+/* Copies one object of a hidden page into the family's visible pages.
+ * Returns 0 once it moved, 1 if the relocator refused and -1 if there
+ * is no room for it. A slab page is released with its last object */
+static int
+mm_compaction_move_object(vm_page_t *vm_page, void *app_data, uint32_t size)
+{
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    mm_family_node_t *node_pool = MM_PAGE_NODE_POOL(vm_page);
+    block_meta_data_t *block_meta_data = (block_meta_data_t *)app_data - 1;
+    vm_bool_t is_zeroed = MM_FALSE;
+    void *new_app_data = mm_allocate_object(vm_page_family, vm_page->numa_node, (int)(size / vm_page_family->struct_size),
+                                            vm_page_family->alignment, &is_zeroed);
+    if (!new_app_data)
+        return -1;
+    memcpy(new_app_data, app_data, size);
+    if (vm_page_family->relocate(app_data, new_app_data, vm_page_family->relocate_arg))
+    {
+        mm_free_object(MM_GET_PAGE_FROM_APP_DATA(new_app_data), new_app_data);
+        return 1;
+    }
+    if (MM_PROFILE_PAGE_SAMPLED(vm_page))
+        mm_profile_sample_free(vm_page, app_data);
+    if (vm_page->page_kind == MM_PAGE_SLAB)
+    {
+        if (vm_page_family->is_size_class == MM_TRUE)
+            *mm_size_class_owner_tag(MM_GET_PAGE_FROM_APP_DATA(new_app_data), new_app_data) =
+                *mm_size_class_owner_tag(vm_page, app_data);
+        mm_slab_free_object(vm_page, app_data);
+        return 0;
+    }
+    /* Merged and filed when the page is restored */
+    mm_block_set_free(block_meta_data, MM_TRUE);
+    node_pool->objects_in_use--;
+    node_pool->bytes_in_use -= MM_BLOCK_SIZE(block_meta_data);
+    mm_reclaim_hard_internal_frag(block_meta_data);
+    init_glthread(MM_BLOCK_GLUE(block_meta_data));
+    return 0;
+}
+
+/* Moves the objects of candidates[index], whose page is hidden like all
+ * the candidates up to *last. When the visible pages run out of room
+ * the densest hidden candidate is made visible again. Returns 0 once
+ * the page is empty, non zero when an object had to stay */
+static int
+mm_compaction_evacuate(mm_compaction_candidate_t *candidates, uint32_t index, uint32_t *last,
+                       uint64_t *free_slots, mm_compaction_stats_t *stats)
+{
+    vm_page_t *vm_page = candidates[index].vm_page;
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    block_meta_data_t *block_meta_data = NULL, *next_block = NULL;
+    uint32_t slot, slot_count = 0;
+    vm_bool_t last_object = MM_FALSE;
+    void *app_data = NULL;
+    int rc;
+
+    if (vm_page->page_kind == MM_PAGE_SLAB)
+    {
+        /* Live slots are the carved ones not on the free stack */
+        slot_count = vm_page->slab_carved;
+        memset(free_slots, 0, (slot_count + 63) / 64 * sizeof(uint64_t));
+        for (app_data = vm_page->slab_free_head; app_data; app_data = *(void **)app_data)
+        {
+            slot = (uint32_t)(((char *)app_data - (char *)vm_page - vm_page_family->slab_first_slot) /
+                              vm_page_family->slab_slot_size);
+            free_slots[slot / 64] |= 1ull << (slot % 64);
+        }
+    }
+    else
+        next_block = &vm_page->block_meta_data;
+
+    for (slot = 0;; slot++)
+    {
+        uint32_t size = vm_page_family->struct_size;
+        if (vm_page->page_kind == MM_PAGE_SLAB)
+        {
+            if (slot == slot_count)
+                break;
+            if (free_slots[slot / 64] & (1ull << (slot % 64)))
+                continue;
+            app_data = (char *)vm_page + vm_page_family->slab_first_slot + slot * vm_page_family->slab_slot_size;
+        }
+        else
+        {
+            if (!(block_meta_data = next_block))
+                break;
+            next_block = NEXT_META_BLOCK(block_meta_data);
+            if (MM_BLOCK_IS_FREE(block_meta_data) == MM_TRUE)
+                continue;
+            app_data = (void *)(block_meta_data + 1);
+            size = MM_BLOCK_SIZE(block_meta_data);
+        }
+        /* Freed objects waiting in the quarantine have to stay */
+        if (debug_canary_bytes && mm_debug_canary_is_freed(vm_page, app_data) == MM_TRUE)
+            return 1;
+        last_object = vm_page->page_kind == MM_PAGE_SLAB && vm_page->slab_in_use == 1 ? MM_TRUE : MM_FALSE;
+        rc = mm_compaction_move_object(vm_page, app_data, size);
+        while (rc < 0 && *last > index)
+        {
+            mm_compaction_restore_page(candidates[(*last)--].vm_page);
+            rc = mm_compaction_move_object(vm_page, app_data, size);
+        }
+        if (rc)
+            return rc;
+        stats->objects_moved++;
+        if (last_object == MM_TRUE)
+            return 0;
+    }
+    return 0;
+}
+
+/* Family lock held. Empties the sparse pages of one node, sparsest first */
+static void
+mm_compaction_compact_node(vm_page_family_t *vm_page_family, uint32_t numa_node, uint32_t max_occupancy,
+                           uint64_t *free_slots, mm_compaction_stats_t *stats)
+{
+    mm_compaction_stats_t scan_stats;
+    uint32_t count, index, last, units;
+    vm_page_t *vm_page = NULL;
+    vm_bool_t is_released = MM_FALSE;
+    count = mm_compaction_scan_node(vm_page_family, numa_node, max_occupancy, NULL, stats);
+    if (!count)
+        return;
+    units = (uint32_t)((count * sizeof(mm_compaction_candidate_t) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
+    mm_compaction_candidate_t *candidates = (mm_compaction_candidate_t *)mm_get_new_vm_page_from_kernel(units);
+    if (!candidates)
+        return;
+    memset(&scan_stats, 0, sizeof(scan_stats));
+    mm_compaction_scan_node(vm_page_family, numa_node, max_occupancy, candidates, &scan_stats);
+    qsort(candidates, count, sizeof(mm_compaction_candidate_t), mm_compare_candidates);
+    for (index = 0; index < count; index++)
+        mm_compaction_hide_page(candidates[index].vm_page);
+
+    /* Candidates past last have been made visible again */
+    last = count - 1;
+    for (index = 0; index <= last; index++)
+    {
+        vm_page = candidates[index].vm_page;
+        if (mm_compaction_evacuate(candidates, index, &last, free_slots, stats))
+            is_released = mm_compaction_restore_page(vm_page);
+        else if (vm_page->page_kind == MM_PAGE_SLAB)
+            is_released = MM_TRUE;
+        else
+            is_released = mm_compaction_restore_page(vm_page);
+        if (is_released == MM_TRUE)
+            stats->pages_released++;
+    }
+    mm_return_vm_page_to_kernel((void *)candidates, units);
+}
+
+int mm_compact_family(mm_family_handle_t vm_page_family, uint32_t max_occupancy, mm_compaction_stats_t *stats)
 {
-    block_meta_data_t *block_meta_data = (block_meta_data_t *)((char *)app_data - sizeof(block_meta_data_t));
-    assert(block_meta_data->is_free == MM_FALSE);
-    mm_free_blocks(block_meta_data);
-}
\ No newline at end of file
+    mm_compaction_stats_t local_stats;
+    mm_thread_cache_bin_t *bin = NULL;
+    uint64_t *free_slots = NULL;
+    uint32_t numa_node;
+    int units = 0;
+    if (!vm_page_family)
+        return -1;
+    if (!vm_page_family->relocate)
+    {
+        printf("Error: %s() Family %s has no relocator\n", __FUNCTION__, vm_page_family->struct_name);
+        return -1;
+    }
+    if (!stats)
+        stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+    /* Objects cached by the calling thread are not in use, hand them back */
+    bin = mm_thread_cache_bin(vm_page_family);
+    if (bin && bin->count)
+        mm_thread_cache_drain(vm_page_family, bin, 0);
+    if (vm_page_family->slab_mode == MM_TRUE)
+    {
+        units = (int)(((vm_page_family->slab_slots_per_page + 63) / 64 * sizeof(uint64_t) + SYSTEM_PAGE_SIZE - 1) /
+                      SYSTEM_PAGE_SIZE);
+        free_slots = (uint64_t *)mm_get_new_vm_page_from_kernel(units);
+        if (!free_slots)
+            return -1;
+    }
+
+    pthread_mutex_lock(&vm_page_family->family_lock);
+    vm_page_family->compacting = MM_TRUE;
+    for (numa_node = 0; numa_node < vm_page_family->node_count; numa_node++)
+        mm_compaction_compact_node(vm_page_family, numa_node, max_occupancy, free_slots, stats);
+    vm_page_family->compacting = MM_FALSE;
+    stats->idle_bytes = mm_compaction_idle_bytes(vm_page_family, MM_TRUE);
+    pthread_mutex_unlock(&vm_page_family->family_lock);
+    if (free_slots)
+        mm_return_vm_page_to_kernel((void *)free_slots, units);
+
+    /* Emptied pages are parked in the reserves, unmap those above the low watermark */
+    pthread_mutex_lock(&span_reserve_lock);
+    for (numa_node = 0; numa_node < vm_page_family->node_count; numa_node++)
+    {
+        mm_span_reserve_t *reserve = mm_family_span_reserve(vm_page_family, numa_node);
+        mm_span_reserve_release(reserve, reserve->min_free_spans);
+    }
+    pthread_mutex_unlock(&span_reserve_lock);
+    return 0;
+}
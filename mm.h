@@ -5,11 +5,38 @@
 #include <stdio.h>
 #include <memory.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "gluethread/glthread.h"
+#include "uapi_mm.h"
 
 #define MM_MAX_STRUCT_NAME 32
 
-struct vm_page_family_;
+/* A family's pages are spans of 1, 2, 4 .. MM_MAX_SPAN_PAGES system
+ * pages, the smallest holding MM_SPAN_MIN_OBJECTS structs. Requests
+ * that do not fit a span are mapped on their own as large objects */
+#define MM_MAX_SPAN_PAGES 16
+#define MM_SPAN_MIN_OBJECTS 8
+
+/* Large objects span fewer system pages than this, so that their page
+ * count, padding and guard page included, fits an int */
+#define MM_MAX_OBJECT_PAGES ((uint64_t)INT32_MAX - 2 * MM_MAX_SPAN_PAGES)
+
+/* Empty spans are parked in a process wide reserve instead of being
+ * unmapped, and the reserve is refilled from the kernel a chunk of
+ * MM_SPAN_ALIGNMENT sized slots at a time. Once it holds max_free
+ * spans it is trimmed back down to min_free */
+#define MM_RESERVE_CHUNK_SPANS 16
+#define MM_RESERVE_MIN_FREE_SPANS 4
+#define MM_RESERVE_MAX_FREE_SPANS 64
+
+/* Huge page backed reserves map whole huge pages and carve them into
+ * span slots, a huge page goes back to the kernel only once all of its
+ * slots are parked again */
+#define MM_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/* Slots are MM_SPAN_ALIGNMENT aligned, so the low bit of a parked
+ * slot's address is free to record that its memory is known zero */
+#define MM_SPAN_ZEROED 0x1UL
 
 typedef enum
 {
@@ -17,72 +44,449 @@ typedef enum
     MM_TRUE
 } vm_bool_t;
 
+typedef struct mm_span_reserve_
+{
+    void **free_spans; /* Stack of empty span slots, out of band so that
+                        * released memory is never touched again */
+    uint32_t free_span_count;
+    uint32_t capacity;
+    uint32_t chunk_spans;
+    uint32_t min_free_spans;
+    uint32_t max_free_spans;
+    mm_huge_page_mode_t huge_mode;
+    vm_bool_t hugetlb_unavailable; /* MAP_HUGETLB failed, use THP instead */
+    uint32_t numa_node;            /* Node its memory is bound to */
+    struct mm_shm_heap_ *shm_heap; /* Set for the reserve of a shm heap */
+} mm_span_reserve_t;
+
+/* A shm heap is one MAP_SHARED mapping of a memfd or a file, cut into
+ * span slots. The first slot holds the header below, the others back the
+ * pages and large objects of the families bound to the heap. Blocks link
+ * to their neighbours by offset, but the page lists and free lists of a
+ * family hold pointers of the creating process, which alone allocates and
+ * frees. Other processes attach read-only anywhere and follow offsets,
+ * starting from the root object */
+#define MM_SHM_HEAP_MAGIC 0x70616568206d6d73ULL
+
+typedef struct mm_shm_heap_header_
+{
+    uint64_t magic;
+    uint64_t size;
+    uint64_t root_offset; /* Atomic, 0 while there is no root */
+} mm_shm_heap_header_t;
+
+typedef struct mm_shm_heap_
+{
+    mm_span_reserve_t reserve; /* Parked slots, of the creator only */
+    mm_shm_heap_header_t *header; /* At the start of the mapping */
+    uint64_t size;
+    uint64_t next_slot; /* Offset of the first slot never handed out */
+    int fd;
+    vm_bool_t read_only; /* Attached rather than created */
+} mm_shm_heap_t;
+
+/* NUMA nodes are known by their kernel ids, sparse ids simply leave
+ * holes without CPUs. Node counts above MM_MAX_NUMA_NODES are capped */
+#define MM_MAX_NUMA_NODES 64
+#define MM_NUMA_MAX_CPUS 1024
+
+typedef struct mm_numa_topology_
+{
+    uint32_t node_count;
+    vm_bool_t simulated; /* Nodes are only accounted, memory is not bound */
+    uint8_t cpu_to_node[MM_NUMA_MAX_CPUS];
+} mm_numa_topology_t;
+
+/* Batch allocation works through the request in chunks of this many
+ * objects per family lock acquisition */
+#define MM_BATCH_CHUNK 64
+
+/* Block pages a unit of their family fits in are on one of these
+ * partial lists, by the share of the page in use, the fullest on the
+ * highest. The other block pages are on the full list. Allocation
+ * drains the fullest pages first so that the others can empty out */
+#define MM_PAGE_OCCUPANCY_CLASSES 4
+#define MM_PAGE_FULL MM_PAGE_OCCUPANCY_CLASSES
+
+/* Within an occupancy class pages are binned by their largest free
+ * block, bin i holding pages whose largest block is [2^(i+4), 2^(i+5)),
+ * the last one anything larger. The free blocks of a page are binned
+ * by their size the same way */
+#define MM_PAGE_FREE_BINS 12
+
+struct vm_page_family_;
+
+/* Block headers are two words. The first packs the payload size, the
+ * free flag and the tail, the hard internal fragmentation bytes between
+ * the payload and the next header or the end of the page. The next
+ * block is found from the size and tail, the previous one from its
+ * distance. Free blocks keep their free list glue in their payload */
+#define MM_BLOCK_FREE 0x80000000u
+#define MM_BLOCK_TAIL_SHIFT 25
+#define MM_BLOCK_MAX_TAIL 63u
+#define MM_BLOCK_SIZE_MASK ((1u << MM_BLOCK_TAIL_SHIFT) - 1)
+
 typedef struct block_meta_data_
 {
-    vm_bool_t is_free;
-    uint32_t block_size;
-    glthread_t priority_thread_glue;
-    struct block_meta_data_ *prev_block;
-    struct block_meta_data_ *next_block;
-    uint32_t offset;
+    uint32_t size_and_flags;
+    uint32_t prev_offset; /* Bytes back to the previous header, 0 for the first block */
 } block_meta_data_t;
 
+/* Every block spans at least the free list glue so that it can be
+ * binned once freed, the tail pads smaller requests */
+#define MM_MIN_BLOCK_PAYLOAD ((uint32_t)sizeof(glthread_t))
+#define MM_MIN_FREE_BLOCK ((uint32_t)(sizeof(block_meta_data_t) + MM_MIN_BLOCK_PAYLOAD))
+#define MM_BLOCK_EXTENT(size) ((size) < MM_MIN_BLOCK_PAYLOAD ? MM_MIN_BLOCK_PAYLOAD : (size))
+
+#define MM_BLOCK_SIZE(block_meta_data_ptr) ((block_meta_data_ptr)->size_and_flags & MM_BLOCK_SIZE_MASK)
+#define MM_BLOCK_TAIL(block_meta_data_ptr) \
+    (((block_meta_data_ptr)->size_and_flags >> MM_BLOCK_TAIL_SHIFT) & MM_BLOCK_MAX_TAIL)
+#define MM_BLOCK_IS_FREE(block_meta_data_ptr) \
+    (((block_meta_data_ptr)->size_and_flags & MM_BLOCK_FREE) ? MM_TRUE : MM_FALSE)
+#define MM_BLOCK_GLUE(block_meta_data_ptr) ((glthread_t *)((block_meta_data_ptr) + 1))
+/* Where the next header starts, or the end of the page for the last block */
+#define MM_BLOCK_END(block_meta_data_ptr) \
+    ((char *)((block_meta_data_ptr) + 1) + MM_BLOCK_SIZE(block_meta_data_ptr) + MM_BLOCK_TAIL(block_meta_data_ptr))
+
+static inline void
+mm_block_init(block_meta_data_t *block_meta_data, vm_bool_t is_free,
+              uint32_t size, uint32_t tail)
+{
+    block_meta_data->size_and_flags = (is_free == MM_TRUE ? MM_BLOCK_FREE : 0) |
+                                      (tail << MM_BLOCK_TAIL_SHIFT) | size;
+}
+
+static inline void
+mm_block_set_size(block_meta_data_t *block_meta_data, uint32_t size)
+{
+    block_meta_data->size_and_flags = (block_meta_data->size_and_flags & ~MM_BLOCK_SIZE_MASK) | size;
+}
+
+static inline void
+mm_block_set_tail(block_meta_data_t *block_meta_data, uint32_t tail)
+{
+    block_meta_data->size_and_flags =
+        (block_meta_data->size_and_flags & ~(MM_BLOCK_MAX_TAIL << MM_BLOCK_TAIL_SHIFT)) |
+        (tail << MM_BLOCK_TAIL_SHIFT);
+}
+
+static inline void
+mm_block_set_free(block_meta_data_t *block_meta_data, vm_bool_t is_free)
+{
+    if (is_free == MM_TRUE)
+        block_meta_data->size_and_flags |= MM_BLOCK_FREE;
+    else
+        block_meta_data->size_and_flags &= ~MM_BLOCK_FREE;
+}
+
+static inline block_meta_data_t *
+glthread_to_block_meta_data(glthread_t *glthread_ptr)
+{
+    return (block_meta_data_t *)glthread_ptr - 1;
+}
+
+typedef enum
+{
+    MM_PAGE_BLOCKS, /* Variable sized blocks, each behind a block_meta_data_t */
+    MM_PAGE_SLAB,   /* Equal struct sized slots with no per object header */
+    MM_PAGE_LARGE,  /* A single object mapped directly from the kernel */
+    MM_PAGE_ARENA   /* Bump allocated objects of an arena, freed all at once */
+} vm_page_kind_t;
+
 typedef struct vm_page_
 {
     struct vm_page_ *next;
     struct vm_page_ *prev;
     struct vm_page_family_ *pg_family;
+    vm_page_kind_t page_kind;
+    uint32_t span_pages; /* System pages backing this vm page */
+    uint32_t dirty_limit; /* Bytes from the page start that may have been
+                           * written since the span was last all zero */
+    uint32_t sampled_objects; /* Live objects in the heap profile */
+    /* Slab pages only */
+    uint32_t slab_in_use;
+    uint32_t slab_carved; /* Slots handed out at least once */
+    uint32_t numa_node;   /* Node whose pool the page belongs to */
+    void *slab_free_head; /* Intrusive stack of freed slots */
+    /* Block pages only */
+    /* Free blocks of the page by size bin, unordered within a bin. Bit i
+     * of free_bin_bitmap set iff free_blocks[i] is non-empty */
+    glthread_t free_blocks[MM_PAGE_FREE_BINS];
+    uint32_t free_bin_bitmap;
+    uint32_t free_bytes;       /* Their payload */
+    uint32_t largest_free;     /* Payload of the largest of them */
+    uint32_t occupancy_class;  /* Of the list partial_glue is on */
+    uint32_t free_bin;
+    glthread_t partial_glue; /* On a partial or full list of the page's node */
+    uint64_t large_object_size; /* Bytes requested, large pages only */
     block_meta_data_t block_meta_data;
     char page_memory[0];
 } vm_page_t;
 
+/* The part of a family that lives on one NUMA node: the partial and
+ * full lists of the family's pages on that node, and their
+ * usage counters. Pages and the objects on them always belong to the
+ * pool of the page's node, whichever thread frees them */
+typedef struct mm_family_node_
+{
+    /* Bit i of partial_bin_bitmap[c] set iff partial_pages[c][i] is non-empty */
+    uint32_t partial_bin_bitmap[MM_PAGE_OCCUPANCY_CLASSES];
+    glthread_t partial_pages[MM_PAGE_OCCUPANCY_CLASSES][MM_PAGE_FREE_BINS];
+    glthread_t full_pages;
+    glthread_t slab_partial_pages; /* Slab pages with at least one free slot */
+    uint32_t slab_page_count;
+    uint32_t large_object_count;
+    uint64_t large_object_pages;
+    /* Usage counters, kept up to date under family_lock by the
+     * allocation and free paths so that reading them needs no walk */
+    uint32_t block_page_count;
+    uint64_t slab_object_count;
+    uint64_t objects_in_use; /* Blocks, slab slots and large objects */
+    uint64_t bytes_in_use;   /* Bytes requested by the objects in use */
+    uint64_t free_block_count;
+    uint64_t free_block_bytes; /* Payload of the blocks in the free lists */
+    uint32_t largest_free;       /* Largest free block a unit fits in */
+    uint32_t largest_free_pages; /* Pages whose largest free block is that */
+} mm_family_node_t;
+
 typedef struct vm_page_family_
 {
     char struct_name[MM_MAX_STRUCT_NAME];
     uint32_t struct_size;
+    uint32_t name_hash;
+    uint32_t family_id;          /* Dense index in registration order */
+    uint32_t span_pages;         /* System pages per vm page of this family */
+    mm_huge_page_mode_t huge_mode; /* Picks the span reserve of each node */
+    pthread_mutex_t family_lock; /* Guards the page list and the node pools */
     vm_page_t *first_page;
-    glthread_t free_block_priority_list_head;
+    /* Slab mode serves single units from slab pages, larger
+     * requests still go to the regular block pages above */
+    vm_bool_t slab_mode;
+    uint32_t slab_slot_size;
+    uint32_t slab_slots_per_page;
+    uint32_t slab_first_slot;  /* Page offset of slot 0 */
+    uint32_t alignment;        /* Of every payload, 1 leaves it to the sizes */
+    uint32_t node_count;
+    mm_family_node_t *nodes; /* One pool per NUMA node */
+    mm_relocate_fn_t relocate;
+    void *relocate_arg;
+    vm_bool_t compacting; /* Allocations may only use existing local pages */
+    /* Shared size classes. A member family allocates single units from
+     * the slab pages of its size class, whose slots carry the family id
+     * of their owner. The member counts those objects on its own */
+    struct vm_page_family_ *size_class;
+    vm_bool_t is_size_class;
+    uint64_t shared_objects; /* Atomic */
+    uint64_t shared_bytes;   /* Atomic */
+    mm_shm_heap_t *shm_heap; /* Backs all of its spans when set */
 } vm_page_family_t;
 
-typedef struct vm_page_for_family_
+/* Aligned payloads are placed by moving the block header forward inside
+ * a free block. Gaps in front of the header that are too small for a
+ * free block of their own go to the tail of the previous block, or are
+ * grown by the alignment until they are not, so a free block this much
+ * larger always fits */
+#define MM_ALIGN_UP(value, alignment) (((value) + (alignment) - 1) & ~((__typeof__(value))(alignment) - 1))
+#define MM_ALIGNED_REQUEST_SIZE(size, alignment) \
+    ((uint64_t)MM_BLOCK_EXTENT(size) + 2 * (uint64_t)(alignment) + MM_MIN_FREE_BLOCK)
+
+/* Slot sizes of the shared size classes, about four per doubling */
+#define MM_SIZE_CLASS_SIZES 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, \
+                            320, 384, 448, 512, 640, 768, 896, 1024
+#define MM_SIZE_CLASS_MAX 1024
+
+/* Size class slab pages keep a 16 bit owner family id per slot ahead of
+ * slot 0, MM_MAX_FAMILIES ids fit */
+#define MM_SLAB_OWNER_TAGS(vm_page_ptr) ((uint16_t *)(vm_page_ptr)->page_memory)
+
+#define MM_PAGE_NODE_POOL(vm_page_ptr) (&(vm_page_ptr)->pg_family->nodes[(vm_page_ptr)->numa_node])
+
+/* Registered families sit in one array whose address range is reserved
+ * for MM_MAX_FAMILIES up front and backed as it is touched, so it grows
+ * without moving a family a handle points to */
+#define MM_MAX_FAMILIES 65536
+
+typedef struct mm_family_registry_
 {
-    struct vm_page_for_family_ *next;
-    vm_page_family_t vm_page_family[0];
-} vm_page_for_family_t;
+    vm_page_family_t *families;
+    uint32_t count;
+} mm_family_registry_t;
 
-GLTHREAD_TO_STRUCT(glthread_to_block_meta_data, block_meta_data_t, priority_thread_glue, glthread_ptr);
+/* Open addressed index over the registered page families, keyed
+ * by struct name, so that lookups do not walk the family pages */
+typedef struct mm_family_hash_table_
+{
+    uint32_t capacity; /* Always a power of two */
+    uint32_t count;
+    vm_page_family_t **buckets;
+} mm_family_hash_table_t;
 
-#define MAX_FAMILIES_PER_VM_PAGE \
-    (SYSTEM_PAGE_SIZE - sizeof(vm_page_for_family_t *)) / sizeof(vm_page_family_t)
+#define MM_FAMILY_HASH_MIN_CAPACITY 64
 
-#define ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_family_ptr, curr)                   \
-    {                                                                               \
-        uint32_t count = 0;                                                         \
-        for (curr = (vm_page_family_t *)&vm_page_for_family_ptr->vm_page_family[0]; \
-             curr->struct_size && count <= MAX_FAMILIES_PER_VM_PAGE;                \
-             curr++, count++)                                                       \
-        {
+/* An arena bump allocates header-less objects from spans of its own
+ * and gives them all back at once. It lives at the start of its first
+ * span and is not thread safe. Requests larger than a span are mapped
+ * on their own and chained on large_pages */
+#define MM_ARENA_ALIGNMENT sizeof(void *)
+#define MM_ARENA_ROUND_UP(size) (((size) + MM_ARENA_ALIGNMENT - 1) & ~(uint64_t)(MM_ARENA_ALIGNMENT - 1))
+
+typedef struct mm_arena_
+{
+    mm_span_reserve_t *span_reserve; /* Of the node it was created on */
+    vm_page_t *first_page; /* Spans in the order they were added */
+    vm_page_t *current_page;
+    char *bump;
+    char *limit;
+    vm_page_t *large_pages;
+} mm_arena_t;
+
+/* A page compaction may empty, with what is in use on it */
+typedef struct mm_compaction_candidate_
+{
+    vm_page_t *vm_page;
+    uint64_t objects;
+    uint64_t bytes_in_use;
+    uint32_t occupancy; /* Per mille of the page's capacity */
+} mm_compaction_candidate_t;
+
+/* Heap profiler. Live samples are kept in an open addressed table
+ * keyed by app_data, every sample and the free of a sampled object
+ * is also pushed to a bounded lock free ring for tracing */
+#define MM_PROFILE_TABLE_SIZE 8192 /* Power of two */
+#define MM_PROFILE_RING_SIZE 1024  /* Power of two */
+
+typedef struct mm_profile_ring_slot_
+{
+    uint64_t sequence;
+    mm_profile_event_t event;
+} mm_profile_ring_slot_t;
+
+typedef struct mm_profile_
+{
+    uint64_t sample_interval; /* Mean bytes between samples, 0 when off */
+    uint64_t last_sample_interval; /* Kept after stop for the dump header */
+    pthread_mutex_t lock;     /* Guards the live table */
+    mm_profile_event_t *live_samples;
+    uint32_t live_count;
+    uint64_t dropped_samples;
+    mm_profile_ring_slot_t *ring;
+    uint64_t ring_head;
+    uint64_t ring_tail;
+} mm_profile_t;
+
+#define MM_PROFILE_ENABLED() \
+    __builtin_expect(__atomic_load_n(&heap_profile.sample_interval, __ATOMIC_RELAXED) != 0, 0)
+
+/* Per thread cache of single unit objects, two stacks per family.
+ * Cached objects stay allocated as far as the family is concerned
+ * and are linked through the first word of their payload. Objects
+ * that were all zero when they entered the cache, apart from that
+ * link, are kept apart so that xcalloc can skip clearing them. The bins
+ * of the first MM_THREAD_CACHE_FAMILIES families are inline, those of
+ * later families come in blocks of as many, mapped the first time the
+ * thread touches a family of the block */
+#define MM_THREAD_CACHE_FAMILIES 256
+#define MM_THREAD_CACHE_BLOCKS (MM_MAX_FAMILIES / MM_THREAD_CACHE_FAMILIES)
+#define MM_THREAD_CACHE_DEPTH 64
+#define MM_THREAD_CACHE_BATCH 16
+
+typedef struct mm_thread_cache_bin_
+{
+    void *head;
+    void *zeroed_head;
+    uint32_t count;
+    vm_bool_t allocates; /* The thread has allocated from the bin */
+} mm_thread_cache_bin_t;
+
+/* Debug mode, see mm_set_debug(). A canary is a word right after the
+ * payload derived from the object's address, flipped once the object
+ * is freed. Freed objects sit in a per thread quarantine ring before
+ * they are released, the oldest one going first, with up to
+ * MM_DEBUG_POISON_MAX_BYTES of their payload poisoned. Stale writes
+ * mostly hit the first fields, poisoning large payloads whole would
+ * cost more than the rest of the debug checks together */
+#define MM_DEBUG_CANARY_BYTES ((uint32_t)sizeof(uint64_t))
+#define MM_DEBUG_CANARY_FREED 0xf4eef4eef4eef4eeull
+#define MM_DEBUG_POISON 0xdf
+#define MM_DEBUG_POISON_WORD 0xdfdfdfdfdfdfdfdfull
+#define MM_DEBUG_POISON_MAX_BYTES 1024
+#define MM_DEBUG_QUARANTINE_DEPTH 256
+
+#define MM_DEBUG_ENABLED() __builtin_expect(debug_flags != 0, 0)
+
+typedef struct mm_debug_quarantine_
+{
+    void *objects[MM_DEBUG_QUARANTINE_DEPTH];
+    uint32_t head; /* Oldest object */
+    uint32_t count;
+} mm_debug_quarantine_t;
+
+typedef struct mm_thread_cache_
+{
+    mm_thread_cache_bin_t bins[MM_THREAD_CACHE_FAMILIES];
+    mm_thread_cache_bin_t *bin_blocks[MM_THREAD_CACHE_BLOCKS]; /* Block 0 is bins */
+    mm_debug_quarantine_t quarantine;
+} mm_thread_cache_t;
 
-#define ITERATE_PAGE_FAMILIES_END(vm_page_for_family_ptr, curr) \
-    }                                                           \
+#define MM_THREAD_CACHE_NEXT(app_data) (*(void **)(app_data))
+#define MM_THREAD_CACHE_BLOCK_PAGES \
+    ((int)((MM_THREAD_CACHE_FAMILIES * sizeof(mm_thread_cache_bin_t) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE))
+
+GLTHREAD_TO_STRUCT(glthread_to_partial_page, vm_page_t, partial_glue, glthread_ptr);
+
+#define ITERATE_PAGE_FAMILIES_BEGIN(registry_ptr, curr)                    \
+    {                                                                      \
+        uint32_t _family_index = 0;                                        \
+        for (; _family_index < (registry_ptr)->count; _family_index++)     \
+        {                                                                  \
+            curr = &(registry_ptr)->families[_family_index];
+
+#define ITERATE_PAGE_FAMILIES_END(registry_ptr, curr) \
+    }                                                 \
     }
 
 vm_page_family_t *
 lookup_page_family_by_name(char *struct_name);
 
 #define offset_of(container_structure, field_name) (char *)(&((container_structure *)0)->field_name)
-#define MM_GET_PAGE_FROM_META_BLOCK(block_meta_data_ptr) (void *)((char *)block_meta_data_ptr - block_meta_data_ptr->offset)
-#define NEXT_META_BLOCK(block_meta_data_ptr) (block_meta_data_ptr->next_block)
-#define NEXT_META_BLOCK_BY_SIZE(block_meta_data_ptr) (block_meta_data_t *)((char *)(block_meta_data_ptr + 1) + block_meta_data_ptr->block_size)
-#define PREV_META_BLOCK(block_meta_data_ptr) (block_meta_data_ptr->prev_block)
-
-#define mm_bind_blocks_for_allocation(allocated_meta_block, free_meta_block)      \
-    {                                                                             \
-        NEXT_META_BLOCK(free_meta_block) = NEXT_META_BLOCK(allocated_meta_block); \
-        PREV_META_BLOCK(free_meta_block) = allocated_meta_block;                  \
-        NEXT_META_BLOCK(allocated_meta_block) = free_meta_block;                  \
-        if (NEXT_META_BLOCK(free_meta_block))                                     \
-            PREV_META_BLOCK(NEXT_META_BLOCK(free_meta_block)) = free_meta_block;  \
+/* Every vm_page_t starts on a boundary aligned to the largest span
+ * size, so the owning page of any address inside it, header or
+ * payload, is found by masking rather than by an offset stored in
+ * each block. Large objects keep their payload start within that
+ * distance of the header, which is all masking needs */
+#define MM_SPAN_ALIGNMENT ((uintptr_t)SYSTEM_PAGE_SIZE * MM_MAX_SPAN_PAGES)
+#define MM_GET_PAGE_FROM_APP_DATA(app_data) \
+    ((vm_page_t *)((uintptr_t)(app_data) & ~(MM_SPAN_ALIGNMENT - 1)))
+#define MM_GET_PAGE_FROM_META_BLOCK(block_meta_data_ptr) MM_GET_PAGE_FROM_APP_DATA(block_meta_data_ptr)
+#define NEXT_META_BLOCK(block_meta_data_ptr)                                    \
+    (MM_BLOCK_END(block_meta_data_ptr) <                                        \
+             (char *)MM_GET_PAGE_FROM_META_BLOCK(block_meta_data_ptr) +         \
+                 MM_GET_PAGE_FROM_META_BLOCK(block_meta_data_ptr)->span_pages * \
+                     SYSTEM_PAGE_SIZE                                           \
+         ? (block_meta_data_t *)MM_BLOCK_END(block_meta_data_ptr)               \
+         : NULL)
+#define NEXT_META_BLOCK_BY_SIZE(block_meta_data_ptr) \
+    (block_meta_data_t *)((char *)((block_meta_data_ptr) + 1) + MM_BLOCK_SIZE(block_meta_data_ptr))
+#define PREV_META_BLOCK(block_meta_data_ptr)                                                    \
+    ((block_meta_data_ptr)->prev_offset                                                         \
+         ? (block_meta_data_t *)((char *)(block_meta_data_ptr) - (block_meta_data_ptr)->prev_offset) \
+         : NULL)
+
+/* Points the block after block_meta_data_ptr, if any, back at it */
+#define MM_LINK_NEXT_META_BLOCK(block_meta_data_ptr)                             \
+    {                                                                            \
+        block_meta_data_t *_next_block = NEXT_META_BLOCK(block_meta_data_ptr); \
+        if (_next_block)                                                         \
+            _next_block->prev_offset =                                           \
+                (uint32_t)((char *)_next_block - (char *)(block_meta_data_ptr)); \
+    }
+
+/* The allocated block must already end where free_meta_block starts */
+#define mm_bind_blocks_for_allocation(allocated_meta_block, free_meta_block)        \
+    {                                                                               \
+        (free_meta_block)->prev_offset =                                            \
+            (uint32_t)((char *)(free_meta_block) - (char *)(allocated_meta_block)); \
+        MM_LINK_NEXT_META_BLOCK(free_meta_block);                                   \
     }
 
 #endif
@@ -90,10 +494,9 @@ lookup_page_family_by_name(char *struct_name);
 vm_bool_t
 mm_is_vm_page_empty(vm_page_t *vm_page);
 
-#define MARK_VM_PAGE_EMPTY(vm_page_t_ptr)             \
-    vm_page_t_ptr->block_meta_data.is_free = MM_TRUE; \
-    vm_page_t_ptr->block_meta_data.next_block = NULL; \
-    vm_page_t_ptr->block_meta_data.prev_block = NULL;
+#define MARK_VM_PAGE_EMPTY(vm_page_t_ptr)                         \
+    vm_page_t_ptr->block_meta_data.size_and_flags = MM_BLOCK_FREE; \
+    vm_page_t_ptr->block_meta_data.prev_offset = 0;
 
 #define ITERATE_VM_PAGE_BEGIN(vm_page_family_ptr, curr)                                \
     {                                                                                  \
@@ -114,14 +517,76 @@ mm_is_vm_page_empty(vm_page_t *vm_page);
     }
 
 vm_page_t *
-allocate_vm_page(vm_page_family_t *vm_page_family);
+allocate_vm_page(vm_page_family_t *vm_page_family, uint32_t numa_node);
 void mm_vm_page_delete_and_free(vm_page_t *vm_page);
 
+static inline uint32_t
+mm_page_free_bin_index(uint32_t block_size)
+{
+    uint32_t bin = block_size < 16 ? 0 : 27 - __builtin_clz(block_size);
+    return bin < MM_PAGE_FREE_BINS ? bin : MM_PAGE_FREE_BINS - 1;
+}
+
+/* Only the highest non-empty bin of the page needs a look */
+static inline block_meta_data_t *
+mm_get_largest_free_block_of_page(vm_page_t *vm_page)
+{
+    glthread_t *list = NULL, *curr = NULL;
+    block_meta_data_t *block_meta_data = NULL, *largest = NULL;
+    if (!vm_page->free_bin_bitmap)
+        return NULL;
+    list = &vm_page->free_blocks[31 - __builtin_clz(vm_page->free_bin_bitmap)];
+    ITERATE_GLTHREAD_BEGIN(list, curr)
+    {
+        block_meta_data = glthread_to_block_meta_data(curr);
+        if (!largest || MM_BLOCK_SIZE(largest) < MM_BLOCK_SIZE(block_meta_data))
+            largest = block_meta_data;
+    }
+    ITERATE_GLTHREAD_END(list, curr);
+    return largest;
+}
+
+/* The largest block is on a page of the highest non-empty bin of some
+ * class, or on a full page if there is none */
+static inline block_meta_data_t *
+mm_get_largest_free_block_of_node(mm_family_node_t *node_pool)
+{
+    uint32_t occupancy_class, bin, bins = 0;
+    glthread_t *curr = NULL;
+    vm_page_t *largest_page = NULL;
+    for (occupancy_class = 0; occupancy_class < MM_PAGE_OCCUPANCY_CLASSES; occupancy_class++)
+        bins |= node_pool->partial_bin_bitmap[occupancy_class];
+    for (occupancy_class = 0; occupancy_class <= MM_PAGE_FULL; occupancy_class++)
+    {
+        glthread_t *list = &node_pool->full_pages;
+        if (occupancy_class < MM_PAGE_FULL)
+        {
+            bin = 31 - __builtin_clz(bins | 1);
+            list = &node_pool->partial_pages[occupancy_class][bin];
+        }
+        else if (bins)
+            break;
+        ITERATE_GLTHREAD_BEGIN(list, curr)
+        {
+            vm_page_t *vm_page = glthread_to_partial_page(curr);
+            if (!largest_page || largest_page->largest_free < vm_page->largest_free)
+                largest_page = vm_page;
+        }
+        ITERATE_GLTHREAD_END(list, curr);
+    }
+    return largest_page && largest_page->largest_free ? mm_get_largest_free_block_of_page(largest_page) : NULL;
+}
+
 static inline block_meta_data_t *
 mm_get_largest_free_block_page_family(vm_page_family_t *page_family)
 {
-    glthread_t *first_free_block_glue = page_family->free_block_priority_list_head.right;
-    if (first_free_block_glue)
-        return glthread_to_block_meta_data(first_free_block_glue);
-    return NULL;
-}
\ No newline at end of file
+    uint32_t node;
+    block_meta_data_t *block_meta_data = NULL, *largest = NULL;
+    for (node = 0; node < page_family->node_count; node++)
+    {
+        block_meta_data = mm_get_largest_free_block_of_node(&page_family->nodes[node]);
+        if (block_meta_data && (!largest || MM_BLOCK_SIZE(largest) < MM_BLOCK_SIZE(block_meta_data)))
+            largest = block_meta_data;
+    }
+    return largest;
+}
@@ -4,24 +4,420 @@
 #include <stdint.h>
 #include <memory.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Opaque handle to a registered page family. Resolving it once and
+ * allocating through it keeps the struct name off the hot path */
+typedef struct vm_page_family_ *mm_family_handle_t;
+
 void mm_init();
 
 void *
 xcalloc(char *struct_name, int units);
 
+void *
+xcalloc_by_handle(mm_family_handle_t family, int units);
+
+/* Like xcalloc but the memory is not cleared */
+void *
+xmalloc(char *struct_name, int units);
+
+void *
+xmalloc_by_handle(mm_family_handle_t family, int units);
+
+/* Single units are cached by the freeing thread for its own next
+ * allocations. A thread that never allocates from their family hands
+ * them back to the family in small batches */
 void xfree(void *app_data);
 
-void mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+/* Resizes an object to units of its family. Grows into a free neighbour
+ * and shrinks in place where it can, otherwise the object moves and is
+ * then only aligned like its family. Added units are zeroed. Returns the
+ * object, or NULL if it could not be resized, leaving it untouched.
+ * Unlike realloc(), the family is known only from the object, so a NULL
+ * object or a unit count below 1 is an error and returns NULL */
+void *
+xrealloc(void *app_data, int units);
+
+/* Allocate n zeroed single units of a family into out, returns how many
+ * were allocated. The family is resolved once for the whole batch */
+int xcalloc_batch(char *struct_name, int n, void **out);
+
+int xcalloc_batch_by_handle(mm_family_handle_t family, int n, void **out);
+
+/* Free n objects of any families. The contents of ptrs are consumed */
+void xfree_batch(void **ptrs, int n);
+
+mm_family_handle_t
+mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+
+mm_family_handle_t
+mm_get_family_handle(char *struct_name);
 
 #define MM_REG_STRUCT(struct_name) ( \
     mm_instantiate_new_page_family(#struct_name, sizeof(struct_name)))
 
-#define XCALLOC(units, struct_name) ( \
-    xcalloc(#struct_name, units))
+/* One entry of a static table of families registered in one call */
+typedef struct mm_family_spec_
+{
+    const char *struct_name;
+    uint32_t struct_size;
+} mm_family_spec_t;
+
+#define MM_FAMILY_SPEC(struct_name) {#struct_name, sizeof(struct_name)}
+
+/* Register count families under a single registry lock, returns how
+ * many were registered. handles, when not NULL, receives the handle of
+ * every entry, NULL for a duplicate name */
+uint32_t
+mm_instantiate_page_families(const mm_family_spec_t *specs, uint32_t count, mm_family_handle_t *handles);
+
+/* Serve single unit allocations of the family from header-less slab
+ * pages. Must be enabled before the family allocates anything */
+mm_family_handle_t
+mm_page_family_enable_slab(mm_family_handle_t family);
+
+#define MM_REG_STRUCT_SLAB(struct_name) ( \
+    mm_page_family_enable_slab(MM_REG_STRUCT(struct_name)))
+
+/* Align every object of the family to alignment, a power of two no
+ * larger than the system page size. Without it objects are only as
+ * aligned as the struct size makes them. Must be set before the family
+ * allocates anything */
+mm_family_handle_t
+mm_page_family_set_alignment(mm_family_handle_t family, uint32_t alignment);
+
+#define MM_REG_STRUCT_ALIGNED(struct_name, alignment) ( \
+    mm_page_family_set_alignment(MM_REG_STRUCT(struct_name), alignment))
+
+/* Serve single units of the family from slab pages shared by all the
+ * shared families whose struct size rounds up to the same size class,
+ * at most 1024 bytes and pointer aligned. Arrays keep using the family's
+ * own pages. Its stats still count all of its objects, the shared pages
+ * are reported by the size class family. Must be set before the family
+ * allocates anything */
+mm_family_handle_t
+mm_page_family_share_size_class(mm_family_handle_t family);
+
+#define MM_REG_STRUCT_SHARED(struct_name) ( \
+    mm_page_family_share_size_class(MM_REG_STRUCT(struct_name)))
+
+/* Makes families registered afterwards shared whenever they can be */
+void mm_set_size_class_sharing(int enable);
+
+/* The family owning the shared pages of a shared family, for its stats,
+ * relocator and compaction. NULL for a family that is not shared */
+mm_family_handle_t
+mm_page_family_size_class(mm_family_handle_t family);
+
+/* Like xcalloc, for objects that need more alignment than their family */
+void *
+xcalloc_aligned(char *struct_name, int units, uint32_t alignment);
+
+void *
+xcalloc_aligned_by_handle(mm_family_handle_t family, int units, uint32_t alignment);
+
+/* Each call site caches the family handle on first use */
+#define MM_FAMILY_HANDLE(struct_name) ({                                     \
+    static mm_family_handle_t _mm_family_handle = NULL;                      \
+    mm_family_handle_t _mm_handle =                                          \
+        __atomic_load_n(&_mm_family_handle, __ATOMIC_ACQUIRE);               \
+    if (!_mm_handle)                                                         \
+    {                                                                        \
+        _mm_handle = mm_get_family_handle(#struct_name);                     \
+        __atomic_store_n(&_mm_family_handle, _mm_handle, __ATOMIC_RELEASE);  \
+    }                                                                        \
+    _mm_handle;                                                              \
+})
+
+#define XCALLOC(units, struct_name) ({                                       \
+    mm_family_handle_t _mm_xcalloc_handle = MM_FAMILY_HANDLE(struct_name);   \
+    _mm_xcalloc_handle ? xcalloc_by_handle(_mm_xcalloc_handle, units)        \
+                       : xcalloc(#struct_name, units);                       \
+})
+
+#define XMALLOC(units, struct_name) ({                                       \
+    mm_family_handle_t _mm_xmalloc_handle = MM_FAMILY_HANDLE(struct_name);   \
+    _mm_xmalloc_handle ? xmalloc_by_handle(_mm_xmalloc_handle, units)        \
+                       : xmalloc(#struct_name, units);                       \
+})
+
+#define XCALLOC_ALIGNED(units, struct_name, alignment) ({                                \
+    mm_family_handle_t _mm_aligned_handle = MM_FAMILY_HANDLE(struct_name);               \
+    _mm_aligned_handle ? xcalloc_aligned_by_handle(_mm_aligned_handle, units, alignment) \
+                       : xcalloc_aligned(#struct_name, units, alignment);                \
+})
+
+#define XCALLOC_BATCH(n, struct_name, out) ({                               \
+    mm_family_handle_t _mm_batch_handle = MM_FAMILY_HANDLE(struct_name);     \
+    _mm_batch_handle ? xcalloc_batch_by_handle(_mm_batch_handle, n, out)     \
+                     : xcalloc_batch(#struct_name, n, out);                  \
+})
 
 #define XFREE(app_data) ( \
     xfree(app_data))
 
+#define XREALLOC(app_data, units) ( \
+    xrealloc(app_data, units))
+
+#define XFREE_BATCH(ptrs, n) ( \
+    xfree_batch(ptrs, n))
+
+/* Arenas hand out zeroed objects of any registered family from
+ * private spans and release them all together on reset or destroy.
+ * XFREE of an arena object is a no-op. An arena must not be shared
+ * between threads without external locking */
+typedef struct mm_arena_ *mm_arena_handle_t;
+
+mm_arena_handle_t
+mm_arena_create();
+
+void *
+xcalloc_in_by_handle(mm_arena_handle_t arena, mm_family_handle_t family, int units);
+
+void *
+xcalloc_in(mm_arena_handle_t arena, char *struct_name, int units);
+
+/* Frees every object of the arena, its spans are kept for reuse */
+void mm_arena_reset(mm_arena_handle_t arena);
+
+void mm_arena_destroy(mm_arena_handle_t arena);
+
+#define XCALLOC_IN(arena, units, struct_name) ({                             \
+    mm_family_handle_t _mm_arena_handle = MM_FAMILY_HANDLE(struct_name);     \
+    _mm_arena_handle ? xcalloc_in_by_handle(arena, _mm_arena_handle, units)  \
+                     : xcalloc_in(arena, #struct_name, units);               \
+})
+
+/* Shm heaps let processes share objects without copying them. A heap is
+ * a fixed size MAP_SHARED mapping of a memfd, or of the file at path,
+ * which is created or truncated. Families bound to it allocate all their
+ * objects there, only in the creating process. Other processes attach the
+ * heap's file read-only at any address and reach objects through offsets
+ * from the heap start, starting from the root object. Objects meant to be
+ * read elsewhere must refer to each other by offset too */
+typedef struct mm_shm_heap_ *mm_shm_heap_handle_t;
+
+mm_shm_heap_handle_t
+mm_shm_heap_create(const char *path, uint64_t size);
+
+/* The heap's file, to hand to other processes */
+int mm_shm_heap_fd(mm_shm_heap_handle_t heap);
+
+/* Maps the heap in the file fd read-only, fd stays the caller's */
+mm_shm_heap_handle_t
+mm_shm_heap_attach(int fd);
+
+/* Unmaps an attached heap, returns 0 on success, -1 otherwise */
+int mm_shm_heap_detach(mm_shm_heap_handle_t heap);
+
+/* Unmaps a created heap and closes its file, processes that attached
+ * it keep their mapping. The families bound to it must have no objects
+ * left, they go back to private memory. Returns 0 on success, -1
+ * otherwise */
+int mm_shm_heap_destroy(mm_shm_heap_handle_t heap);
+
+/* Offset of an object in the heap, 0 for NULL or memory outside it */
+uint64_t
+mm_shm_heap_offset(mm_shm_heap_handle_t heap, const void *app_data);
+
+/* The object at offset in this process's mapping, NULL for 0 */
+void *
+mm_shm_heap_pointer(mm_shm_heap_handle_t heap, uint64_t offset);
+
+/* Publishes the heap's root object, or none for NULL. Whatever was
+ * written to the heap before is visible to a reader that then loads the
+ * root. Returns 0 on success, -1 for an attached heap or an object
+ * outside the heap */
+int mm_shm_heap_set_root(mm_shm_heap_handle_t heap, void *app_data);
+
+void *
+mm_shm_heap_root(mm_shm_heap_handle_t heap);
+
+/* Allocate every object of the family from the heap. The family stops
+ * sharing a size class and uses no huge pages. Must be set before the
+ * family allocates anything */
+mm_family_handle_t
+mm_page_family_set_shm_heap(mm_family_handle_t family, mm_shm_heap_handle_t heap);
+
+#define MM_REG_STRUCT_IN_SHM_HEAP(struct_name, heap) ( \
+    mm_page_family_set_shm_heap(MM_REG_STRUCT(struct_name), heap))
+
+/* Back spans with 2 MiB huge pages, carved into logical vm pages.
+ * Explicit huge pages come from the hugetlb pool and fall back to
+ * transparent ones, which fall back to ordinary pages */
+typedef enum
+{
+    MM_HUGE_PAGES_NONE,
+    MM_HUGE_PAGES_TRANSPARENT,
+    MM_HUGE_PAGES_EXPLICIT,
+    MM_HUGE_PAGE_MODES
+} mm_huge_page_mode_t;
+
+/* Default for families registered and arenas created afterwards */
+void mm_set_huge_pages(mm_huge_page_mode_t mode);
+
+/* Must be set before the family allocates anything */
+mm_family_handle_t
+mm_page_family_set_huge_pages(mm_family_handle_t family, mm_huge_page_mode_t mode);
+
+/* NUMA. Families keep a page pool per node and serve each thread from
+ * its own node's pool, memory of another node is used only when the
+ * local node is out of memory. Objects always go back to the pool of
+ * the node they came from. The topology is read from sysfs by mm_init() */
+uint32_t mm_numa_node_count();
+
+/* Pretends the machine has node_count nodes, CPU i belonging to node
+ * i % node_count. Memory is accounted per node but not bound. Must be
+ * called after mm_init() and before any family is registered, returns
+ * 0 on success, -1 otherwise */
+int mm_numa_simulate(uint32_t node_count);
+
+/* Makes the calling thread allocate from the given node instead of the
+ * node of the CPU it runs on, -1 undoes it. Returns 0, or -1 for an
+ * invalid node */
+int mm_numa_set_thread_node(int numa_node);
+
+/* Empty pages are kept in a reserve of between min_free_spans and
+ * max_free_spans spans, and fetched from the kernel chunk_spans spans
+ * at a time */
+void mm_set_page_reserve(uint32_t chunk_spans, uint32_t min_free_spans, uint32_t max_free_spans);
+
+void mm_trim_page_reserve();
+
+/* Usage of one page family. Objects sitting in a thread cache count
+ * as in use, the family handed them out and has not had them back */
+typedef struct mm_family_stats_
+{
+    const char *struct_name;
+    uint32_t struct_size;
+    uint64_t pages_in_use;       /* System pages backing the family's spans */
+    uint64_t bytes_reserved;     /* Bytes of those pages */
+    uint64_t objects_allocated;  /* Blocks, slab slots and large objects */
+    uint64_t bytes_requested;    /* Bytes asked for by those objects */
+    uint64_t free_blocks;        /* Free blocks and free slab slots */
+    uint64_t bytes_free;
+    uint64_t largest_free_block; /* Largest free block or slot a unit fits in */
+    uint64_t internal_frag_bytes; /* Reserved bytes neither requested nor free:
+                                   * headers, hard IF gaps and slot padding */
+    double external_frag;         /* Share of free bytes outside the largest
+                                   * free block, 0 when nothing is free */
+} mm_family_stats_t;
+
+/* Returns 0 on success, -1 if the family is NULL */
+int mm_get_family_stats(mm_family_handle_t family, mm_family_stats_t *stats);
+
+/* Fills stats for up to max_families registered families and returns
+ * how many were filled */
+uint32_t mm_get_memory_stats(mm_family_stats_t *stats, uint32_t max_families);
+
+/* Usage of the family's pool on one NUMA node, returns 0 on success,
+ * -1 if the family is NULL or has no such node */
+int mm_get_family_node_stats(mm_family_handle_t family, uint32_t numa_node, mm_family_stats_t *stats);
+
+/* Compaction moves the live objects of sparsely used pages into the
+ * family's other pages on the same node, so the emptied pages can go
+ * back to the kernel. After an object is copied, the family's relocator
+ * is called with the family lock held. It returns 0 once every reference
+ * to old_app_data points to new_app_data, anything else keeps the object
+ * where it is. Objects it does not know, such as ones parked in another
+ * thread's cache, must be refused. The new copy is only aligned like the
+ * family's objects. The relocator must not allocate or free objects of
+ * the family */
+typedef int (*mm_relocate_fn_t)(void *old_app_data, void *new_app_data, void *arg);
+
+mm_family_handle_t
+mm_page_family_set_relocator(mm_family_handle_t family, mm_relocate_fn_t relocate, void *arg);
+
+typedef struct mm_compaction_stats_
+{
+    uint64_t sparse_pages;   /* Block and slab pages at most max_occupancy percent in use */
+    uint64_t sparse_objects; /* Objects living on those pages */
+    uint64_t sparse_bytes;   /* Bytes requested by those objects */
+    uint64_t idle_bytes;     /* Free whole system pages the kernel can take
+                              * back without moving anything */
+    uint64_t objects_moved;
+    uint64_t pages_released; /* Pages emptied by moving their objects */
+} mm_compaction_stats_t;
+
+/* Reports what compacting the family would work on, moves nothing.
+ * Returns 0 on success, -1 if the family is NULL */
+int mm_get_compaction_stats(mm_family_handle_t family, uint32_t max_occupancy, mm_compaction_stats_t *stats);
+
+/* Gives the family's idle pages back to the kernel and moves the objects
+ * of pages at most max_occupancy percent in use, sparsest pages first,
+ * for as long as the other pages have room. stats may be NULL. Returns 0
+ * on success, -1 if the family is NULL or has no relocator */
+int mm_compact_family(mm_family_handle_t family, uint32_t max_occupancy, mm_compaction_stats_t *stats);
+
+/* Sampling heap profiler. On average one allocation per sample_interval
+ * bytes is sampled, with its call stack. Costs one branch when off */
+#define MM_PROFILE_MAX_DEPTH 24
+
+typedef enum
+{
+    MM_PROFILE_ALLOC,
+    MM_PROFILE_FREE
+} mm_profile_event_type_t;
+
+typedef struct mm_profile_event_
+{
+    mm_profile_event_type_t type;
+    uint32_t depth;
+    void *app_data;
+    uint64_t size;   /* Bytes requested */
+    uint64_t weight; /* Estimated bytes allocated that the sample stands for */
+    const char *struct_name;
+    void *frames[MM_PROFILE_MAX_DEPTH]; /* Call stack of the allocation */
+} mm_profile_event_t;
+
+typedef enum
+{
+    MM_PROFILE_FORMAT_PPROF,    /* Legacy pprof heap profile text format */
+    MM_PROFILE_FORMAT_COLLAPSED /* One folded stack per line, for flame graphs */
+} mm_profile_format_t;
+
+/* Returns 0 on success, -1 if the profiler tables cannot be mapped */
+int mm_profile_start(uint64_t sample_interval);
+
+/* Stops sampling, samples still live stay in the profile until freed */
+void mm_profile_stop();
+
+/* Pops up to max_events traced events in order, returns how many */
+uint32_t mm_profile_read_events(mm_profile_event_t *events, uint32_t max_events);
+
+/* Writes the live samples to path, returns 0 on success, -1 otherwise.
+ * Collapsed stacks name functions exported with -rdynamic, pprof
+ * profiles carry raw addresses and the process mappings */
+int mm_profile_dump(char *path, mm_profile_format_t format);
+
+typedef enum
+{
+    MM_DEBUG_CANARIES = 1 << 0,
+    MM_DEBUG_GUARD_PAGES = 1 << 1,
+    MM_DEBUG_QUARANTINE = 1 << 2
+} mm_debug_flags_t;
+
+/* Debug mode for canary hosts. Canaries put a checked word after every
+ * object's payload, catching overruns and double frees when the object
+ * is freed. Guard pages map an inaccessible page right after every
+ * large object, which ends flush against it. Quarantine, which implies
+ * canaries, poisons freed objects and holds them back for a while so
+ * that writes after free are caught too, they count as in use until
+ * released. Problems are reported and abort the process. Set after
+ * mm_init() and before any family is registered, or through
+ * MM_DEBUG=canary,guard,quarantine in the environment. Returns 0 on
+ * success, -1 otherwise */
+int mm_set_debug(uint32_t flags);
+
+/* Walks the block pages of every family, checking block links, free
+ * lists and, in debug mode, canaries. Prints each problem found and
+ * returns how many there were */
+uint32_t mm_verify_heap();
+
 void mm_print_registered_page_families();
 
 void mm_print_memory_usage(char *struct_name);
@@ -29,4 +425,8 @@ void mm_print_memory_usage(char *struct_name);
 #define MEMORY_USAGE(struct_name) ( \
     mm_print_memory_usage(#struct_name))
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+#ifndef __UAPI_MM_HPP__
+#define __UAPI_MM_HPP__
+
+/* Typed C++ front-end. Every type gets its own page family, registered
+ * on first use under a name derived from the type, and allocates through
+ * the family handle without any name lookup. mm_init() must have been
+ * called before the first allocation */
+
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <new>
+#include <memory>
+#include <utility>
+#include "uapi_mm.h"
+
+namespace mm
+{
+
+/* Specialize with slab = true to serve single objects of T from slab pages */
+template <typename T>
+struct family_traits
+{
+    static constexpr bool slab = false;
+};
+
+namespace detail
+{
+
+/* Sizes are multiples of the alignment, which keeps objects aligned up
+ * to pointer alignment without any help. Families of more aligned
+ * types get their alignment set */
+constexpr std::size_t natural_alignment = alignof(void *);
+
+/* Family names are limited to 31 characters, so a truncated type name is
+ * kept readable for the usage dumps and a hash of the full one keeps it
+ * unique */
+template <typename T>
+inline const char *
+type_signature()
+{
+    return __PRETTY_FUNCTION__;
+}
+
+inline void
+make_family_name(const char *signature, char *name, std::size_t name_size)
+{
+    uint32_t hash = 2166136261u;
+    const char *type_name = signature, *curr = NULL;
+    std::size_t length = 0;
+    for (curr = signature; *curr; curr++)
+    {
+        hash ^= (unsigned char)*curr;
+        hash *= 16777619u;
+        if (curr[0] == 'T' && curr[1] == ' ' && curr[2] == '=' && curr[3] == ' ')
+            type_name = curr + 4;
+    }
+    while (type_name[length] && type_name[length] != ']' && type_name[length] != ';')
+        length++;
+    if (length > name_size - 10)
+        length = name_size - 10;
+    std::snprintf(name, name_size, "%.*s#%08x", (int)length, type_name, hash);
+}
+
+template <typename T>
+inline mm_family_handle_t
+register_family()
+{
+    char name[32];
+    make_family_name(type_signature<T>(), name, sizeof(name));
+    /* The type may already be registered by another shared object */
+    mm_family_handle_t handle = mm_get_family_handle(name);
+    if (handle)
+        return handle;
+    handle = mm_instantiate_new_page_family(name, sizeof(T));
+    if (handle && alignof(T) > natural_alignment)
+        handle = mm_page_family_set_alignment(handle, alignof(T));
+    if (handle && family_traits<T>::slab)
+        mm_page_family_enable_slab(handle);
+    return handle;
+}
+
+} // namespace detail
+
+template <typename T>
+inline mm_family_handle_t
+family_handle()
+{
+    static_assert(alignof(T) <= 4096, "mm: alignment beyond a page is not supported");
+    static const mm_family_handle_t handle = detail::register_family<T>();
+    return handle;
+}
+
+/* Stateless, every mm::allocator compares equal to every other one */
+template <typename T>
+class allocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type is_always_equal;
+
+    allocator() noexcept {}
+
+    template <typename U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *
+    allocate(std::size_t n)
+    {
+        if (n > INT_MAX)
+            throw std::bad_array_new_length();
+        void *app_data = xmalloc_by_handle(family_handle<T>(), n ? (int)n : 1);
+        if (!app_data)
+            throw std::bad_alloc();
+        return static_cast<T *>(app_data);
+    }
+
+    void
+    deallocate(T *app_data, std::size_t) noexcept
+    {
+        xfree(app_data);
+    }
+};
+
+template <typename T, typename U>
+inline bool
+operator==(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <typename T, typename U>
+inline bool
+operator!=(const allocator<T> &, const allocator<U> &) noexcept
+{
+    return false;
+}
+
+template <typename T>
+struct deleter
+{
+    void
+    operator()(T *app_data) const noexcept
+    {
+        app_data->~T();
+        xfree(app_data);
+    }
+};
+
+template <typename T>
+using unique_ptr = std::unique_ptr<T, deleter<T>>;
+
+template <typename T, typename... Args>
+inline unique_ptr<T>
+make(Args &&...args)
+{
+    void *app_data = xmalloc_by_handle(family_handle<T>(), 1);
+    if (!app_data)
+        throw std::bad_alloc();
+    try
+    {
+        return unique_ptr<T>(new (app_data) T(std::forward<Args>(args)...));
+    }
+    catch (...)
+    {
+        xfree(app_data);
+        throw;
+    }
+}
+
+} // namespace mm
+
+#endif